@@ -0,0 +1,314 @@
+/**
+ * Host benchmark for the motor controller's pure logic
+ *
+ * Builds motion_math.h and frame_parser.h exactly as the firmware does,
+ * checks their results, and times them on the development machine, so
+ * planner, step and parser changes can be compared before flashing. Run
+ * with:
+ *
+ *     pio run -e native -t exec
+ *
+ * Exits non-zero if a check fails or a timing goes over its BUDGET_*.
+ * Numbers are host timings: compare them between builds, not against the
+ * ESP32 (use get_stats on the board for that).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <ArduinoJson.h>
+#include "motion_config.h"
+#include "motion_math.h"
+#include "frame_parser.h"
+
+// Timing budgets for an -O2 host build, several times the figures of a
+// typical development machine: only a real regression should trip them
+#define BUDGET_STEP_NS      20.0    // Per Bresenham step event
+#define BUDGET_SEGMENT_US   0.5     // Per planned segment
+#define BUDGET_FRAME_NS     2000.0  // Per 9-point binary path frame
+#define BUDGET_JSON_US      20.0    // Per JSON path command
+
+// Keeps results alive so the optimizer can't drop the work being timed
+volatile uint32_t sink;
+int failures = 0;
+
+static double elapsedSeconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void check(bool ok, const char* what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void checkBudget(double measured, double budget, const char* what) {
+    if (measured > budget) {
+        printf("FAIL: %s %.3f over budget %.3f\n", what, measured, budget);
+        failures++;
+    }
+}
+
+// ==================== CHECKS ====================
+
+static void checkKinematics() {
+    // Inverse then forward kinematics returns the Cartesian position,
+    // including the half steps of an odd A + B
+    bool ok = true;
+    for (long x = -400; x <= 32000; x += 401) {
+        for (long y = -400; y <= 32000; y += 397) {
+            long stepsA, stepsB;
+            float mmX, mmY;
+            calculateHBotSteps(x, y, stepsA, stepsB);
+            calculateHBotPosition(stepsA, stepsB, STEPS_PER_MM, mmX, mmY);
+            ok &= fabsf(mmX - (float)x / STEPS_PER_MM) < 1e-3f &&
+                  fabsf(mmY - (float)y / STEPS_PER_MM) < 1e-3f;
+        }
+    }
+    check(ok, "H-Bot inverse/forward round trip");
+}
+
+static void checkStepBlock() {
+    // Every motor steps exactly its share of a block, in the right
+    // direction, and the ticks run out together
+    const long blocks[][2] = {{1000, 1000}, {1000, -1}, {-7, 3000}, {1234, -999}, {0, 5}, {-1, -1}};
+    bool ok = true;
+    for (const auto& steps : blocks) {
+        uint32_t ticks = std::max(labs(steps[0]), labs(steps[1]));
+        StepBlock block;
+        loadStepBlock(block, steps[0], steps[1], ticks);
+        long a = 0, b = 0;
+        for (uint32_t t = 0; t < ticks; t++) {
+            uint8_t step = stepBlockTick(block);
+            a += (step & STEP_A) ? block.dirA : 0;
+            b += (step & STEP_B) ? block.dirB : 0;
+        }
+        ok &= a == steps[0] && b == steps[1] && block.ticksLeft == 0 && stepBlockTick(block) == 0;
+    }
+    check(ok, "Bresenham step totals");
+}
+
+static void checkProfile() {
+    // Segments cover the block exactly and stay within the speed limits
+    const float dt = SEGMENT_US / 1000000.0f;
+    bool ok = true;
+    for (uint32_t ticks : {1u, 50u, 4000u, 60000u}) {
+        for (bool sCurve : {false, true}) {
+            MotionProfile profile;
+            ProfileCursor cursor = {0, 0.0f, 0.0f};
+            planProfile(profile, ticks, START_SPEED, DEFAULT_SPEED, START_SPEED, ACCELERATION, sCurve);
+            uint32_t planned = 0;
+            while (cursor.ticksPlanned < profile.ticks) {
+                uint32_t intervalUs;
+                planned += nextSegment(profile, cursor, dt, START_SPEED, MAX_SPEED, intervalUs);
+                ok &= intervalUs >= 1000000 / MAX_SPEED && intervalUs <= 1000000 / START_SPEED;
+            }
+            ok &= planned == ticks && profile.cruiseSpeed <= DEFAULT_SPEED + 0.5f;
+        }
+    }
+    check(ok, "profile segments cover the block within the speed limits");
+}
+
+static void checkFrames() {
+    // CRC16-CCITT check value, and a frame parsed whole or rejected on a
+    // flipped bit
+    uint16_t crc = 0xFFFF;
+    for (const char* c = "123456789"; *c; c++) {
+        crc = crc16Update(crc, *c);
+    }
+    check(crc == 0x29B1, "CRC16-CCITT of \"123456789\"");
+    
+    // home (0x10), no payload
+    const uint8_t frame[] = {FRAME_SYNC, 0x01, 0x10, 0x0F, 0x3C};
+    uint16_t frameCrc = crc16Update(crc16Update(0xFFFF, frame[1]), frame[2]);
+    check(frameCrc == (frame[3] | frame[4] << 8), "CRC of a known frame");
+    
+    FrameParser parser = {};
+    FrameStatus status = FRAME_TEXT;
+    for (uint8_t c : frame) {
+        status = parser.feed(c, 0);
+    }
+    check(status == FRAME_READY && parser.data[0] == 0x10, "known frame parsed");
+    
+    for (size_t i = 0; i < sizeof(frame); i++) {
+        status = parser.feed(i == 2 ? frame[i] ^ 0x01 : frame[i], 0);
+    }
+    check(status == FRAME_BAD_CRC, "corrupted frame rejected");
+}
+
+// ==================== STEP EVENTS ====================
+
+static double benchStepEvents() {
+    // A knight-like zig-zag across the board, in Cartesian steps
+    const long path[][2] = {
+        {0, 0}, {4000, 2000}, {8000, 0}, {12000, 6000}, {16000, 4000},
+        {8000, 16000}, {0, 12000}, {6000, 6000}, {0, 0}
+    };
+    const int points = sizeof(path) / sizeof(path[0]);
+    const int rounds = 200;
+    
+    StepBlock block;
+    uint64_t stepEvents = 0;
+    uint32_t motorSteps = 0;
+    auto start = std::chrono::steady_clock::now();
+    
+    for (int round = 0; round < rounds; round++) {
+        long a = 0, b = 0;
+        for (int i = 1; i < points; i++) {
+            long targetA, targetB;
+            calculateHBotSteps(path[i][0], path[i][1], targetA, targetB);
+            long stepsA = targetA - a;
+            long stepsB = targetB - b;
+            uint32_t ticks = std::max(labs(stepsA), labs(stepsB));
+            
+            loadStepBlock(block, stepsA, stepsB, ticks);
+            for (uint32_t t = 0; t < ticks; t++) {
+                uint8_t steps = stepBlockTick(block);
+                motorSteps += (steps & STEP_A) + ((steps & STEP_B) >> 1);
+            }
+            stepEvents += ticks;
+            a = targetA;
+            b = targetB;
+        }
+    }
+    
+    double seconds = elapsedSeconds(start);
+    sink = motorSteps;
+    printf("step events:   %10.0f ticks/s  (%.1f ns/tick, %llu ticks)\n",
+           stepEvents / seconds, seconds * 1e9 / stepEvents, (unsigned long long)stepEvents);
+    return seconds * 1e9 / stepEvents;
+}
+
+// ==================== PLANNER ====================
+
+static double benchPlanner() {
+    // Blocks of mixed length and corner angle, profiled and sliced into
+    // segments the way beginNextProfile()/prepareSegments() do
+    const float dt = SEGMENT_US / 1000000.0f;
+    const int blocks = 2000;
+    
+    MotionProfile profile;
+    ProfileCursor cursor;
+    uint64_t segments = 0;
+    uint64_t ticksTotal = 0;
+    uint64_t ticksExpected = 0;
+    float prevUX = 1.0f, prevUY = 0.0f;
+    auto start = std::chrono::steady_clock::now();
+    
+    for (int i = 0; i < blocks; i++) {
+        float angle = (i % 16) * 0.3927f;  // 22.5 degree turns
+        float ux = cosf(angle), uy = sinf(angle);
+        float corner = junctionSpeed(prevUX, prevUY, ux, uy,
+                                     ACCELERATION / (float)STEPS_PER_MM, JUNCTION_DEVIATION);
+        float entry = std::min(corner * STEPS_PER_MM, (float)DEFAULT_SPEED);
+        uint32_t ticks = 200 + (i % 50) * 400;
+        
+        planProfile(profile, ticks, std::max(entry, (float)START_SPEED), DEFAULT_SPEED,
+                    START_SPEED, ACCELERATION, (i & 1) != 0);
+        cursor = {0, 0.0f, 0.0f};
+        ticksExpected += ticks;
+        while (cursor.ticksPlanned < profile.ticks) {
+            uint32_t intervalUs;
+            ticksTotal += nextSegment(profile, cursor, dt, START_SPEED, MAX_SPEED, intervalUs);
+            segments++;
+        }
+        prevUX = ux;
+        prevUY = uy;
+    }
+    
+    double seconds = elapsedSeconds(start);
+    sink = ticksTotal;
+    printf("planner:       %10.3f us/segment  (%llu segments, %d blocks)\n",
+           seconds * 1e6 / segments, (unsigned long long)segments, blocks);
+    check(ticksTotal == ticksExpected, "planner segments add up to the block ticks");
+    return seconds * 1e6 / segments;
+}
+
+// ==================== PARSERS ====================
+
+static size_t buildFrame(uint8_t* out, uint8_t opcode, const uint8_t* payload, uint8_t len) {
+    out[0] = FRAME_SYNC;
+    out[1] = len + 1;
+    out[2] = opcode;
+    memcpy(out + 3, payload, len);
+    uint16_t crc = 0xFFFF;
+    for (int i = 1; i < len + 3; i++) {
+        crc = crc16Update(crc, out[i]);
+    }
+    out[len + 3] = crc & 0xFF;
+    out[len + 4] = crc >> 8;
+    return len + 5;
+}
+
+static double benchFrameParser() {
+    // A 9-point path frame, the largest command the backend sends often
+    uint8_t payload[2 + 9 * 4];
+    for (size_t i = 0; i < sizeof(payload); i++) {
+        payload[i] = (uint8_t)(i * 37);
+    }
+    uint8_t frame[FRAME_MAX_LEN + 5];
+    size_t frameLen = buildFrame(frame, 0x13, payload, sizeof(payload));
+    
+    const int frames = 500000;
+    FrameParser parser = {};
+    uint32_t ready = 0;
+    auto start = std::chrono::steady_clock::now();
+    
+    for (int i = 0; i < frames; i++) {
+        for (size_t j = 0; j < frameLen; j++) {
+            ready += parser.feed(frame[j], 0) == FRAME_READY;
+        }
+    }
+    
+    double seconds = elapsedSeconds(start);
+    sink = ready;
+    printf("binary frames: %10.0f frames/s  (%.1f MB/s)\n",
+           frames / seconds, frames * frameLen / seconds / 1e6);
+    check(ready == (uint32_t)frames, "every benchmark frame parsed");
+    return seconds * 1e9 / frames;
+}
+
+static double benchJsonParser() {
+    const char* line = "{\"cmd\":\"path\",\"speed\":4000,\"points\":[[25,25],[75,75],"
+                       "[125,25],[175,75],[225,25],[275,75],[325,25],[375,75],[400,400]]}";
+    const size_t lineLen = strlen(line);
+    const int lines = 200000;
+    
+    StaticJsonDocument<2048> doc;
+    uint32_t points = 0;
+    auto start = std::chrono::steady_clock::now();
+    
+    for (int i = 0; i < lines; i++) {
+        if (deserializeJson(doc, line, lineLen) == DeserializationError::Ok) {
+            points += doc["points"].size();
+        }
+    }
+    
+    double seconds = elapsedSeconds(start);
+    sink = points;
+    printf("JSON commands: %10.0f lines/s  (%.1f MB/s)\n",
+           lines / seconds, lines * lineLen / seconds / 1e6);
+    check(points == (uint32_t)lines * 9, "every benchmark JSON path parsed");
+    return seconds * 1e6 / lines;
+}
+
+int main() {
+    printf("Motor controller benchmark\n");
+    checkKinematics();
+    checkStepBlock();
+    checkProfile();
+    checkFrames();
+    
+    checkBudget(benchStepEvents(), BUDGET_STEP_NS, "ns/step event");
+    checkBudget(benchPlanner(), BUDGET_SEGMENT_US, "us/segment");
+    checkBudget(benchFrameParser(), BUDGET_FRAME_NS, "ns/binary frame");
+    checkBudget(benchJsonParser(), BUDGET_JSON_US, "us/JSON command");
+    
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
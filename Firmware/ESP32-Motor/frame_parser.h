@@ -0,0 +1,89 @@
+/**
+ * Binary frame parser for the Pi link
+ *
+ * Frame: [SYNC][LEN][OPCODE][PAYLOAD...][CRC16 lo][CRC16 hi]
+ * LEN counts OPCODE + PAYLOAD; CRC16-CCITT (init 0xFFFF) covers LEN..PAYLOAD.
+ *
+ * Plain C++ with no Arduino dependencies, so the native benchmark in
+ * bench/ builds it on the host. The sensor firmware has the same file.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define FRAME_SYNC          0xA5    // Never the first byte of a JSON line
+#define FRAME_MAX_LEN       255
+#define FRAME_TIMEOUT_MS    20      // Drop a partial frame after this gap
+
+enum FrameStatus : uint8_t {
+    FRAME_TEXT,             // Not part of a frame, belongs to the JSON line buffer
+    FRAME_PENDING,          // Consumed, frame not complete yet
+    FRAME_READY,            // Complete with a good CRC: data[0] opcode, then payload
+    FRAME_BAD_CRC           // Complete but corrupted, dropped
+};
+
+inline uint16_t crc16Update(uint16_t crc, uint8_t data) {
+    // CRC16-CCITT (poly 0x1021), init 0xFFFF
+    crc ^= (uint16_t)data << 8;
+    for (int i = 0; i < 8; i++) {
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+struct FrameParser {
+    uint8_t state;          // 0 = idle, 1 = length, 2 = body, 3/4 = CRC bytes
+    uint8_t length;
+    uint16_t pos;
+    uint16_t crc;           // Computed over LEN..PAYLOAD
+    uint16_t rxCrc;         // Received from the frame
+    uint8_t data[FRAME_MAX_LEN];
+    unsigned long lastByteTime;
+    
+    FrameStatus feed(uint8_t c, unsigned long now) {
+        /**
+         * Feed one received byte, 'now' in ms. A partial frame older than
+         * FRAME_TIMEOUT_MS is dropped first, so a lost byte can't swallow
+         * the next command. A zero LEN byte is consumed and ends the frame.
+         */
+        if (state != 0 && now - lastByteTime > FRAME_TIMEOUT_MS) {
+            state = 0;  // Stale partial frame
+        }
+        lastByteTime = now;
+        
+        switch (state) {
+            case 0:
+                if (c != FRAME_SYNC) return FRAME_TEXT;
+                state = 1;
+                return FRAME_PENDING;
+            
+            case 1:
+                if (c == 0) {
+                    state = 0;
+                    return FRAME_PENDING;
+                }
+                length = c;
+                pos = 0;
+                crc = crc16Update(0xFFFF, c);
+                state = 2;
+                return FRAME_PENDING;
+            
+            case 2:
+                data[pos++] = c;
+                crc = crc16Update(crc, c);
+                if (pos == length) state = 3;
+                return FRAME_PENDING;
+            
+            case 3:
+                rxCrc = c;
+                state = 4;
+                return FRAME_PENDING;
+            
+            default:
+                state = 0;
+                rxCrc |= (uint16_t)c << 8;
+                return rxCrc == crc ? FRAME_READY : FRAME_BAD_CRC;
+        }
+    }
+};
@@ -3,10 +3,25 @@
  * 
  * Responsibilities:
  * - Control 2x TMC2226 stepper drivers for H-Bot gantry system
- * - Electromagnet control (4x electromagnets via MOSFETs)
- * - Limit switch homing
+ * - Electromagnet control (4x electromagnets via MOSFETs, PWM kick-and-hold)
+ * - Two-phase (fast seek, slow latch) limit switch homing of both axes
+ * - StallGuard stall detection and optional sensorless homing (DIAG pins)
+ * - Motor current scaling: boost while accelerating, hold when idle
+ * - Closed-loop fan control from driver temperature flags (and a thermistor)
+ * - Step pulse generation from a hardware timer interrupt
+ * - Trapezoidal / S-curve acceleration planning
+ * - Multi-waypoint motion queue with look-ahead corner blending
+ * - Coordinated (Bresenham) interpolation of both motors
  * - PWM fan control (4x fans)
- * - Communicate with Raspberry Pi via UART (JSON protocol)
+ * - Communicate with Raspberry Pi via UART (JSON or binary framed protocol)
+ * - Calibration and tuning kept in NVS; warm boot from a parked position
+ * 
+ * Tasks:
+ * - Core 0: motionTask() - planner, homing and the step timer interrupt
+ * - Core 1: loop() - UART protocol and status reporting
+ * - Core 1: thermalTask() - low priority, fan curve from driver temperatures
+ * - Commands and reports cross between them through lock-free SPSC queues;
+ *   stop also raises a flag the step ISR checks on its next tick
  * 
  * Hardware:
  * - ESP32-S3 DevKit C-1
@@ -14,7 +29,7 @@
  * - 2x NEMA17 stepper motors (0.7A)
  * - 4x P25/20 electromagnets (12V)
  * - 4x IRFL44N MOSFETs for electromagnet switching
- * - 1x Limit switch (for homing)
+ * - 2x Limit switches (X and Y minimum, for homing)
  * - 4x Arctic S4028-6K fans (40mm, PWM)
  * - TXS0108E Level Shifter for fan PWM
  * 
@@ -27,6 +42,52 @@
 #include <Arduino.h>
 #include <TMCStepper.h>
 #include <ArduinoJson.h>
+#include <Preferences.h>
+#include "soc/gpio_struct.h"
+#include <atomic>
+#include <stdarg.h>
+#include "frame_parser.h"
+#include "motion_config.h"
+#include "motion_math.h"
+
+// ==================== LOGGING ====================
+
+// Debug output on Serial, leveled like the Arduino core's log_x() and
+// driven by the same CORE_DEBUG_LEVEL build flag (see platformio.ini):
+// 0 = none, 1 = error, 2 = warning, 3 = info, 4 = debug, 5 = verbose.
+// Calls above the build level compile to nothing, arguments included.
+#ifndef CORE_DEBUG_LEVEL
+#define CORE_DEBUG_LEVEL    0
+#endif
+
+#define LOG_BUFFER_SIZE     2048    // Debug ring buffer (power of two), drained by loop()
+#define LOG_LINE_MAX        128     // Longest formatted line, longer ones are cut
+
+#if CORE_DEBUG_LEVEL >= 1
+#define LOG_E(...)          logPrintf('E', __VA_ARGS__)
+#else
+#define LOG_E(...)          do {} while (0)
+#endif
+#if CORE_DEBUG_LEVEL >= 2
+#define LOG_W(...)          logPrintf('W', __VA_ARGS__)
+#else
+#define LOG_W(...)          do {} while (0)
+#endif
+#if CORE_DEBUG_LEVEL >= 3
+#define LOG_I(...)          logPrintf('I', __VA_ARGS__)
+#else
+#define LOG_I(...)          do {} while (0)
+#endif
+#if CORE_DEBUG_LEVEL >= 4
+#define LOG_D(...)          logPrintf('D', __VA_ARGS__)
+#else
+#define LOG_D(...)          do {} while (0)
+#endif
+#if CORE_DEBUG_LEVEL >= 5
+#define LOG_V(...)          logPrintf('V', __VA_ARGS__)
+#else
+#define LOG_V(...)          do {} while (0)
+#endif
 
 // ==================== PIN DEFINITIONS ====================
 
@@ -37,6 +98,7 @@
 #define MOTOR_A_EN_PIN      4
 #define MOTOR_A_TX_PIN      5   // ESP32 TX to TMC2226
 #define MOTOR_A_RX_PIN      6   // ESP32 RX from TMC2226
+#define MOTOR_A_DIAG_PIN    13  // StallGuard DIAG output (active HIGH)
 
 // Motor B (Y-axis component)
 #define MOTOR_B_STEP_PIN    7
@@ -44,6 +106,7 @@
 #define MOTOR_B_EN_PIN      9
 #define MOTOR_B_TX_PIN      10  // ESP32 TX to TMC2226
 #define MOTOR_B_RX_PIN      11  // ESP32 RX from TMC2226
+#define MOTOR_B_DIAG_PIN    14  // StallGuard DIAG output (active HIGH)
 
 // Electromagnets (via MOSFETs, active HIGH)
 #define MAGNET_1_PIN        16
@@ -51,8 +114,9 @@
 #define MAGNET_3_PIN        18
 #define MAGNET_4_PIN        19
 
-// Limit switch (active LOW with pullup)
-#define LIMIT_SWITCH_PIN    32
+// Limit switches at the X and Y minimum (active LOW with pullup)
+#define LIMIT_SWITCH_PIN    32      // X axis
+#define LIMIT_SWITCH_Y_PIN  12      // Y axis
 
 // PWM Fan control (via level shifter to 5V)
 #define FAN_1_PIN           25
@@ -60,10 +124,58 @@
 #define FAN_3_PIN           27
 #define FAN_4_PIN           33
 
+// Optional NTC thermistor (10k, B3950) to GND with a 10k pullup, on an ADC
+// pin near the drivers; -1 = not fitted
+#define THERMISTOR_PIN      -1
+
 // UART communication with Raspberry Pi
 #define UART_RX_PIN         1   // RX from Pi
 #define UART_TX_PIN         3   // TX to Pi
 #define UART_BAUD           115200
+#define UART_RX_BUFFER      1024    // Driver ring buffer, filled by the UART RX ISR
+#define LINE_BUFFER_SIZE    512     // Longest JSON command line accepted
+#define MAX_UART_BAUD       2000000 // Upper limit for set_baud
+#define BAUD_CONFIRM_MS     1000    // Revert an unconfirmed rate change after this
+#define BAUD_ERROR_LIMIT    3       // Consecutive bad frames/lines before falling back
+#define STATS_BUCKETS       14      // get_stats histogram: <1 us, then powers of two up to >= 4 ms
+#define TELEMETRY_MAX_HZ    100     // Upper limit for set_telemetry
+
+// ==================== BINARY PROTOCOL ====================
+
+// Frame: [SYNC][LEN][OPCODE][PAYLOAD...][CRC16 lo][CRC16 hi]
+// LEN counts OPCODE + PAYLOAD; CRC16-CCITT covers LEN..PAYLOAD
+// (parser and FRAME_* limits in frame_parser.h).
+// Multi-byte fields are little-endian, positions are in 0.1 mm.
+// A command wrapped in OP_SEQ is answered with OP_ACK on receipt, then
+// exactly one OP_DONE or OP_ERROR once it has finished (see beginCommand()).
+
+// Pi -> motor controller
+#define OP_SET_PROTOCOL     0x01    // u8 mode (0 = JSON, 1 = binary)
+#define OP_SET_BAUD         0x02    // u32 baud
+#define OP_BAUD_TEST        0x03    // Test pattern, echoed back; empty = confirm
+#define OP_SEQ              0x04    // u16 seq (1-65535), then a command's opcode + payload
+#define OP_HOME             0x10
+#define OP_MOVE_ABSOLUTE    0x11    // i16 x, i16 y, u16 speed (0 = keep)
+#define OP_MOVE_RELATIVE    0x12    // i16 dx, i16 dy
+#define OP_PATH             0x13    // u16 speed (0 = keep), N x (i16 x, i16 y)
+#define OP_STOP             0x14
+#define OP_GET_POSITION     0x15
+#define OP_MAGNET           0x16    // u8 magnet (0 = all, 1-4), u8 on
+#define OP_SET_FAN          0x17    // u8 fan (1-4), [u8 pwm] (no pwm = automatic)
+#define OP_SET_STALL        0x18    // u8 flags (bit0 detect, bit1 sensorless homing), u8 threshold
+#define OP_SET_CURRENT      0x19    // u16 run, u16 hold, u16 boost (mA RMS), u16 hold delay ms (0 = keep)
+#define OP_SET_TELEMETRY    0x1A    // u8 rate (Hz, 0 = off)
+#define OP_MAGNET_PATH      0x1B    // u16 speed (0 = keep), N x (i16 x, i16 y, u8 magnets), 0xFF = keep
+#define OP_SET_MAGNET_POWER 0x1C    // u8 magnet (0 = all), u8 hold %, u16 kick ms (0 = keep)
+
+// Motor controller -> Pi
+#define OP_STATUS           0x80    // status '\0' [message]
+#define OP_POSITION         0x81    // i16 x, i16 y, u8 homed
+#define OP_STALL            0x82    // i16 x, i16 y, u8 motors (bit0 A, bit1 B)
+#define OP_ACK              0x83    // u16 seq: command received
+#define OP_DONE             0x84    // u16 seq: command finished (moves: target reached)
+#define OP_ERROR            0x85    // u16 seq, message: command failed or was aborted
+#define OP_TELEMETRY        0x86    // u32 time ms, i16 x, i16 y, i16 vx, i16 vy (mm/s), u8 queued, u8 flags
 
 // ==================== MOTOR CONFIGURATION ====================
 
@@ -71,25 +183,87 @@
 #define MOTOR_A_ADDRESS     0b00  // Both MS pins LOW
 #define MOTOR_B_ADDRESS     0b01  // MS1_AD0 HIGH, MS2_AD1 LOW
 
-// Stepper motor specs
-#define STEPS_PER_REV       200     // 1.8° stepper
-#define MICROSTEPS          16      // TMC2226 microstepping
-#define STEPS_PER_MM        80      // Steps per mm (configure based on pulley size)
+// Stepper specs, speeds and planner tuning: motion_config.h (shared with
+// the host benchmark)
+#define MAX_STEP_RATE       20000   // Ceiling for max_speed in set_config (step ISR budget)
+#define HOMING_SPEED        500     // Slow re-approach that latches the switch edge
+#define HOMING_SEEK_SPEED   3000    // Fast approach to find the switch (ramped)
+#define HOMING_BACKOFF_MM   3.0     // Retreat after the seek, before the slow latch
+#define HOMING_PULLOFF_MM   1.0     // Final clearance from the switch, becomes 0
 
-// Speed settings (steps/second)
-#define DEFAULT_SPEED       2000    // Default movement speed
-#define MAX_SPEED           8000    // Maximum speed
-#define HOMING_SPEED        500     // Slower speed for homing
-#define ACCELERATION        2000    // Steps/second²
+// Magnet-aware moves (moves that say whether they carry a piece)
+#define CARRY_SPEED         3000    // Steps/s cap while dragging a piece
+#define CARRY_ACCELERATION  1000    // Steps/s², S-curve, so the piece stays coupled
+#define MAGNET_ENGAGE_MS    200     // Hold still after a magnet turns on, before carrying
+#define MAGNET_RELEASE_MS   100     // Hold still after a magnet turns off, before leaving
+#define MAGNETS_ALL         0x0F    // Magnet mask: bit n = magnet n + 1
+#define MAGNETS_KEEP        -1      // Move leaves the magnets (and speed limits) alone
+
+// Magnet drive (LEDC PWM): full power to pull a piece in, then a lower
+// duty holds it with far less current through the coil and MOSFET
+#define MAGNET_PWM_CHANNEL  4       // Magnets 1-4 on LEDC channels 4-7 (timers 2/3, fans use 0/1)
+#define MAGNET_PWM_FREQ     5000    // Hz, low enough for the GPIO-driven MOSFET gates
+#define MAGNET_PWM_BITS     8
+#define MAGNET_DUTY_MAX     255     // (1 << MAGNET_PWM_BITS) - 1
+#define MAGNET_KICK_MS      150     // Full-power pull-in after switching on
+#define MAGNET_HOLD_DUTY    40      // % of full power once pulled in
 
 // Current limits (RMS current in mA)
 #define MOTOR_CURRENT_RUN   500     // 0.7A * 0.707 ≈ 500mA RMS
 #define MOTOR_CURRENT_HOLD  200     // Lower current when holding
+#define MOTOR_CURRENT_BOOST 600     // While accelerating from rest
+#define HOLD_DELAY_MS       500     // Standstill time before dropping to hold current
+
+// StallGuard4 (StealthChop only, which is what the drivers run)
+#define STALL_DETECTION     true    // Abort and report a stall mid-move
+#define SENSORLESS_HOMING   false   // Home against the end stops instead of the switches
+#define STALL_THRESHOLD     80      // SGTHRS, 0-255: higher trips more easily
+#define STALL_MIN_SPEED     1000    // Steps/s; StallGuard is unreliable below this
+#define STALL_TCOOLTHRS     (12000000UL * MICROSTEPS / (256UL * STALL_MIN_SPEED))  // TSTEP at STALL_MIN_SPEED
+#define DIAG_MASK           ((1UL << MOTOR_A_DIAG_PIN) | (1UL << MOTOR_B_DIAG_PIN))
+
+// Step generation (hardware timer ISR)
+#define STEP_TIMER_INDEX    0       // Hardware timer used for step pulses
+#define STEP_TIMER_DIVIDER  80      // 80 MHz APB / 80 = 1 MHz (1 µs per tick)
+#define STEP_PULSE_US       2       // STEP high time (TMC2226 needs >100 ns)
+#define SEGMENT_BUFFER_SIZE 32      // Queued segments (~80 ms of motion)
+
+// Motion queue / look-ahead planner
+#define BLOCK_QUEUE_SIZE    16      // Queued waypoints (look-ahead depth)
+#define COMMAND_QUEUE_SIZE  64      // loop() -> motion task (a full path frame fits)
+#define MAX_PATH_POINTS     (COMMAND_QUEUE_SIZE - 1)  // A path is queued whole
+// Motion task -> loop(): room for an abort per queued command and block
+// plus status events, so a stop never leaves the motion task waiting on loop()
+#define EVENT_QUEUE_SIZE    (COMMAND_QUEUE_SIZE + BLOCK_QUEUE_SIZE + 8)
+
+// Motion task
+#define MOTION_TASK_CORE     0      // Away from loop() and the UART
+#define MOTION_TASK_PRIORITY 5      // Above loop() (1) so segments never starve
+
+// Thermal fan control
+#define THERMAL_TASK_CORE    1
+#define THERMAL_TASK_PRIORITY 1     // Same as loop(), far below motion
+#define THERMAL_INTERVAL_MS  1000   // Driver status poll period
+#define FAN_MIN_PWM          80     // Idle airflow over the drivers
+#define FAN_WARM_PWM         160    // A driver reports >120°C (pre-warning)
+#define FAN_HOT_PWM          220    // A driver reports >143°C
+#define FAN_MAX_PWM          255    // >150°C or overtemperature shutdown
+#define FAN_RAMP_DOWN        8      // PWM lost per poll when cooling, avoids hunting
+#define FAN_TEMP_LOW         35.0   // °C, thermistor curve: FAN_MIN_PWM at or below
+#define FAN_TEMP_HIGH        60.0   // °C, thermistor curve: FAN_MAX_PWM at or above
 
 // Board dimensions (in mm)
 #define MAX_X_MM            400.0
 #define MAX_Y_MM            400.0
 
+// Persistent configuration (NVS): everything above that set_config can
+// change is only a default
+#define CONFIG_NAMESPACE    "motor"
+#define CONFIG_VERSION      1       // Bump when MotorConfig changes; other versions are ignored
+#define WARM_BOOT           true    // Trust a cleanly parked position after a reset
+#define PARK_DELAY_MS       1000    // Idle time before the position is saved as parked
+#define PARK_RTC_MAGIC      0x5041524BUL    // "PARK": parkRecord is valid
+
 // ==================== GLOBAL VARIABLES ====================
 
 // Hardware Serial for TMC2226 communication
@@ -112,84 +286,550 @@ float currentPosY = 0.0;
 long targetStepsX = 0;
 long targetStepsY = 0;
 
-// Movement state
+// End of the last queued waypoint (in steps); relative moves start here
+long plannerStepsX = 0;
+long plannerStepsY = 0;
+
+// Movement state (owned by motionTask; isHomed is also read by loop())
 bool isMoving = false;
-bool isHomed = false;
+volatile bool isHomed = false;
 
 // Speed and acceleration
 float currentSpeed = DEFAULT_SPEED;
-unsigned long stepDelay = 1000000 / DEFAULT_SPEED; // microseconds
+float currentAccel = ACCELERATION;
+bool sCurveEnabled = S_CURVE_ACCEL;
+
+// Calibration and limits: build defaults until loadConfig() / set_config.
+// Positions are in board coordinates: the homed position is at
+// (-originX, -originY), so (0, 0) is wherever the board origin was measured.
+float stepsPerMm = STEPS_PER_MM;
+float maxSpeed = MAX_SPEED;
+float carrySpeed = CARRY_SPEED;
+float carryAccel = CARRY_ACCELERATION;
+float travelX = MAX_X_MM;           // Reachable travel from the homed position
+float travelY = MAX_Y_MM;
+float originX = 0.0f;               // Board origin, mm from the homed position
+float originY = 0.0f;
+bool warmBoot = WARM_BOOT;
+
+// One queued straight-line move. Speeds are Cartesian (mm/s) so corner
+// speeds stay consistent between blocks with different motor step ratios.
+struct PlannerBlock {
+    long stepsA;            // Signed motor steps for this block
+    long stepsB;
+    uint32_t ticks;         // Step ticks (= steps of the dominant motor)
+    float millimeters;      // Cartesian length
+    float unitX;            // Cartesian direction
+    float unitY;
+    float mmPerTick;        // Converts tick rates to mm/s
+    float nominalSpeed;     // mm/s
+    float accel;            // mm/s²
+    float maxEntrySpeed;    // mm/s, limited by the junction with the previous block
+    float entrySpeed;       // mm/s, planned
+    bool sCurve;
+    int8_t magnets;         // Magnet mask the ISR switches to at block start, MAGNETS_KEEP
+    uint32_t dwellUs;       // Magnet switch: hold after switching (0 = move)
+    uint16_t seq;           // Tagged command that ends with this block (0 = none)
+};
+
+// One slice of the velocity profile: 'ticks' step ticks at a fixed interval.
+// Segments are computed by the motion task (floats allowed) and consumed by
+// the ISR, both on MOTION_TASK_CORE.
+struct StepSegment {
+    uint16_t ticks;
+    uint32_t intervalUs;
+    uint8_t block;          // Index into blockQueue
+    bool newBlock;          // First segment of the block: load steps and DIR
+};
+
+// Motion queue (owned by the motion task; loop() only reaches it through
+// motionCommands. A block is read-only once its first segment has been
+// prepared)
+PlannerBlock blockQueue[BLOCK_QUEUE_SIZE];
+uint8_t blockHead = 0;              // Next free slot
+uint8_t blockTail = 0;              // Oldest block not yet retired
+uint8_t prepBlock = 0;              // Block being (or next to be) sliced into segments
+bool prepActive = false;            // activeProfile belongs to prepBlock
+float lockedExitSpeed = 0.0;        // mm/s exit of the last block already sliced
+uint8_t plannerMagnets = 0;         // Magnet mask once every queued block has run
+
+// Step generator state (shared with the timer ISR, guarded by stepperMux)
+// Each move is precomputed into a StepBlock in motor space (see
+// motion_math.h); the ISR only counts it down, so pulse timing doesn't
+// depend on what the motion task or loop() is doing.
+hw_timer_t* stepTimer = nullptr;
+portMUX_TYPE stepperMux = portMUX_INITIALIZER_UNLOCKED;
+StepBlock activeBlock = {0, 0, 0, 0, 0, 0, 1, 1};
+StepSegment segmentBuffer[SEGMENT_BUFFER_SIZE];
+volatile uint8_t segmentHead = 0;   // Written by the motion task
+volatile uint8_t segmentTail = 0;   // Written by the ISR
+volatile bool segmentsFinal = true; // Every queued block has been sliced
+uint16_t segmentTicksLeft = 0;      // Ticks left in the segment being executed
+volatile uint8_t executingBlock = 0; // Block the ISR is stepping
+MotionProfile activeProfile;
+ProfileCursor profileCursor;
+volatile bool stepperBusy = false;
+volatile long motorStepsA = 0;      // Absolute motor positions (in steps)
+volatile long motorStepsB = 0;
+uint32_t stepPulseCycles = 0;       // STEP_PULSE_US in CPU cycles
+
+// Stop handshake: loop() bumps stopRequests, the motion task bumps
+// stopsHandled once it has flushed. While they differ the ISR makes no
+// steps and queued commands older than the stop are discarded.
+volatile uint32_t stopRequests = 0;
+volatile uint32_t stopsHandled = 0;
+
+// Binary path frames can't carry more points than fit in the queue
+static_assert((FRAME_MAX_LEN - 3) / 4 <= MAX_PATH_POINTS, "A full path frame fits the command queue");
+
+// Single-producer single-consumer ring buffer, safe across cores without
+// locks: only the producer writes head, only the consumer writes tail.
+// Holds N - 1 items.
+template <typename T, size_t N>
+struct SpscQueue {
+    T items[N];
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    
+    bool push(const T& item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t next = (h + 1) % N;
+        if (next == tail.load(std::memory_order_acquire)) return false;   // Full
+        items[h] = item;
+        head.store(next, std::memory_order_release);
+        return true;
+    }
+    
+    bool pop(T& item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return false;      // Empty
+        item = items[t];
+        tail.store((t + 1) % N, std::memory_order_release);
+        return true;
+    }
+    
+    bool empty() const {
+        return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+    }
+    
+    size_t space() const {
+        // Free slots, exact for the producer (the consumer only adds more)
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t t = tail.load(std::memory_order_acquire);
+        return (t + N - h - 1) % N;
+    }
+};
+
+enum MotionCommandType : uint8_t {
+    CMD_HOME,
+    CMD_MOVE_ABSOLUTE,      // x, y mm
+    CMD_MOVE_RELATIVE,      // x, y = dx, dy mm
+    CMD_STOP
+};
+
+#define PROFILE_KEEP        -1      // MotionCommand.profile: leave unchanged
+
+struct MotionCommand {
+    MotionCommandType type;
+    float x;
+    float y;
+    float speed;            // Steps/s, 0 = keep
+    float accel;            // Steps/s², 0 = keep
+    int8_t profile;         // 0 = trapezoid, 1 = S-curve, PROFILE_KEEP
+    int8_t magnets;         // Magnets while travelling to x, y, MAGNETS_KEEP
+    uint16_t seq;           // Reported done/error when finished (0 = untagged)
+};
+
+enum MotionEventType : uint8_t {
+    EVENT_MOVE_DONE,
+    EVENT_HOMED,
+    EVENT_STOPPED,
+    EVENT_NOT_HOMED,
+    EVENT_HOMING_FAILED,
+    EVENT_STALL,            // motors = DIAG_MASK bits that tripped
+    EVENT_DONE,             // Tagged move reached its target
+    EVENT_ABORTED           // Tagged move flushed by a stop, home or stall
+};
+
+struct MotionEvent {
+    MotionEventType type;
+    uint32_t motors;
+    uint16_t seq;           // Tagged command this event finishes (0 = none)
+};
+
+// Homing state machine, advanced by serviceHoming() in the motion task.
+// Each axis: seek fast until the switch trips, back off, re-approach
+// slowly to latch the edge precisely, then pull off.
+enum HomingPhase : uint8_t {
+    HOMING_IDLE,
+    HOMING_SEEK,
+    HOMING_BACKOFF,
+    HOMING_LATCH,
+    HOMING_PULLOFF
+};
+
+HomingPhase homingPhase = HOMING_IDLE;
+uint8_t homingAxis = 0;             // 0 = X, 1 = Y
+uint16_t homingSeq = 0;             // Tagged home command in progress
+const uint8_t HOMING_SWITCH_PINS[2] = {LIMIT_SWITCH_PIN, LIMIT_SWITCH_Y_PIN};
+
+// While watchHoming is set the step ISR checks the homing trigger (switch,
+// or DIAG when homing sensorlessly) and stops stepping the moment it
+// fires, setting limitHit
+volatile bool watchHoming = false;
+volatile bool limitHit = false;
+volatile bool homingSensorless = false;     // Latched from sensorlessHoming at start
+
+// Stall detection: outside of homing the ISR stops on any DIAG output
+// and records which ones tripped in stallMotors
+volatile bool stallDetection = STALL_DETECTION;
+volatile bool sensorlessHoming = SENSORLESS_HOMING;
+volatile uint32_t stallMotors = 0;
+uint8_t stallThreshold = STALL_THRESHOLD;
+
+// Motor current levels. Each one is a precomputed IHOLD_IRUN word, so
+// changing level is a single register write per driver, done from the
+// motion task (never the ISR) and only when the level actually changes.
+enum CurrentLevel : uint8_t {
+    CURRENT_HOLD,
+    CURRENT_RUN,
+    CURRENT_BOOST,
+    CURRENT_LEVELS
+};
+
+uint16_t currentSettings[CURRENT_LEVELS] = {MOTOR_CURRENT_HOLD, MOTOR_CURRENT_RUN, MOTOR_CURRENT_BOOST};
+uint32_t currentWords[CURRENT_LEVELS];
+CurrentLevel appliedCurrent = CURRENT_RUN;
+uint32_t holdDelayMs = HOLD_DELAY_MS;
+unsigned long boostUntil = 0;       // End of the initial acceleration ramp
+unsigned long idleSince = 0;        // When the stepper last stopped
+
+// Set by loop() when set_stall / set_current changed driver registers;
+// the motion task applies them
+volatile bool driverConfigPending = false;
+
+// MotorSerial is shared by the motion task (current, StallGuard) and the
+// thermal task (status reads); every driver transaction holds this mutex
+SemaphoreHandle_t driverBus = nullptr;
+
+// Thermal state, worst of both drivers (and the thermistor, if fitted)
+enum ThermalLevel : uint8_t {
+    THERMAL_NORMAL,
+    THERMAL_WARM,           // otpw / t120
+    THERMAL_HOT,            // t143 / t150
+    THERMAL_OVERTEMP        // t157 / ot: the driver shuts its outputs off
+};
 
-// Electromagnet states
-bool magnetStates[4] = {false, false, false, false};
+const uint8_t THERMAL_FAN_PWM[] = {FAN_MIN_PWM, FAN_WARM_PWM, FAN_HOT_PWM, FAN_MAX_PWM};
+volatile ThermalLevel thermalLevel = THERMAL_NORMAL;   // Written by thermalTask
+ThermalLevel reportedThermal = THERMAL_NORMAL;          // Last level sent by loop()
+volatile bool fanAuto[4] = {true, true, true, true};   // false after a manual set_fan
+uint8_t fanPwm[4] = {0, 0, 0, 0};
+float driverTemperature = NAN;      // Thermistor reading in °C
+TaskHandle_t thermalTaskHandle = nullptr;
+
+SpscQueue<MotionCommand, COMMAND_QUEUE_SIZE> motionCommands;
+SpscQueue<MotionEvent, EVENT_QUEUE_SIZE> motionEvents;
+TaskHandle_t motionTaskHandle = nullptr;
+
+// Debug log ring buffer. Any task may append (under logMux); loop() drains
+// it to Serial only as fast as the TX FIFO takes it, so logging never
+// blocks. Indices run freely and are masked on access.
+char logBuffer[LOG_BUFFER_SIZE];
+volatile uint32_t logHead = 0;
+volatile uint32_t logTail = 0;
+volatile uint32_t logDropped = 0;   // Lines lost to a full buffer
+portMUX_TYPE logMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Timing histograms for get_stats, from the CPU cycle counter. loop()
+// records the loop and command stats, the step ISR records its interval
+// error; all of them are copied and cleared under stepperMux.
+enum PerfStatId : uint8_t {
+    PERF_LOOP,                      // One loop() pass
+    PERF_STEP_JITTER,               // Step ISR entry vs. the programmed interval
+    PERF_COMMAND,                   // One UART command, parsed and executed
+    PERF_STATS
+};
+
+struct PerfStat {
+    uint32_t count;
+    uint32_t maxCycles;
+    uint64_t totalCycles;
+    uint32_t buckets[STATS_BUCKETS];
+};
+
+PerfStat perfStats[PERF_STATS];
+const char* const PERF_STAT_NAMES[PERF_STATS] = {"loop", "step_jitter", "command"};
+uint32_t cyclesPerUs = 240;         // Set from the CPU clock in setup()
+uint32_t stepLastCycle = 0;         // Cycle count at the previous step ISR
+uint32_t stepIntervalUs = 0;        // Alarm period the ISR is running at
+
+// Link error counters for get_stats
+struct LinkCounters {
+    uint32_t rxOverflows;           // RX FIFO/ring overflow events (bytes were lost)
+    uint32_t rxErrors;              // Framing or parity errors
+    uint32_t crcErrors;             // Binary frames dropped on CRC
+    uint32_t jsonErrors;            // Unparseable JSON lines
+    uint32_t lineOverflows;         // JSON lines longer than LINE_BUFFER_SIZE
+} linkCounters;
+
+// Position stream (set_telemetry): loop() samples the step counters at
+// telemetryRate while the stepper runs, plus one record once it stops
+uint8_t telemetryRate = 0;          // Hz, 0 = off
+unsigned long telemetryLast = 0;    // micros() of the last record
+float telemetryX = 0.0f;            // Position at the last record, for velocity
+float telemetryY = 0.0f;
+bool telemetryMoving = false;       // The last record was taken while moving
+
+// Electromagnet states (bit n = magnet n + 1), switched by setMagnet() or
+// by the step ISR at the start of a magnet switch block; the motion task
+// drives the PWM outputs to match (serviceMagnets())
+volatile uint8_t magnetMask = 0;
+uint8_t magnetsApplied = 0;         // Mask the PWM outputs currently follow
+unsigned long magnetOnSince[4];     // Start of each magnet's kick
+uint8_t magnetDuty[4] = {0, 0, 0, 0};
+
+// Kick-and-hold settings per magnet (set by loop(), read by the motion task)
+uint8_t magnetHoldPercent[4] = {MAGNET_HOLD_DUTY, MAGNET_HOLD_DUTY, MAGNET_HOLD_DUTY, MAGNET_HOLD_DUTY};
+uint16_t magnetKickMs[4] = {MAGNET_KICK_MS, MAGNET_KICK_MS, MAGNET_KICK_MS, MAGNET_KICK_MS};
+
+// Stored configuration: one versioned blob in NVS, holding every setting
+// set_config can change. Loaded into the runtime settings above at boot.
+struct MotorConfig {
+    uint16_t version;
+    float stepsPerMm;
+    float travelX;          // mm from the homed position
+    float travelY;
+    float originX;          // Board origin, mm from the homed position
+    float originY;
+    float speed;            // Steps/s, cruise speed for moves without one
+    float maxSpeed;
+    float accel;            // Steps/s²
+    bool sCurve;
+    float carrySpeed;
+    float carryAccel;
+    uint16_t current[CURRENT_LEVELS];   // mA RMS
+    uint32_t holdDelayMs;
+    bool stallDetection;
+    bool sensorlessHoming;
+    uint8_t stallThreshold;
+    uint8_t magnetHold[4];  // % once pulled in
+    uint16_t magnetKick[4]; // ms at full power
+    bool warmBoot;
+};
+
+// Where the gantry was last parked, so a reset while it is idle doesn't
+// cost a re-home. Kept in RTC memory, which survives every reset but a
+// power cycle and costs no flash write, so it is marked moving before the
+// first step of every move and a reset mid-move is never trusted. Without
+// a valid copy (power cycle, or a brownout that cleared it) nothing says
+// the gantry didn't move, so it homes as before.
+enum ParkState : uint8_t {
+    PARK_NONE,              // Not homed
+    PARK_MOVING,            // The motors may have moved since
+    PARK_CLEAN              // Idle at stepsA/stepsB, holding torque
+};
+
+struct ParkRecord {
+    int32_t stepsA;
+    int32_t stepsB;
+    ParkState state;
+};
+
+Preferences configStore;
+bool configStored = false;          // A valid blob is in NVS (get_config "stored")
+RTC_NOINIT_ATTR ParkRecord parkRecord;      // Valid with PARK_RTC_MAGIC
+RTC_NOINIT_ATTR uint32_t parkMagic;
+bool warmBooted = false;            // Position restored from parkRecord at boot
 
 // JSON buffer
 StaticJsonDocument<2048> jsonDoc;
-String inputBuffer = "";
+// Fixed line buffer: commands are parsed in place, nothing is allocated
+char lineBuffer[LINE_BUFFER_SIZE];
+size_t lineLength = 0;
+bool lineOverflow = false;     // Discarding until the next newline
+
+// Binary protocol state (JSON commands are always accepted; this selects
+// the format of outgoing messages)
+bool binaryProtocol = false;
+
+// Link speed negotiation (set_baud): a new rate is kept only once the Pi
+// has confirmed it with a CRC-checked test burst
+uint32_t linkBaud = UART_BAUD;
+uint32_t fallbackBaud = UART_BAUD;
+bool baudPending = false;
+unsigned long baudSwitchTime = 0;
+uint8_t linkErrors = 0;             // Consecutive corrupted frames/lines
+
+FrameParser frameParser;
 
-// Timing
-unsigned long lastStepTime = 0;
+// Command being run by loop(): its sequence ID (0 = untagged) and whether
+// the motion task sends its done/error later instead of endCommand()
+uint16_t commandSeq = 0;
+bool commandDeferred = false;
 
 // ==================== FUNCTION DECLARATIONS ====================
 
 void setupPins();
 void setupMotorDrivers();
-void homeGantry();
-void moveToAbsolute(float targetX, float targetY);
-void moveRelative(float deltaX, float deltaY);
-void stepMotors();
-void calculateHBotSteps(long targetX, long targetY, long& stepsA, long& stepsB);
+void setupStepTimer();
+void motionTask(void* param);
+void runMotionCommand(const MotionCommand& command);
+bool reserveMotionCommands(size_t count);
+void queueMotionCommand(const MotionCommand& command);
+void requestStop();
+bool stopPending();
+void postMotionEvent(MotionEventType type, uint32_t motors = 0, uint16_t seq = 0);
+void queueTaggedCommand(MotionCommand command);
+void processMotionEvents();
+void readPosition(float& x, float& y);
+void homeGantry(uint16_t seq);
+void serviceHoming();
+void beginHomingMove(HomingPhase phase, float distance, float speed, bool watchSwitch);
+void finishHoming(bool success, const char* reason = nullptr);
+bool IRAM_ATTR limitPressed(uint8_t pin);
+bool IRAM_ATTR homingTriggered();
+void handleStall();
+void setStallGuard(bool detect, bool sensorless, int threshold);
+void configureCurrents();
+void setDriverCurrent(CurrentLevel level);
+void serviceDrivers();
+void setMotorCurrents(int run, int hold, int boost, int holdDelay);
+void moveToAbsolute(float targetX, float targetY, int8_t magnets, uint16_t seq);
+void moveRelative(float deltaX, float deltaY, uint16_t seq);
+bool waitForBlockSlot();
+bool queueMagnetSwitch(uint8_t magnets);
+void queueMove(float targetX, float targetY, float speed, int8_t magnets = MAGNETS_KEEP, uint16_t seq = 0);
+void recalculatePlan();
+void serviceMotion();
+void startStepper();
+void prepareSegments();
+void stopStepper();
+void retireBlocks(MotionEventType result);
+void finishMove();
+void stopMotion(uint16_t seq);
+void updatePositionFromMotors();
+void IRAM_ATTR stepMotors();
 void setMagnet(int magnetIndex, bool state);
 void setAllMagnets(bool state);
+void setMagnetPower(int magnet, int holdPercent, int kickMs);
+void serviceMagnets();
+void defaultConfig(MotorConfig& config);
+void captureConfig(MotorConfig& config);
+void applyConfig(const MotorConfig& config);
+void loadConfig();
+void saveConfig();
+bool motionIdle();
+void setConfig(JsonObject cmd);
+void resetConfig();
+void sendConfig();
+bool restoreParkedPosition();
+void writeParkRecord(ParkState state);
+void markParkMoving();
+void serviceParking();
+void setMotorPosition(long stepsA, long stepsB);
+float homingTravel(int axis);
 void setFanSpeed(int fanIndex, int pwmValue);
+void setFanAuto(int fanIndex);
+void thermalTask(void* param);
+ThermalLevel readDriverThermal(TMC2226Stepper& driver);
+float readThermistor();
+void reportThermal();
 void processUARTCommand();
+void feedLineByte(char c);
+bool feedFrameByte(uint8_t c);
+void processBinaryFrame(uint8_t opcode, const uint8_t* payload, uint8_t len);
+void sendFrame(uint8_t opcode, const uint8_t* payload, uint8_t len);
+void requestBaudRate(uint32_t baud);
+void handleBaudTest(const uint8_t* payload, uint8_t len);
+void serviceLinkSpeed();
+void reportLinkError();
 void sendStatus(const char* status, const char* message = nullptr);
+void sendReply(uint8_t opcode, uint16_t seq, const char* message = nullptr);
+void reportCommandError(uint16_t seq, const char* message);
+void beginCommand(uint16_t seq);
+void endCommand();
+void failCommand(const char* message);
+int8_t parseMagnets(JsonVariant value, int8_t fallback);
 void sendPositionUpdate();
+void sendStallEvent(uint32_t motors);
+void setTelemetryRate(int rate);
+void serviceTelemetry();
+void IRAM_ATTR recordPerf(PerfStat& stat, uint32_t cycles);
+void onUARTError(hardwareSerial_error_t error);
+void sendStats(bool reset);
+void resetStats();
+void logPrintf(char level, const char* format, ...);
+void serviceLog();
 
 // ==================== SETUP ====================
 
 void setup() {
     // Initialize serial for debugging
     Serial.begin(115200);
-    Serial.println("\n\n=== ESP32 Motor Controller Starting ===");
+    LOG_I("=== ESP32 Motor Controller Starting ===");
     
     // Initialize UART for Pi communication
+    Serial1.setRxBufferSize(UART_RX_BUFFER);
     Serial1.begin(UART_BAUD, SERIAL_8N1, UART_RX_PIN, UART_TX_PIN);
+    Serial1.onReceiveError(onUARTError);
+    cyclesPerUs = ESP.getCpuFreqMHz();
     
     // Initialize UART for TMC2226 drivers (both share same UART bus)
     // Motor A TX connects to both drivers' PDN_UART via 1kΩ resistors
     // Motor A RX also connects (for reading back status)
     MotorSerial.begin(115200, SERIAL_8N1, MOTOR_A_RX_PIN, MOTOR_A_TX_PIN);
     
+    // Stored tuning first, so the drivers are set up with it
+    loadConfig();
+    
     // Setup hardware
     setupPins();
     setupMotorDrivers();
+    driverBus = xSemaphoreCreateMutex();
+    warmBooted = restoreParkedPosition();
+    
+    // Planning and stepping run on their own core; the step timer is
+    // attached from there so its interrupt is serviced on that core too
+    xTaskCreatePinnedToCore(motionTask, "motion", 4096, nullptr, MOTION_TASK_PRIORITY,
+                            &motionTaskHandle, MOTION_TASK_CORE);
     
-    Serial.println("Setup complete. Ready for commands.");
+    // Fan curve, low priority on the UART core
+    xTaskCreatePinnedToCore(thermalTask, "thermal", 3072, nullptr, THERMAL_TASK_PRIORITY,
+                            &thermalTaskHandle, THERMAL_TASK_CORE);
+    
+    LOG_I("Setup complete. Ready for commands.");
     
     // Send ready signal to Pi
-    sendStatus("ready", "Motor controller initialized");
+    sendStatus("ready", warmBooted ? "Motor controller initialized, parked position restored"
+                                   : "Motor controller initialized");
 }
 
 // ==================== MAIN LOOP ====================
 
 void loop() {
-    // Execute movement if in motion
-    if (isMoving) {
-        stepMotors();
-    }
+    uint32_t loopStart = ESP.getCycleCount();
+    
+    // Report what the motion task has finished
+    processMotionEvents();
+    serviceTelemetry();
+    reportThermal();
+    serviceLog();
     
     // Process UART commands from Pi
+    serviceLinkSpeed();
     while (Serial1.available()) {
         char c = Serial1.read();
         
-        if (c == '\n') {
-            processUARTCommand();
-            inputBuffer = "";
-        } else {
-            inputBuffer += c;
+        // Binary frames start with FRAME_SYNC outside of a JSON line
+        if (lineLength == 0 && !lineOverflow && feedFrameByte(c)) {
+            continue;
         }
+        
+        feedLineByte(c);
     }
+    
+    recordPerf(perfStats[PERF_LOOP], ESP.getCycleCount() - loopStart);
 }
 
 // ==================== PIN SETUP ====================
@@ -214,11 +854,21 @@ void setupPins() {
     pinMode(MAGNET_3_PIN, OUTPUT);
     pinMode(MAGNET_4_PIN, OUTPUT);
     
-    // Ensure all magnets off
-    setAllMagnets(false);
+    // Magnet PWM, starting at 0 % (all off)
+    const uint8_t magnetPins[] = {MAGNET_1_PIN, MAGNET_2_PIN, MAGNET_3_PIN, MAGNET_4_PIN};
+    for (int i = 0; i < 4; i++) {
+        ledcSetup(MAGNET_PWM_CHANNEL + i, MAGNET_PWM_FREQ, MAGNET_PWM_BITS);
+        ledcAttachPin(magnetPins[i], MAGNET_PWM_CHANNEL + i);
+        ledcWrite(MAGNET_PWM_CHANNEL + i, 0);
+    }
     
     // Limit switch
     pinMode(LIMIT_SWITCH_PIN, INPUT_PULLUP);
+    pinMode(LIMIT_SWITCH_Y_PIN, INPUT_PULLUP);
+    
+    // StallGuard outputs (push-pull from the drivers)
+    pinMode(MOTOR_A_DIAG_PIN, INPUT);
+    pinMode(MOTOR_B_DIAG_PIN, INPUT);
     
     // Fan PWM pins
     pinMode(FAN_1_PIN, OUTPUT);
@@ -242,18 +892,18 @@ void setupPins() {
         setFanSpeed(i, 128);
     }
     
-    Serial.println("Pins configured");
+    LOG_I("Pins configured");
 }
 
 // ==================== TMC2226 SETUP ====================
 
 void setupMotorDrivers() {
-    Serial.println("Configuring TMC2226 drivers...");
+    LOG_I("Configuring TMC2226 drivers...");
     
     // Driver A configuration
     driverA.begin();
     driverA.toff(5);                    // Enable driver
-    driverA.rms_current(MOTOR_CURRENT_RUN); // Set RMS current
+    driverA.rms_current(currentSettings[CURRENT_RUN]); // Set RMS current
     driverA.microsteps(MICROSTEPS);     // Set microstepping
     driverA.pwm_autoscale(true);        // Enable automatic current scaling
     driverA.en_spreadCycle(false);      // Use StealthChop (quieter)
@@ -261,235 +911,1707 @@ void setupMotorDrivers() {
     // Driver B configuration
     driverB.begin();
     driverB.toff(5);
-    driverB.rms_current(MOTOR_CURRENT_RUN);
+    driverB.rms_current(currentSettings[CURRENT_RUN]);
     driverB.microsteps(MICROSTEPS);
     driverB.pwm_autoscale(true);
     driverB.en_spreadCycle(false);
     
-    Serial.println("TMC2226 drivers configured");
+    // StallGuard: DIAG goes HIGH when the load exceeds SGTHRS, but only
+    // above STALL_MIN_SPEED (TCOOLTHRS), so ramps from rest never trip it
+    driverA.TCOOLTHRS(STALL_TCOOLTHRS);
+    driverA.SGTHRS(stallThreshold);
+    driverB.TCOOLTHRS(STALL_TCOOLTHRS);
+    driverB.SGTHRS(stallThreshold);
+    
+    LOG_I("TMC2226 drivers configured");
     
     // Test: Read back configuration
-    Serial.print("Driver A current: ");
-    Serial.println(driverA.rms_current());
-    Serial.print("Driver B current: ");
-    Serial.println(driverB.rms_current());
+    LOG_I("Driver A current: %u", driverA.rms_current());
+    LOG_I("Driver B current: %u", driverB.rms_current());
+}
+
+// ==================== STEP TIMER SETUP ====================
+
+void setupStepTimer() {
+    stepPulseCycles = STEP_PULSE_US * ESP.getCpuFreqMHz();
+    
+    stepTimer = timerBegin(STEP_TIMER_INDEX, STEP_TIMER_DIVIDER, true);
+    timerAttachInterrupt(stepTimer, &stepMotors, false);
+    timerAlarmWrite(stepTimer, 1000000 / START_SPEED, true);
+    
+    LOG_I("Step timer configured");
+}
+
+// ==================== MOTION TASK ====================
+
+void motionTask(void* param) {
+    /**
+     * Owns the planner, the segment buffer and homing, pinned to
+     * MOTION_TASK_CORE. Each pass drains the command queue (so a whole
+     * path is queued and blended before the stepper starts), then keeps
+     * the ISR's segment buffer topped up. Waking every tick is plenty:
+     * the segment buffer holds far more than a tick of motion.
+     *
+     * While homing, commands stay queued (only a stop gets through), so
+     * moves sent right after "home" run once the gantry is homed.
+     */
+    setupStepTimer();
+    configureCurrents();
+    idleSince = millis();
+    
+    for (;;) {
+        MotionCommand command;
+        while ((homingPhase == HOMING_IDLE || stopPending()) && motionCommands.pop(command)) {
+            if (stopPending() && command.type != CMD_STOP) {
+                // Sent before the stop, superseded by it
+                if (command.seq) {
+                    postMotionEvent(EVENT_ABORTED, 0, command.seq);
+                }
+                continue;
+            }
+            runMotionCommand(command);
+        }
+        
+        if (stallMotors) {
+            handleStall();
+        }
+        
+        // Steps are generated by the timer ISR; keep its segment buffer
+        // topped up and retire finished blocks here
+        if (isMoving && !stopPending()) {
+            serviceMotion();
+        }
+        
+        if (homingPhase != HOMING_IDLE && !stopPending()) {
+            serviceHoming();
+        }
+        
+        serviceDrivers();
+        serviceMagnets();
+        serviceParking();
+        
+        vTaskDelay(1);
+    }
+}
+
+void runMotionCommand(const MotionCommand& command) {
+    switch (command.type) {
+        case CMD_HOME:
+            homeGantry(command.seq);
+            break;
+        
+        case CMD_MOVE_ABSOLUTE:
+            if (command.speed > 0) {
+                currentSpeed = constrain(command.speed, (float)START_SPEED, maxSpeed);
+            }
+            if (command.accel > 0) {
+                currentAccel = constrain(command.accel, 100.0f, 50000.0f);
+            }
+            if (command.profile != PROFILE_KEEP) {
+                sCurveEnabled = command.profile != 0;
+            }
+            moveToAbsolute(command.x, command.y, command.magnets, command.seq);
+            break;
+        
+        case CMD_MOVE_RELATIVE:
+            moveRelative(command.x, command.y, command.seq);
+            break;
+        
+        case CMD_STOP:
+            stopMotion(command.seq);
+            stopsHandled = stopsHandled + 1;
+            break;
+    }
+}
+
+bool reserveMotionCommands(size_t count) {
+    /**
+     * Check that 'count' commands fit in the command queue, or fail the
+     * current command so the Pi retries it later. loop() never waits for
+     * the motion task here: it is the only reader of motionEvents, and a
+     * motion task waiting on a full event queue would stop popping
+     * commands. A path is queued whole or not at all.
+     */
+    if (motionCommands.space() >= count) {
+        return true;
+    }
+    failCommand("Motion queue full");
+    return false;
+}
+
+void queueMotionCommand(const MotionCommand& command) {
+    // Room was reserved with reserveMotionCommands(), and only loop() pushes
+    motionCommands.push(command);
+}
+
+void queueTaggedCommand(MotionCommand command) {
+    // Hand the current command to the motion task, which reports its
+    // done/error once it has actually finished
+    if (!reserveMotionCommands(1)) {
+        return;
+    }
+    command.seq = commandSeq;
+    commandDeferred = commandSeq != 0;
+    queueMotionCommand(command);
+}
+
+void requestStop() {
+    /**
+     * Raise the flag first so the ISR halts on its next tick, then let the
+     * motion task flush everything queued before this point. A stop is
+     * never refused, so this is the one place loop() waits for a slot:
+     * with a stop pending the motion task discards queued commands
+     * without waiting, and EVENT_QUEUE_SIZE has room for all their aborts.
+     */
+    stopRequests = stopRequests + 1;
+    
+    MotionCommand stop = {CMD_STOP, 0, 0, 0, 0, PROFILE_KEEP, MAGNETS_KEEP, commandSeq};
+    while (!motionCommands.push(stop)) {
+        vTaskDelay(1);
+    }
+    commandDeferred = commandSeq != 0;
+}
+
+bool stopPending() {
+    return stopRequests != stopsHandled;
+}
+
+void postMotionEvent(MotionEventType type, uint32_t motors, uint16_t seq) {
+    // loop() drains every pass and never blocks on the command queue
+    // (see reserveMotionCommands), so this never waits long
+    MotionEvent event = {type, motors, seq};
+    while (!motionEvents.push(event)) {
+        vTaskDelay(1);
+    }
+}
+
+void processMotionEvents() {
+    MotionEvent event;
+    while (motionEvents.pop(event)) {
+        switch (event.type) {
+            case EVENT_MOVE_DONE:
+                sendPositionUpdate();
+                break;
+            
+            case EVENT_HOMED:
+                sendStatus("homed", "Gantry homed to (0, 0)");
+                sendReply(OP_DONE, event.seq);
+                break;
+            
+            case EVENT_STOPPED:
+                sendStatus("stopped", "Movement stopped");
+                sendReply(OP_DONE, event.seq);
+                break;
+            
+            case EVENT_NOT_HOMED:
+                reportCommandError(event.seq, "Gantry not homed");
+                break;
+            
+            case EVENT_HOMING_FAILED:
+                reportCommandError(event.seq, "Homing failed");
+                break;
+            
+            case EVENT_STALL:
+                sendStallEvent(event.motors);
+                break;
+            
+            case EVENT_DONE:
+                sendReply(OP_DONE, event.seq);
+                break;
+            
+            case EVENT_ABORTED:
+                sendReply(OP_ERROR, event.seq, "Aborted");
+                break;
+        }
+    }
 }
 
 // ==================== HOMING ====================
 
-void homeGantry() {
-    Serial.println("Starting homing sequence...");
+void homeGantry(uint16_t seq) {
+    /**
+     * Start homing X, then Y; serviceHoming() does the rest.
+     *
+     * On an H-Bot, driving both motors the same way only moves X, so each
+     * axis is homed with its own Cartesian move through the planner
+     * (ramped like any other move) against its own switch.
+     *
+     * Sensorless homing seeks until StallGuard reports the end stop
+     * instead. It skips the slow latch, since StallGuard does not work
+     * at HOMING_SPEED, and pulls off straight away.
+     */
+    LOG_I("Starting homing sequence...");
     
     isHomed = false;
+    stopStepper();
+    isMoving = false;
+    stallMotors = 0;
+    homingSensorless = sensorlessHoming;
+    homingSeq = seq;
     
-    // Move towards limit switch until triggered
-    // Assuming limit switch is at (0, 0)
-    
-    digitalWrite(MOTOR_A_DIR_PIN, LOW);  // Reverse direction
-    digitalWrite(MOTOR_B_DIR_PIN, LOW);
+    homingAxis = 0;
+    if (!homingSensorless && limitPressed(HOMING_SWITCH_PINS[homingAxis])) {
+        beginHomingMove(HOMING_BACKOFF, HOMING_BACKOFF_MM, HOMING_SEEK_SPEED, false);
+    } else {
+        beginHomingMove(HOMING_SEEK, -homingTravel(homingAxis), HOMING_SEEK_SPEED, true);
+    }
+}
+
+void serviceHoming() {
+    // Switch closed: the ISR has already stopped stepping, discard the
+    // rest of the move and take the position the motors reached
+    if (limitHit) {
+        stopStepper();
+        isMoving = false;
+        watchHoming = false;
+        limitHit = false;
+        
+        if (homingPhase == HOMING_SEEK && homingSensorless) {
+            LOG_I("End stop detected (StallGuard)");
+            beginHomingMove(HOMING_PULLOFF, HOMING_PULLOFF_MM, HOMING_SEEK_SPEED, false);
+        } else if (homingPhase == HOMING_SEEK) {
+            LOG_I("Limit switch triggered");
+            beginHomingMove(HOMING_BACKOFF, HOMING_BACKOFF_MM, HOMING_SEEK_SPEED, false);
+        } else {
+            beginHomingMove(HOMING_PULLOFF, HOMING_PULLOFF_MM, HOMING_SPEED, false);
+        }
+        return;
+    }
     
-    // Move slowly until limit switch triggers
-    while (digitalRead(LIMIT_SWITCH_PIN) == HIGH) {
-        // Step both motors
-        digitalWrite(MOTOR_A_STEP_PIN, HIGH);
-        digitalWrite(MOTOR_B_STEP_PIN, HIGH);
-        delayMicroseconds(5);
-        digitalWrite(MOTOR_A_STEP_PIN, LOW);
-        digitalWrite(MOTOR_B_STEP_PIN, LOW);
-        delayMicroseconds(1000000 / HOMING_SPEED);
+    if (isMoving) {
+        return;
     }
     
-    Serial.println("Limit switch triggered");
+    switch (homingPhase) {
+        case HOMING_SEEK:
+        case HOMING_LATCH:
+            finishHoming(false, "Limit switch not found");
+            break;
+        
+        case HOMING_BACKOFF:
+            if (limitPressed(HOMING_SWITCH_PINS[homingAxis])) {
+                finishHoming(false, "Limit switch stuck");
+                break;
+            }
+            beginHomingMove(HOMING_LATCH, -2.0f * HOMING_BACKOFF_MM, HOMING_SPEED, true);
+            break;
+        
+        case HOMING_PULLOFF:
+            if (homingAxis == 0) {
+                homingAxis = 1;
+                beginHomingMove(HOMING_SEEK, -homingTravel(homingAxis), HOMING_SEEK_SPEED, true);
+            } else {
+                finishHoming(true);
+            }
+            break;
+        
+        case HOMING_IDLE:
+            break;
+    }
+}
+
+float homingTravel(int axis) {
+    // Seek distance: 10% more than the axis can travel
+    return (axis == 0 ? travelX : travelY) * 1.1f;
+}
+
+void beginHomingMove(HomingPhase phase, float distance, float speed, bool watchSwitch) {
+    // Plain planner move along the homing axis. Targets are relative to
+    // wherever the motors are, since nothing is known until this finishes.
+    homingPhase = phase;
+    limitHit = false;
+    watchHoming = watchSwitch;
     
-    // Back off slightly
-    digitalWrite(MOTOR_A_DIR_PIN, HIGH);
-    digitalWrite(MOTOR_B_DIR_PIN, HIGH);
+    float x = (float)plannerStepsX / stepsPerMm;
+    float y = (float)plannerStepsY / stepsPerMm;
+    if (homingAxis == 0) {
+        x += distance;
+    } else {
+        y += distance;
+    }
+    queueMove(x, y, speed);
+}
+
+void finishHoming(bool success, const char* reason) {
+    homingPhase = HOMING_IDLE;
+    watchHoming = false;
+    limitHit = false;
     
-    for (int i = 0; i < 100; i++) {
-        digitalWrite(MOTOR_A_STEP_PIN, HIGH);
-        digitalWrite(MOTOR_B_STEP_PIN, HIGH);
-        delayMicroseconds(5);
-        digitalWrite(MOTOR_A_STEP_PIN, LOW);
-        digitalWrite(MOTOR_B_STEP_PIN, LOW);
-        delayMicroseconds(1000000 / HOMING_SPEED);
+    if (!success) {
+        stopStepper();
+        isMoving = false;
+        LOG_W("Homing failed: %s", reason);
+        postMotionEvent(EVENT_HOMING_FAILED, 0, homingSeq);
+        return;
     }
     
-    // Set current position as (0, 0)
-    currentStepsX = 0;
-    currentStepsY = 0;
-    currentPosX = 0.0;
-    currentPosY = 0.0;
+    // Both axes sit HOMING_PULLOFF_MM off their switches: call that
+    // (-originX, -originY), so the board origin is (0, 0). Homing Y moves
+    // the motors in opposite directions, so X is unchanged.
+    long homeA, homeB;
+    calculateHBotSteps(lroundf(-originX * stepsPerMm), lroundf(-originY * stepsPerMm), homeA, homeB);
+    setMotorPosition(homeA, homeB);
     
     isHomed = true;
     
-    Serial.println("Homing complete");
-    sendStatus("homed", "Gantry homed to (0, 0)");
+    LOG_I("Homing complete");
+    postMotionEvent(EVENT_HOMED, 0, homingSeq);
 }
 
-// ==================== MOVEMENT ====================
+bool IRAM_ATTR limitPressed(uint8_t pin) {
+    // Register read so the step ISR can call it; switches are active LOW
+    uint32_t levels = pin < 32 ? GPIO.in : GPIO.in1.data;
+    return !(levels & (1UL << (pin & 31)));
+}
 
-void moveToAbsolute(float targetX, float targetY) {
-    if (!isHomed) {
-        Serial.println("ERROR: Cannot move - not homed");
-        sendStatus("error", "Gantry not homed");
+bool IRAM_ATTR homingTriggered() {
+    // Moving both motors either way, so a stall on either means the end stop
+    if (homingSensorless) {
+        return (GPIO.in & DIAG_MASK) != 0;
+    }
+    return limitPressed(HOMING_SWITCH_PINS[homingAxis]);
+}
+
+// ==================== STALL DETECTION ====================
+
+void handleStall() {
+    /**
+     * The ISR stopped stepping on a DIAG edge. Steps have been lost, so
+     * the position can no longer be trusted: flush the motion, mark the
+     * gantry unhomed and let the Pi decide when to re-home.
+     */
+    uint32_t motors = stallMotors;
+    
+    stopStepper();
+    isMoving = false;
+    stallMotors = 0;
+    
+    if (homingPhase != HOMING_IDLE) {
+        finishHoming(false, "Stall");
         return;
     }
     
-    // Constrain to board limits
-    targetX = constrain(targetX, 0, MAX_X_MM);
-    targetY = constrain(targetY, 0, MAX_Y_MM);
+    isHomed = false;
+    LOG_W("Stall detected on motor%s%s",
+          (motors & (1UL << MOTOR_A_DIAG_PIN)) ? " A" : "",
+          (motors & (1UL << MOTOR_B_DIAG_PIN)) ? " B" : "");
+    postMotionEvent(EVENT_STALL, motors);
+}
+
+void setStallGuard(bool detect, bool sensorless, int threshold) {
+    // Called from loop(); the flags are picked up by the ISR and the next
+    // homing run, the threshold by serviceDrivers()
+    stallDetection = detect;
+    sensorlessHoming = sensorless;
+    stallThreshold = constrain(threshold, 0, 255);
+    driverConfigPending = true;
     
-    Serial.print("Moving to (");
-    Serial.print(targetX);
-    Serial.print(", ");
-    Serial.print(targetY);
-    Serial.println(")");
+    LOG_I("StallGuard: detect %d, sensorless homing %d, threshold %u",
+          detect, sensorless, stallThreshold);
+}
+
+// ==================== DRIVER CURRENT ====================
+
+void configureCurrents() {
+    /**
+     * Precompute the IHOLD_IRUN word of each current level.
+     *
+     * rms_current() at the boost level picks the sense resistor range
+     * (vsense) that every level then shares; the other levels only scale
+     * the current scale field, since current is proportional to CS + 1.
+     * IHOLD always stays at the hold current, so the driver also drops
+     * to it on its own if the firmware is ever late.
+     */
+    xSemaphoreTake(driverBus, portMAX_DELAY);
+    driverA.rms_current(currentSettings[CURRENT_BOOST]);
+    driverB.rms_current(currentSettings[CURRENT_BOOST]);
+    uint32_t word = driverA.IHOLD_IRUN();
+    xSemaphoreGive(driverBus);
     
-    // Convert mm to steps
-    targetStepsX = (long)(targetX * STEPS_PER_MM);
-    targetStepsY = (long)(targetY * STEPS_PER_MM);
+    uint8_t boostCs = (word >> 8) & 0x1F;
+    uint32_t holdDelayBits = word & 0x000F0000;
     
-    isMoving = true;
+    uint8_t cs[CURRENT_LEVELS];
+    for (int i = 0; i < CURRENT_LEVELS; i++) {
+        float ratio = (float)currentSettings[i] / currentSettings[CURRENT_BOOST];
+        cs[i] = constrain(lroundf(ratio * (boostCs + 1)) - 1, 0L, 31L);
+    }
+    for (int i = 0; i < CURRENT_LEVELS; i++) {
+        currentWords[i] = holdDelayBits | ((uint32_t)cs[i] << 8) | cs[CURRENT_HOLD];
+    }
+    
+    appliedCurrent = CURRENT_LEVELS;  // Rewritten by the next setDriverCurrent()
 }
 
-void moveRelative(float deltaX, float deltaY) {
-    moveToAbsolute(currentPosX + deltaX, currentPosY + deltaY);
+void setDriverCurrent(CurrentLevel level) {
+    // Both drivers back to back: one UART datagram each
+    if (level == appliedCurrent) {
+        return;
+    }
+    
+    xSemaphoreTake(driverBus, portMAX_DELAY);
+    driverA.IHOLD_IRUN(currentWords[level]);
+    driverB.IHOLD_IRUN(currentWords[level]);
+    xSemaphoreGive(driverBus);
+    appliedCurrent = level;
 }
 
-void stepMotors() {
-    // Calculate remaining distance
-    long remainingX = targetStepsX - currentStepsX;
-    long remainingY = targetStepsY - currentStepsY;
+void serviceDrivers() {
+    /**
+     * Called every motion task pass: apply pending configuration, then
+     * pick the current level. startStepper() has already switched to
+     * boost before the first step; after the initial ramp the motors run
+     * at run current, and HOLD_DELAY_MS after stopping they drop to hold.
+     */
+    if (driverConfigPending) {
+        driverConfigPending = false;
+        xSemaphoreTake(driverBus, portMAX_DELAY);
+        driverA.SGTHRS(stallThreshold);
+        driverB.SGTHRS(stallThreshold);
+        xSemaphoreGive(driverBus);
+        configureCurrents();
+    }
     
-    // Check if we've reached target
-    if (remainingX == 0 && remainingY == 0) {
-        isMoving = false;
-        sendPositionUpdate();
-        Serial.println("Movement complete");
-        return;
-    }
-    
-    // Calculate H-Bot motor directions
-    // H-Bot kinematics:
-    // Motor A: controls X + Y diagonal
-    // Motor B: controls X - Y diagonal
-    //
-    // To move +X: A forward, B forward
-    // To move +Y: A forward, B backward
-    
-    long stepsA = remainingX + remainingY;  // A motor steps
-    long stepsB = remainingX - remainingY;  // B motor steps
-    
-    // Set motor directions
-    digitalWrite(MOTOR_A_DIR_PIN, stepsA > 0 ? HIGH : LOW);
-    digitalWrite(MOTOR_B_DIR_PIN, stepsB > 0 ? HIGH : LOW);
-    
-    // Step motors
-    unsigned long currentTime = micros();
-    if (currentTime - lastStepTime >= stepDelay) {
-        // Step motor A if needed
-        if (stepsA != 0) {
-            digitalWrite(MOTOR_A_STEP_PIN, HIGH);
-            delayMicroseconds(5);
-            digitalWrite(MOTOR_A_STEP_PIN, LOW);
-            currentStepsX += (stepsA > 0) ? 1 : -1;
-        }
-        
-        // Step motor B if needed
-        if (stepsB != 0) {
-            digitalWrite(MOTOR_B_STEP_PIN, HIGH);
-            delayMicroseconds(5);
-            digitalWrite(MOTOR_B_STEP_PIN, LOW);
-            // Y component is difference in motor steps
-            if (stepsA == 0) {
-                currentStepsY += (stepsB > 0) ? -1 : 1;
-            } else {
-                currentStepsY += (remainingY > 0) ? 1 : -1;
-            }
+    unsigned long now = millis();
+    CurrentLevel level;
+    
+    if (isMoving) {
+        level = (long)(boostUntil - now) > 0 ? CURRENT_BOOST : CURRENT_RUN;
+    } else {
+        level = now - idleSince >= holdDelayMs ? CURRENT_HOLD : appliedCurrent;
+        if (level == CURRENT_BOOST || level == CURRENT_LEVELS) {
+            level = CURRENT_RUN;  // Stopped; hold follows after the delay
         }
-        
-        // Update current position in mm
-        currentPosX = (float)currentStepsX / STEPS_PER_MM;
-        currentPosY = (float)currentStepsY / STEPS_PER_MM;
-        
-        lastStepTime = currentTime;
     }
+    
+    setDriverCurrent(level);
 }
 
-// ==================== ELECTROMAGNET CONTROL ====================
+void setMotorCurrents(int run, int hold, int boost, int holdDelay) {
+    // Called from loop(); 0 keeps a setting. Boost is never below run.
+    if (run > 0) currentSettings[CURRENT_RUN] = constrain(run, 50, 2000);
+    if (hold > 0) currentSettings[CURRENT_HOLD] = constrain(hold, 50, 2000);
+    if (boost > 0) currentSettings[CURRENT_BOOST] = constrain(boost, 50, 2000);
+    if (holdDelay > 0) holdDelayMs = holdDelay;
+    
+    currentSettings[CURRENT_BOOST] = max(currentSettings[CURRENT_BOOST], currentSettings[CURRENT_RUN]);
+    currentSettings[CURRENT_HOLD] = min(currentSettings[CURRENT_HOLD], currentSettings[CURRENT_RUN]);
+    driverConfigPending = true;
+    
+    LOG_I("Motor current: run %u, hold %u, boost %u mA, hold after %lu ms",
+          currentSettings[CURRENT_RUN], currentSettings[CURRENT_HOLD],
+          currentSettings[CURRENT_BOOST], (unsigned long)holdDelayMs);
+}
 
-void setMagnet(int magnetIndex, bool state) {
-    if (magnetIndex < 0 || magnetIndex >= 4) return;
+// ==================== MOVEMENT ====================
+
+void moveToAbsolute(float targetX, float targetY, int8_t magnets, uint16_t seq) {
+    if (!isHomed) {
+        LOG_W("Cannot move - not homed");
+        postMotionEvent(EVENT_NOT_HOMED, 0, seq);
+        return;
+    }
     
-    int pins[] = {MAGNET_1_PIN, MAGNET_2_PIN, MAGNET_3_PIN, MAGNET_4_PIN};
+    // Constrain to board limits
+    targetX = constrain(targetX, -originX, travelX - originX);
+    targetY = constrain(targetY, -originY, travelY - originY);
     
-    digitalWrite(pins[magnetIndex], state ? HIGH : LOW);
-    magnetStates[magnetIndex] = state;
+    LOG_D("Moving to (%.1f, %.1f)", targetX, targetY);
     
-    Serial.print("Magnet ");
-    Serial.print(magnetIndex + 1);
-    Serial.println(state ? " ON" : " OFF");
+    queueMove(targetX, targetY, currentSpeed, magnets, seq);
 }
 
-void setAllMagnets(bool state) {
-    for (int i = 0; i < 4; i++) {
-        setMagnet(i, state);
-    }
+void moveRelative(float deltaX, float deltaY, uint16_t seq) {
+    // Relative to the end of whatever is already queued
+    moveToAbsolute((float)plannerStepsX / stepsPerMm + deltaX,
+                   (float)plannerStepsY / stepsPerMm + deltaY, MAGNETS_KEEP, seq);
 }
 
-// ==================== FAN CONTROL ====================
+// ==================== MOTION QUEUE ====================
 
-void setFanSpeed(int fanIndex, int pwmValue) {
-    if (fanIndex < 0 || fanIndex >= 4) return;
+uint8_t nextBlockIndex(uint8_t index) {
+    return (index + 1) % BLOCK_QUEUE_SIZE;
+}
+
+uint8_t prevBlockIndex(uint8_t index) {
+    return (index + BLOCK_QUEUE_SIZE - 1) % BLOCK_QUEUE_SIZE;
+}
+
+float blockRampAccel(const PlannerBlock& block) {
+    // S-curve ramps average 2/3 of their peak acceleration (see planProfile)
+    return block.sCurve ? block.accel / 1.5f : block.accel;
+}
+
+bool waitForBlockSlot() {
+    /**
+     * Wait for a free block slot, running the stepper to drain the queue;
+     * false if a stop or a stall arrives in the meantime. A stall holds
+     * the ISR, so no block would ever retire: it is handled (and reported)
+     * here rather than on the next motionTask() pass.
+     */
+    while (nextBlockIndex(blockHead) == blockTail) {
+        if (stopPending()) {
+            return false;
+        }
+        if (stallMotors) {
+            handleStall();
+            return false;
+        }
+        if (!stepperBusy) {
+            startStepper();
+        }
+        serviceMotion();
+        serviceDrivers();  // Boost drops to run current during long paths
+        serviceMagnets();  // A queued magnet switch may run meanwhile
+        vTaskDelay(1);
+    }
+    return true;
+}
+
+bool queueMagnetSwitch(uint8_t magnets) {
+    /**
+     * Queue a magnet change where the queued path currently ends: a block
+     * of two empty ticks. The step ISR flips magnetMask when it loads the
+     * block, right after the previous block's last step (the motion task
+     * follows with the PWM within a tick), and the second tick comes
+     * MAGNET_ENGAGE_MS (or MAGNET_RELEASE_MS) later, so the piece is
+     * gripped or let go before anything moves again, even when the switch
+     * ends the queue. Its entry speed is 0, so the previous block brakes
+     * to a stop on the square.
+     *
+     * Returns false if the magnets already end up in that state.
+     */
+    if (blockHead == blockTail) {
+        plannerMagnets = magnetMask;  // Nothing queued: start from the pins
+    }
+    if (magnets == plannerMagnets || !waitForBlockSlot()) {
+        return false;
+    }
     
-    pwmValue = constrain(pwmValue, 0, 255);
-    ledcWrite(fanIndex, pwmValue);
+    PlannerBlock& block = blockQueue[blockHead];
+    block = {};
+    block.ticks = 2;
+    block.magnets = magnets;
+    block.dwellUs = (magnets & ~plannerMagnets ? MAGNET_ENGAGE_MS : MAGNET_RELEASE_MS) * 1000UL;
+    plannerMagnets = magnets;
+    
+    portENTER_CRITICAL(&stepperMux);
+    blockHead = nextBlockIndex(blockHead);
+    segmentsFinal = false;
+    portEXIT_CRITICAL(&stepperMux);
     
-    Serial.print("Fan ");
-    Serial.print(fanIndex + 1);
-    Serial.print(" speed: ");
-    Serial.println(pwmValue);
+    recalculatePlan();
+    isMoving = true;
+    return true;
 }
 
-// ==================== UART COMMAND PROCESSING ====================
-
-void processUARTCommand() {
-    // Parse JSON command
-    DeserializationError error = deserializeJson(jsonDoc, inputBuffer);
+void queueMove(float targetX, float targetY, float speed, int8_t magnets, uint16_t seq) {
+    /**
+     * Append a straight move to (targetX, targetY) mm to the motion queue,
+     * cruising at 'speed' steps/s. A tagged move ('seq') is reported done
+     * when its block retires, or aborted if the queue is flushed first.
+     *
+     * A move that states its magnets switches them first if needed (see
+     * queueMagnetSwitch()) and picks its limits from them: carrying a
+     * piece is capped at carrySpeed / carryAccel with S-curve ramps,
+     * empty travel runs at maxSpeed.
+     *
+     * The entry speed of the new block is limited by the corner it makes
+     * with the previous block (junction deviation), then the whole
+     * unexecuted part of the queue is re-planned so only the last block
+     * decelerates to a stop.
+     *
+     * The stepper is started by the motion task once it has drained the
+     * command queue (motionTask -> serviceMotion), not here, so every point
+     * of a path command is queued (and blended) before the first block locks.
+     * If the queue is full this waits for a free slot while the stepper
+     * drains it, so a long path never drops waypoints (unless a stop or
+     * a stall arrives in the meantime).
+     */
+    bool switched = magnets != MAGNETS_KEEP && queueMagnetSwitch(magnets);
     
-    if (error) {
-        Serial.print("JSON parse error: ");
-        Serial.println(error.c_str());
+    // A stall while waiting to queue the switch flushed the queue and
+    // cleared the homed flag: the move is aborted with it
+    bool stalled = !isHomed && homingPhase == HOMING_IDLE;
+    
+    if (stalled || !waitForBlockSlot()) {
+        if (seq) {
+            postMotionEvent(EVENT_ABORTED, 0, seq);
+        }
         return;
     }
     
-    JsonObject cmd = jsonDoc.as<JsonObject>();
-    const char* cmdType = cmd["cmd"];
+    float accel = currentAccel;
+    bool sCurve = sCurveEnabled;
+    if (magnets > 0) {
+        speed = min(speed, carrySpeed);
+        accel = min(accel, carryAccel);
+        sCurve = true;
+    } else if (magnets == 0) {
+        speed = maxSpeed;
+    }
     
-    if (cmdType == nullptr) {
-        Serial.println("No 'cmd' field in JSON");
+    long newStepsX = (long)(targetX * stepsPerMm);
+    long newStepsY = (long)(targetY * stepsPerMm);
+    long deltaX = newStepsX - plannerStepsX;
+    long deltaY = newStepsY - plannerStepsY;
+    
+    if (deltaX == 0 && deltaY == 0) {
+        isMoving = true;  // Finished by the next serviceMotion() if nothing else is queued
+        if (switched) {
+            blockQueue[prevBlockIndex(blockHead)].seq = seq;  // Done after the magnet switch
+        } else if (seq) {
+            postMotionEvent(EVENT_DONE, 0, seq);  // Already there
+        }
         return;
     }
     
-    // Route command
-    if (strcmp(cmdType, "home") == 0) {
-        homeGantry();
+    // Motor steps for the block, computed once from absolute motor targets
+    // so rounding never accumulates across a path
+    long fromA, fromB, toA, toB;
+    calculateHBotSteps(plannerStepsX, plannerStepsY, fromA, fromB);
+    calculateHBotSteps(newStepsX, newStepsY, toA, toB);
+    
+    PlannerBlock& block = blockQueue[blockHead];
+    block.stepsA = toA - fromA;
+    block.stepsB = toB - fromB;
+    
+    // The dominant motor steps on every tick, so the block lasts as many
+    // ticks as that motor needs and runs at the fastest rate it allows
+    block.ticks = max(labs(block.stepsA), labs(block.stepsB));
+    
+    float dx = (float)deltaX / stepsPerMm;
+    float dy = (float)deltaY / stepsPerMm;
+    block.millimeters = sqrtf(dx * dx + dy * dy);
+    block.unitX = dx / block.millimeters;
+    block.unitY = dy / block.millimeters;
+    block.mmPerTick = block.millimeters / block.ticks;
+    block.nominalSpeed = speed * block.mmPerTick;
+    block.accel = accel * block.mmPerTick;
+    block.sCurve = sCurve;
+    block.magnets = MAGNETS_KEEP;
+    block.dwellUs = 0;
+    block.seq = seq;
+    
+    // Entry speed limited by the corner with the previous queued block
+    block.maxEntrySpeed = 0.0f;
+    if (blockHead != blockTail) {
+        const PlannerBlock& prev = blockQueue[prevBlockIndex(blockHead)];
+        float corner = junctionSpeed(prev.unitX, prev.unitY, block.unitX, block.unitY,
+                                     min(blockRampAccel(prev), blockRampAccel(block)),
+                                     JUNCTION_DEVIATION);
+        block.maxEntrySpeed = min(corner, min(prev.nominalSpeed, block.nominalSpeed));
     }
-    else if (strcmp(cmdType, "move_absolute") == 0) {
-        float x = cmd["x"] | 0.0;
-        float y = cmd["y"] | 0.0;
-        
-        if (cmd.containsKey("speed")) {
-            currentSpeed = cmd["speed"];
-            stepDelay = 1000000 / currentSpeed;
-        }
-        
-        moveToAbsolute(x, y);
+    block.entrySpeed = block.maxEntrySpeed;
+    
+    plannerStepsX = newStepsX;
+    plannerStepsY = newStepsY;
+    targetStepsX = newStepsX;
+    targetStepsY = newStepsY;
+    
+    portENTER_CRITICAL(&stepperMux);
+    blockHead = nextBlockIndex(blockHead);
+    segmentsFinal = false;
+    portEXIT_CRITICAL(&stepperMux);
+    
+    recalculatePlan();
+    isMoving = true;
+}
+
+void recalculatePlan() {
+    /**
+     * Look-ahead over the blocks not yet sliced into segments.
+     *
+     * Backward pass: each block may only enter as fast as it can still
+     * brake to the next block's entry speed (the last block brakes to 0).
+     * Forward pass: each block may only enter as fast as the previous one
+     * can accelerate to, starting from the already-locked exit speed.
+     */
+    uint8_t first = prepActive ? nextBlockIndex(prepBlock) : prepBlock;
+    if (first == blockHead) {
+        return;
     }
-    else if (strcmp(cmdType, "move_relative") == 0) {
-        float dx = cmd["dx"] | 0.0;
-        float dy = cmd["dy"] | 0.0;
-        moveRelative(dx, dy);
+    
+    float nextEntry = 0.0f;
+    uint8_t i = blockHead;
+    do {
+        i = prevBlockIndex(i);
+        PlannerBlock& block = blockQueue[i];
+        float reachable = sqrtf(nextEntry * nextEntry +
+                                2.0f * blockRampAccel(block) * block.millimeters);
+        block.entrySpeed = min(block.maxEntrySpeed, reachable);
+        nextEntry = block.entrySpeed;
+    } while (i != first);
+    
+    float prevExit = lockedExitSpeed;
+    for (i = first; i != blockHead; i = nextBlockIndex(i)) {
+        PlannerBlock& block = blockQueue[i];
+        block.entrySpeed = min(block.entrySpeed, prevExit);
+        prevExit = sqrtf(block.entrySpeed * block.entrySpeed +
+                         2.0f * blockRampAccel(block) * block.millimeters);
+    }
+}
+
+void serviceMotion() {
+    /**
+     * Called from the motion task while moving: retire blocks the ISR has finished,
+     * keep the segment buffer full, and report completion once the queue
+     * has drained.
+     */
+    while (blockTail != executingBlock && blockTail != prepBlock) {
+        if (blockQueue[blockTail].seq) {
+            postMotionEvent(EVENT_DONE, 0, blockQueue[blockTail].seq);
+        }
+        blockTail = nextBlockIndex(blockTail);
+    }
+    
+    if (stepperBusy) {
+        prepareSegments();
+        return;
+    }
+    
+    if (blockTail != blockHead && !segmentsFinal) {
+        startStepper();  // New blocks queued while idle
+        return;
+    }
+    
+    finishMove();
+}
+
+// ==================== STEP GENERATION ====================
+
+void startStepper() {
+    // Nothing is in flight, so the next block starts from rest
+    markParkMoving();  // Before the first step (RTC memory, no flash write)
+    lockedExitSpeed = 0.0f;
+    recalculatePlan();
+    
+    segmentHead = 0;
+    segmentTail = 0;
+    segmentTicksLeft = 0;
+    prepareSegments();
+    
+    if (segmentTail == segmentHead) {
+        return;
+    }
+    
+    executingBlock = blockTail;
+    
+    // Starting from rest: full torque for the first ramp, set before the
+    // first step goes out
+    boostUntil = millis() + (unsigned long)(activeProfile.accelTime * 1000.0f);
+    setDriverCurrent(CURRENT_BOOST);
+    
+    portENTER_CRITICAL(&stepperMux);
+    activeBlock.ticksLeft = 0;
+    stepperBusy = true;
+    portEXIT_CRITICAL(&stepperMux);
+    
+    // The first ISR pops the first segment (loading its block and DIR pins).
+    // The motion task shares the ISR's core, so its cycle count is the
+    // reference for the first interval.
+    stepIntervalUs = segmentBuffer[segmentTail].intervalUs;
+    timerAlarmWrite(stepTimer, stepIntervalUs, true);
+    timerWrite(stepTimer, 0);
+    stepLastCycle = ESP.getCycleCount();
+    timerAlarmEnable(stepTimer);
+}
+
+bool beginNextProfile() {
+    // Lock the next queued block: plan its profile from the planner's
+    // entry/exit speeds (converted from mm/s to step ticks/s)
+    if (prepBlock == blockHead) {
+        return false;
+    }
+    
+    const PlannerBlock& block = blockQueue[prepBlock];
+    uint8_t next = nextBlockIndex(prepBlock);
+    float exitSpeed = (next != blockHead) ? blockQueue[next].entrySpeed : 0.0f;
+    
+    if (block.dwellUs) {
+        // Magnet switch: no motion to plan, prepareSegments() times the ticks
+        planProfile(activeProfile, block.ticks, START_SPEED, START_SPEED, START_SPEED,
+                    ACCELERATION, false);
+    } else {
+        planProfile(activeProfile, block.ticks,
+                    max(block.entrySpeed / block.mmPerTick, (float)START_SPEED),
+                    block.nominalSpeed / block.mmPerTick,
+                    max(exitSpeed / block.mmPerTick, (float)START_SPEED),
+                    block.accel / block.mmPerTick, block.sCurve);
+    }
+    profileCursor = {0, 0.0f, 0.0f};
+    
+    lockedExitSpeed = exitSpeed;
+    prepActive = true;
+    return true;
+}
+
+void prepareSegments() {
+    /**
+     * Fill the segment buffer from the queued blocks. Runs in the motion
+     * task, so the ISR only ever copies a precomputed tick count and interval.
+     * Each segment covers ~SEGMENT_US at the speed sampled mid-segment.
+     */
+    const float dt = SEGMENT_US / 1000000.0f;
+    
+    while (true) {
+        if (!prepActive && !beginNextProfile()) {
+            portENTER_CRITICAL(&stepperMux);
+            segmentsFinal = true;
+            portEXIT_CRITICAL(&stepperMux);
+            return;
+        }
+        
+        uint8_t next = (segmentHead + 1) % SEGMENT_BUFFER_SIZE;
+        if (next == segmentTail) {
+            return;  // Buffer full
+        }
+        
+        StepSegment& seg = segmentBuffer[segmentHead];
+        seg.newBlock = (profileCursor.ticksPlanned == 0);
+        seg.block = prepBlock;
+        if (blockQueue[prepBlock].dwellUs) {
+            // Magnet switch: the dwell, then one tick at the start rate
+            seg.ticks = 1;
+            seg.intervalUs = profileCursor.ticksPlanned == 0 ? blockQueue[prepBlock].dwellUs
+                                                             : 1000000 / START_SPEED;
+            profileCursor.ticksPlanned++;
+        } else {
+            seg.ticks = nextSegment(activeProfile, profileCursor, dt,
+                                    START_SPEED, maxSpeed, seg.intervalUs);
+        }
+        
+        if (profileCursor.ticksPlanned >= activeProfile.ticks) {
+            prepActive = false;
+            prepBlock = nextBlockIndex(prepBlock);
+        }
+        
+        segmentHead = next;
+    }
+}
+
+void stopStepper() {
+    timerAlarmDisable(stepTimer);
+    idleSince = millis();
+    
+    portENTER_CRITICAL(&stepperMux);
+    activeBlock.ticksLeft = 0;
+    segmentHead = segmentTail;
+    segmentTicksLeft = 0;
+    segmentsFinal = true;
+    stepperBusy = false;
+    portEXIT_CRITICAL(&stepperMux);
+    
+    // Flush the motion queue
+    retireBlocks(EVENT_ABORTED);
+    prepBlock = blockHead;
+    executingBlock = blockHead;
+    prepActive = false;
+    lockedExitSpeed = 0.0f;
+    
+    updatePositionFromMotors();
+    plannerStepsX = currentStepsX;
+    plannerStepsY = currentStepsY;
+}
+
+void retireBlocks(MotionEventType result) {
+    // Drop every block left in the queue, reporting the tagged ones
+    // (EVENT_DONE once executed, EVENT_ABORTED when flushed)
+    for (; blockTail != blockHead; blockTail = nextBlockIndex(blockTail)) {
+        if (blockQueue[blockTail].seq) {
+            postMotionEvent(result, 0, blockQueue[blockTail].seq);
+        }
+    }
+}
+
+void stopMotion(uint16_t seq) {
+    // Emergency stop: flush the queue and hold the current position
+    stopStepper();
+    isMoving = false;
+    
+    if (homingPhase != HOMING_IDLE) {
+        homingPhase = HOMING_IDLE;
+        watchHoming = false;
+        limitHit = false;
+        LOG_I("Homing aborted");
+        if (homingSeq) {
+            postMotionEvent(EVENT_ABORTED, 0, homingSeq);
+        }
+    }
+    
+    targetStepsX = currentStepsX;
+    targetStepsY = currentStepsY;
+    postMotionEvent(EVENT_STOPPED, 0, seq);
+}
+
+void finishMove() {
+    timerAlarmDisable(stepTimer);
+    isMoving = false;
+    idleSince = millis();
+    
+    retireBlocks(EVENT_DONE);
+    
+    updatePositionFromMotors();
+    
+    // Homing moves are reported by finishHoming() instead
+    if (homingPhase == HOMING_IDLE) {
+        postMotionEvent(EVENT_MOVE_DONE);
+        LOG_D("Movement complete");
+    }
+}
+
+void readPosition(float& x, float& y) {
+    // Forward kinematics from the steps the motors actually made; safe
+    // from either core
+    portENTER_CRITICAL(&stepperMux);
+    long a = motorStepsA;
+    long b = motorStepsB;
+    portEXIT_CRITICAL(&stepperMux);
+    
+    calculateHBotPosition(a, b, stepsPerMm, x, y);
+}
+
+void updatePositionFromMotors() {
+    readPosition(currentPosX, currentPosY);
+    currentStepsX = lroundf(currentPosX * stepsPerMm);
+    currentStepsY = lroundf(currentPosY * stepsPerMm);
+}
+
+void setMotorPosition(long stepsA, long stepsB) {
+    // Define where the motors are (homing, warm boot); nothing queued
+    portENTER_CRITICAL(&stepperMux);
+    motorStepsA = stepsA;
+    motorStepsB = stepsB;
+    portEXIT_CRITICAL(&stepperMux);
+    
+    updatePositionFromMotors();
+    plannerStepsX = targetStepsX = currentStepsX;
+    plannerStepsY = targetStepsY = currentStepsY;
+}
+
+// ==================== STEP INTERRUPT ====================
+
+void IRAM_ATTR stepMotors() {
+    /**
+     * Hardware timer ISR, fires once per step tick while the stepper is
+     * busy. When the current segment is used up it pops the next
+     * precomputed one (loading a new block's step counts and DIR pins at
+     * block boundaries), then runs one Bresenham step event: the dominant
+     * motor always steps, the other steps whenever its error counter
+     * overflows. Pins are driven through the GPIO set/clear registers;
+     * no Serial or float math is allowed in here.
+     */
+    uint32_t tickCycles = ESP.getCycleCount() - stepLastCycle;
+    stepLastCycle += tickCycles;
+    
+    if (stopRequests != stopsHandled) {
+        return;  // Stop received: no more steps until the motion task flushes
+    }
+    
+    if (watchHoming) {
+        if (limitHit || homingTriggered()) {
+            limitHit = true;  // Homing trigger fired: hold here for serviceHoming()
+            return;
+        }
+    } else if (stallDetection) {
+        uint32_t diag = GPIO.in & DIAG_MASK;
+        if (diag || stallMotors) {
+            stallMotors |= diag;  // Hold here for handleStall()
+            return;
+        }
+    }
+    
+    portENTER_CRITICAL_ISR(&stepperMux);
+    
+    // How far this tick landed from the period it was programmed for
+    uint32_t expected = stepIntervalUs * cyclesPerUs;
+    recordPerf(perfStats[PERF_STEP_JITTER],
+               tickCycles > expected ? tickCycles - expected : expected - tickCycles);
+    
+    if (segmentTicksLeft == 0 && segmentTail != segmentHead) {
+        const StepSegment& seg = segmentBuffer[segmentTail];
+        segmentTicksLeft = seg.ticks;
+        stepIntervalUs = seg.intervalUs;   // Takes effect from the next tick
+        timerAlarmWrite(stepTimer, seg.intervalUs, true);
+        
+        if (seg.newBlock) {
+            const PlannerBlock& block = blockQueue[seg.block];
+            loadStepBlock(activeBlock, block.stepsA, block.stepsB, block.ticks);
+            executingBlock = seg.block;
+            
+            uint32_t dirHigh = 0;
+            uint32_t dirLow = 0;
+            (activeBlock.dirA > 0 ? dirHigh : dirLow) |= (1UL << MOTOR_A_DIR_PIN);
+            (activeBlock.dirB > 0 ? dirHigh : dirLow) |= (1UL << MOTOR_B_DIR_PIN);
+            GPIO.out_w1ts = dirHigh;
+            GPIO.out_w1tc = dirLow;
+            
+            if (block.magnets != MAGNETS_KEEP) {
+                magnetMask = block.magnets;  // Magnet switch block: change over, then dwell
+            }
+        }
+        
+        segmentTail = (segmentTail + 1) % SEGMENT_BUFFER_SIZE;
+    }
+    
+    uint8_t steps = stepBlockTick(activeBlock);
+    uint32_t pulseMask = 0;
+    
+    if (steps & STEP_A) {
+        pulseMask |= (1UL << MOTOR_A_STEP_PIN);
+        motorStepsA += activeBlock.dirA;
+    }
+    if (steps & STEP_B) {
+        pulseMask |= (1UL << MOTOR_B_STEP_PIN);
+        motorStepsB += activeBlock.dirB;
+    }
+    
+    if (pulseMask) {
+        uint32_t pulseStart = ESP.getCycleCount();
+        GPIO.out_w1ts = pulseMask;
+        while (ESP.getCycleCount() - pulseStart < stepPulseCycles) {
+            // Hold STEP high for the driver's minimum pulse width
+        }
+        GPIO.out_w1tc = pulseMask;
+    }
+    
+    if (segmentTicksLeft > 0) {
+        segmentTicksLeft--;
+    }
+    
+    // Done once the last block is stepped out and nothing more is coming;
+    // on underrun the ISR keeps ticking at the current interval until
+    // the motion task catches up
+    if (activeBlock.ticksLeft == 0 &&
+        segmentTicksLeft == 0 && segmentTail == segmentHead && segmentsFinal) {
+        stepperBusy = false;
+    }
+    
+    portEXIT_CRITICAL_ISR(&stepperMux);
+}
+
+// ==================== ELECTROMAGNET CONTROL ====================
+
+void setMagnet(int magnetIndex, bool state) {
+    // Takes effect on the motion task's next pass (serviceMagnets()). The
+    // step ISR also writes magnetMask, hence the critical section.
+    if (magnetIndex < 0 || magnetIndex >= 4) return;
+    
+    portENTER_CRITICAL(&stepperMux);
+    if (state) {
+        magnetMask = magnetMask | (1 << magnetIndex);
+    } else {
+        magnetMask = magnetMask & ~(1 << magnetIndex);
+    }
+    portEXIT_CRITICAL(&stepperMux);
+    
+    LOG_D("Magnet %d %s", magnetIndex + 1, state ? "ON" : "OFF");
+}
+
+void setAllMagnets(bool state) {
+    for (int i = 0; i < 4; i++) {
+        setMagnet(i, state);
+    }
+}
+
+void setMagnetPower(int magnet, int holdPercent, int kickMs) {
+    // Called from loop(); magnet 0 = all, 0 keeps a setting. A magnet
+    // already holding moves to the new duty on the next pass.
+    for (int i = 0; i < 4; i++) {
+        if (magnet != 0 && magnet != i + 1) continue;
+        
+        if (holdPercent > 0) magnetHoldPercent[i] = constrain(holdPercent, 10, 100);
+        if (kickMs > 0) magnetKickMs[i] = constrain(kickMs, 1, 2000);
+        
+        LOG_I("Magnet %d: kick %u ms, hold %u%%", i + 1, magnetKickMs[i], magnetHoldPercent[i]);
+    }
+}
+
+void serviceMagnets() {
+    /**
+     * Motion task: drive the magnet PWM to follow magnetMask. A magnet
+     * that turns on runs at full duty for its kick time, enough to pull
+     * the piece onto the carriage across the gap, then drops to its hold
+     * duty, which is all it takes to keep a piece that's already seated.
+     */
+    uint8_t mask = magnetMask;
+    unsigned long now = millis();
+    
+    for (int i = 0; i < 4; i++) {
+        bool on = (mask >> i) & 1;
+        if (on && !((magnetsApplied >> i) & 1)) {
+            magnetOnSince[i] = now;  // Just switched on: kick
+        }
+        
+        uint8_t duty = 0;
+        if (on) {
+            duty = now - magnetOnSince[i] < magnetKickMs[i]
+                 ? MAGNET_DUTY_MAX : magnetHoldPercent[i] * MAGNET_DUTY_MAX / 100;
+        }
+        if (duty != magnetDuty[i]) {
+            ledcWrite(MAGNET_PWM_CHANNEL + i, duty);
+            magnetDuty[i] = duty;
+        }
+    }
+    
+    magnetsApplied = mask;
+}
+
+// ==================== FAN CONTROL ====================
+
+void setFanSpeed(int fanIndex, int pwmValue) {
+    if (fanIndex < 0 || fanIndex >= 4) return;
+    
+    pwmValue = constrain(pwmValue, 0, 255);
+    ledcWrite(fanIndex, pwmValue);
+    
+    fanPwm[fanIndex] = pwmValue;
+    
+    LOG_D("Fan %d speed: %d", fanIndex + 1, pwmValue);
+}
+
+void setFanAuto(int fanIndex) {
+    // Hand a fan back to the thermal curve (set_fan without a speed)
+    if (fanIndex < 0 || fanIndex >= 4) return;
+    fanAuto[fanIndex] = true;
+}
+
+// ==================== THERMAL CONTROL ====================
+
+void thermalTask(void* param) {
+    /**
+     * Polls both drivers' DRV_STATUS (one register read each) every
+     * THERMAL_INTERVAL_MS and drives automatic fans on a curve.
+     *
+     * Runs at loop() priority on the UART core; it only competes with the
+     * motion task for MotorSerial, a few hundred microseconds per poll,
+     * and never for step timing. Fans speed up at once and slow down by
+     * FAN_RAMP_DOWN per poll, so they don't hunt around a threshold.
+     */
+    TickType_t lastWake = xTaskGetTickCount();
+    
+    for (;;) {
+        ThermalLevel level = max(readDriverThermal(driverA), readDriverThermal(driverB));
+        int target = THERMAL_FAN_PWM[level];
+
+#if THERMISTOR_PIN >= 0
+        driverTemperature = readThermistor();
+        if (!isnan(driverTemperature)) {
+            float u = constrain((driverTemperature - FAN_TEMP_LOW) / (FAN_TEMP_HIGH - FAN_TEMP_LOW), 0.0f, 1.0f);
+            target = max(target, (int)(FAN_MIN_PWM + u * (FAN_MAX_PWM - FAN_MIN_PWM)));
+        }
+#endif
+
+        thermalLevel = level;
+        
+        for (int i = 0; i < 4; i++) {
+            if (!fanAuto[i]) continue;
+            
+            int pwm = target >= fanPwm[i] ? target : max(target, fanPwm[i] - FAN_RAMP_DOWN);
+            if (pwm != fanPwm[i]) {
+                setFanSpeed(i, pwm);
+            }
+        }
+        
+        vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(THERMAL_INTERVAL_MS));
+    }
+}
+
+ThermalLevel readDriverThermal(TMC2226Stepper& driver) {
+    xSemaphoreTake(driverBus, portMAX_DELAY);
+    uint32_t status = driver.DRV_STATUS();
+    xSemaphoreGive(driverBus);
+    
+    // A read without reply comes back as all ones; don't act on it
+    if (status == 0xFFFFFFFF) {
+        return THERMAL_NORMAL;
+    }
+    
+    // DRV_STATUS: bit 0 otpw, 1 ot, 8 t120, 9 t143, 10 t150, 11 t157
+    if (status & ((1UL << 1) | (1UL << 11))) return THERMAL_OVERTEMP;
+    if (status & ((1UL << 9) | (1UL << 10))) return THERMAL_HOT;
+    if (status & ((1UL << 0) | (1UL << 8))) return THERMAL_WARM;
+    return THERMAL_NORMAL;
+}
+
+float readThermistor() {
+    // NTC to GND, 10k to 3.3 V: R = 10k * V / (3.3 V - V), then beta equation
+    uint32_t mv = analogReadMilliVolts(THERMISTOR_PIN);
+    if (mv == 0 || mv >= 3300) {
+        return NAN;  // Shorted or not connected
+    }
+    
+    float resistance = 10000.0f * mv / (3300.0f - mv);
+    float kelvin = 1.0f / (1.0f / 298.15f + logf(resistance / 10000.0f) / 3950.0f);
+    return kelvin - 273.15f;
+}
+
+void reportThermal() {
+    // Called from loop(): tell the Pi whenever the thermal level changes
+    ThermalLevel level = thermalLevel;
+    if (level == reportedThermal) {
+        return;
+    }
+    
+    static const char* const names[] = {"normal", "warm", "hot", "overtemp"};
+    reportedThermal = level;
+    LOG_W("Driver temperature: %s", names[level]);
+    sendStatus("thermal", names[level]);
+}
+
+// ==================== CONFIG STORE ====================
+
+void defaultConfig(MotorConfig& config) {
+    // The build settings, used when NVS holds nothing valid
+    config = {};
+    config.version = CONFIG_VERSION;
+    config.stepsPerMm = STEPS_PER_MM;
+    config.travelX = MAX_X_MM;
+    config.travelY = MAX_Y_MM;
+    config.speed = DEFAULT_SPEED;
+    config.maxSpeed = MAX_SPEED;
+    config.accel = ACCELERATION;
+    config.sCurve = S_CURVE_ACCEL;
+    config.carrySpeed = CARRY_SPEED;
+    config.carryAccel = CARRY_ACCELERATION;
+    config.current[CURRENT_HOLD] = MOTOR_CURRENT_HOLD;
+    config.current[CURRENT_RUN] = MOTOR_CURRENT_RUN;
+    config.current[CURRENT_BOOST] = MOTOR_CURRENT_BOOST;
+    config.holdDelayMs = HOLD_DELAY_MS;
+    config.stallDetection = STALL_DETECTION;
+    config.sensorlessHoming = SENSORLESS_HOMING;
+    config.stallThreshold = STALL_THRESHOLD;
+    for (int i = 0; i < 4; i++) {
+        config.magnetHold[i] = MAGNET_HOLD_DUTY;
+        config.magnetKick[i] = MAGNET_KICK_MS;
+    }
+    config.warmBoot = WARM_BOOT;
+}
+
+void captureConfig(MotorConfig& config) {
+    // The settings currently in effect
+    config = {};
+    config.version = CONFIG_VERSION;
+    config.stepsPerMm = stepsPerMm;
+    config.travelX = travelX;
+    config.travelY = travelY;
+    config.originX = originX;
+    config.originY = originY;
+    config.speed = currentSpeed;
+    config.maxSpeed = maxSpeed;
+    config.accel = currentAccel;
+    config.sCurve = sCurveEnabled;
+    config.carrySpeed = carrySpeed;
+    config.carryAccel = carryAccel;
+    memcpy(config.current, currentSettings, sizeof(config.current));
+    config.holdDelayMs = holdDelayMs;
+    config.stallDetection = stallDetection;
+    config.sensorlessHoming = sensorlessHoming;
+    config.stallThreshold = stallThreshold;
+    memcpy(config.magnetHold, magnetHoldPercent, sizeof(config.magnetHold));
+    memcpy(config.magnetKick, magnetKickMs, sizeof(config.magnetKick));
+    config.warmBoot = warmBoot;
+}
+
+void applyConfig(const MotorConfig& config) {
+    /**
+     * Put a configuration into effect, clamped to what the hardware takes.
+     * Driver registers follow on the motion task's next pass. A new
+     * steps/mm or origin maps the motor position to other coordinates,
+     * so it clears the homed flag (serviceParking() then drops the park
+     * record).
+     */
+    float newStepsPerMm = constrain(config.stepsPerMm, 1.0f, 1000.0f);
+    if (isHomed && (newStepsPerMm != stepsPerMm || config.originX != originX ||
+                    config.originY != originY)) {
+        isHomed = false;
+        LOG_W("Calibration changed, home again before moving");
+    }
+    
+    stepsPerMm = newStepsPerMm;
+    travelX = constrain(config.travelX, 10.0f, 2000.0f);
+    travelY = constrain(config.travelY, 10.0f, 2000.0f);
+    originX = constrain(config.originX, -travelX, travelX);
+    originY = constrain(config.originY, -travelY, travelY);
+    maxSpeed = constrain(config.maxSpeed, (float)START_SPEED, (float)MAX_STEP_RATE);
+    currentSpeed = constrain(config.speed, (float)START_SPEED, maxSpeed);
+    currentAccel = constrain(config.accel, 100.0f, 50000.0f);
+    sCurveEnabled = config.sCurve;
+    carrySpeed = constrain(config.carrySpeed, (float)START_SPEED, maxSpeed);
+    carryAccel = constrain(config.carryAccel, 100.0f, 50000.0f);
+    warmBoot = config.warmBoot;
+    
+    setMotorCurrents(config.current[CURRENT_RUN], config.current[CURRENT_HOLD],
+                     config.current[CURRENT_BOOST], config.holdDelayMs);
+    setStallGuard(config.stallDetection, config.sensorlessHoming, config.stallThreshold);
+    for (int i = 0; i < 4; i++) {
+        setMagnetPower(i + 1, config.magnetHold[i], config.magnetKick[i]);
+    }
+}
+
+void loadConfig() {
+    /**
+     * Boot: the stored configuration over the build defaults, and the park
+     * record. A blob of another size or version (written by other firmware)
+     * is ignored as a whole rather than half applied.
+     */
+    configStore.begin(CONFIG_NAMESPACE, false);
+    
+    MotorConfig config;
+    defaultConfig(config);
+    
+    MotorConfig stored;
+    if (configStore.getBytesLength("config") == sizeof(stored) &&
+        configStore.getBytes("config", &stored, sizeof(stored)) == sizeof(stored) &&
+        stored.version == CONFIG_VERSION) {
+        config = stored;
+        configStored = true;
+        LOG_I("Configuration loaded from NVS");
+    } else {
+        LOG_I("No stored configuration, using build defaults");
+    }
+    applyConfig(config);
+    
+    // Park records used to be kept here; a stale one could be trusted
+    // after a power cut mid-move
+    if (configStore.isKey("park")) {
+        configStore.remove("park");
+    }
+}
+
+void saveConfig() {
+    // Only while the gantry is idle: NVS writes stall both cores' caches
+    MotorConfig config;
+    captureConfig(config);
+    configStored = configStore.putBytes("config", &config, sizeof(config)) == sizeof(config);
+    if (!configStored) {
+        LOG_E("Saving the configuration failed");
+    }
+}
+
+bool motionIdle() {
+    // Nothing moving, homing or waiting for the motion task
+    return !isMoving && homingPhase == HOMING_IDLE && motionCommands.empty();
+}
+
+void setConfig(JsonObject cmd) {
+    /**
+     * set_config: change any of the get_config fields, put them into
+     * effect and (unless "save" is false) store the whole configuration,
+     * so later boots start with it. Refused while the gantry is busy: the
+     * planner reads these settings mid-move, and an NVS write would stall
+     * the step timer.
+     */
+    if (!motionIdle()) {
+        failCommand("Busy, stop the gantry first");
+        return;
+    }
+    
+    MotorConfig config;
+    captureConfig(config);
+    
+    config.stepsPerMm = cmd["steps_per_mm"] | config.stepsPerMm;
+    config.travelX = cmd["travel_x"] | config.travelX;
+    config.travelY = cmd["travel_y"] | config.travelY;
+    config.originX = cmd["origin_x"] | config.originX;
+    config.originY = cmd["origin_y"] | config.originY;
+    config.speed = cmd["speed"] | config.speed;
+    config.maxSpeed = cmd["max_speed"] | config.maxSpeed;
+    config.accel = cmd["accel"] | config.accel;
+    if (cmd.containsKey("profile")) {
+        const char* profile = cmd["profile"];
+        config.sCurve = profile && strcmp(profile, "scurve") == 0;
+    }
+    config.carrySpeed = cmd["carry_speed"] | config.carrySpeed;
+    config.carryAccel = cmd["carry_accel"] | config.carryAccel;
+    
+    JsonObject current = cmd["current"];
+    config.current[CURRENT_RUN] = current["run"] | config.current[CURRENT_RUN];
+    config.current[CURRENT_HOLD] = current["hold"] | config.current[CURRENT_HOLD];
+    config.current[CURRENT_BOOST] = current["boost"] | config.current[CURRENT_BOOST];
+    config.holdDelayMs = current["hold_delay"] | config.holdDelayMs;
+    
+    JsonObject stall = cmd["stall"];
+    config.stallDetection = stall["detect"] | config.stallDetection;
+    config.sensorlessHoming = stall["sensorless"] | config.sensorlessHoming;
+    config.stallThreshold = stall["threshold"] | config.stallThreshold;
+    
+    JsonArray magnetHold = cmd["magnet_hold"];
+    JsonArray magnetKick = cmd["magnet_kick"];
+    for (int i = 0; i < 4; i++) {
+        config.magnetHold[i] = magnetHold[i] | config.magnetHold[i];
+        config.magnetKick[i] = magnetKick[i] | config.magnetKick[i];
+    }
+    
+    config.warmBoot = cmd["warm_boot"] | config.warmBoot;
+    bool save = cmd["save"] | true;
+    
+    applyConfig(config);
+    if (save) {
+        saveConfig();
+    }
+    sendConfig();
+}
+
+void resetConfig() {
+    // Back to the build defaults, and nothing stored
+    if (!motionIdle()) {
+        failCommand("Busy, stop the gantry first");
+        return;
+    }
+    
+    MotorConfig config;
+    defaultConfig(config);
+    applyConfig(config);
+    configStore.remove("config");
+    configStored = false;
+    sendConfig();
+}
+
+void sendConfig() {
+    // Reply to get_config / set_config; always JSON, like get_stats
+    MotorConfig config;
+    captureConfig(config);
+    
+    jsonDoc.clear();
+    jsonDoc["type"] = "config";
+    jsonDoc["controller"] = "motor";
+    jsonDoc["version"] = CONFIG_VERSION;
+    jsonDoc["stored"] = configStored;
+    jsonDoc["steps_per_mm"] = config.stepsPerMm;
+    jsonDoc["travel_x"] = config.travelX;
+    jsonDoc["travel_y"] = config.travelY;
+    jsonDoc["origin_x"] = config.originX;
+    jsonDoc["origin_y"] = config.originY;
+    jsonDoc["speed"] = config.speed;
+    jsonDoc["max_speed"] = config.maxSpeed;
+    jsonDoc["accel"] = config.accel;
+    jsonDoc["profile"] = config.sCurve ? "scurve" : "trapezoid";
+    jsonDoc["carry_speed"] = config.carrySpeed;
+    jsonDoc["carry_accel"] = config.carryAccel;
+    
+    JsonObject current = jsonDoc.createNestedObject("current");
+    current["run"] = config.current[CURRENT_RUN];
+    current["hold"] = config.current[CURRENT_HOLD];
+    current["boost"] = config.current[CURRENT_BOOST];
+    current["hold_delay"] = config.holdDelayMs;
+    
+    JsonObject stall = jsonDoc.createNestedObject("stall");
+    stall["detect"] = config.stallDetection;
+    stall["sensorless"] = config.sensorlessHoming;
+    stall["threshold"] = config.stallThreshold;
+    
+    JsonArray magnetHold = jsonDoc.createNestedArray("magnet_hold");
+    JsonArray magnetKick = jsonDoc.createNestedArray("magnet_kick");
+    for (int i = 0; i < 4; i++) {
+        magnetHold.add(config.magnetHold[i]);
+        magnetKick.add(config.magnetKick[i]);
+    }
+    
+    jsonDoc["warm_boot"] = config.warmBoot;
+    
+    serializeJson(jsonDoc, Serial1);
+    Serial1.println();
+}
+
+bool restoreParkedPosition() {
+    /**
+     * Boot: a clean park record means the motors were idle, holding, at
+     * that position when the controller reset, so it is taken as homed.
+     * Anything else (no record, reset mid-move, warm boot disabled) needs
+     * a home as before, and so does any reset that cleared RTC memory.
+     */
+    if (parkMagic != PARK_RTC_MAGIC) {
+        parkRecord = {0, 0, PARK_NONE};
+        parkMagic = PARK_RTC_MAGIC;
+    }
+    
+    if (!warmBoot || parkRecord.state != PARK_CLEAN) {
+        return false;
+    }
+    
+    setMotorPosition(parkRecord.stepsA, parkRecord.stepsB);
+    isHomed = true;
+    LOG_I("Warm boot: parked at (%.1f, %.1f)", currentPosX, currentPosY);
+    return true;
+}
+
+void writeParkRecord(ParkState state) {
+    // Motion task, step timer off, so the steps can't change underneath
+    parkRecord = {(int32_t)motorStepsA, (int32_t)motorStepsB, state};
+}
+
+void markParkMoving() {
+    // Start of a move: from here on a reset must not trust the position
+    parkRecord.state = PARK_MOVING;
+}
+
+void serviceParking() {
+    // Motion task: once the gantry has been idle for PARK_DELAY_MS, record
+    // it as parked (or forget the position once it is no longer homed)
+    if (isMoving || homingPhase != HOMING_IDLE || millis() - idleSince < PARK_DELAY_MS) {
+        return;
+    }
+    writeParkRecord(isHomed && warmBoot ? PARK_CLEAN : PARK_NONE);
+}
+
+// ==================== UART COMMAND PROCESSING ====================
+
+void feedLineByte(char c) {
+    /**
+     * Append one byte to the JSON line buffer and run the command on '\n'.
+     * A line longer than LINE_BUFFER_SIZE is dropped as a whole and
+     * reported once, instead of growing without bound.
+     */
+    if (c == '\n') {
+        if (lineOverflow) {
+            lineOverflow = false;
+        } else if (lineLength > 0) {
+            uint32_t start = ESP.getCycleCount();
+            processUARTCommand();
+            endCommand();
+            recordPerf(perfStats[PERF_COMMAND], ESP.getCycleCount() - start);
+        }
+        lineLength = 0;
+        return;
+    }
+    
+    if (c == '\r' || lineOverflow) {
+        return;
+    }
+    
+    if (lineLength >= LINE_BUFFER_SIZE - 1) {
+        LOG_W("UART line overflow, dropping command");
+        linkCounters.lineOverflows++;
+        sendStatus("error", "Command too long");
+        lineOverflow = true;
+        lineLength = 0;
+        return;
+    }
+    
+    lineBuffer[lineLength++] = c;
+}
+
+void beginCommand(uint16_t seq) {
+    /**
+     * Start running a received command. A tagged one (seq != 0) is acked
+     * straight away and later gets exactly one done or error: from
+     * endCommand() for commands that finish on the spot, from failCommand()
+     * when rejected, or from the motion task once a queued move has
+     * finished.
+     */
+    commandSeq = seq;
+    commandDeferred = false;
+    sendReply(OP_ACK, seq);
+}
+
+void endCommand() {
+    if (!commandDeferred) {
+        sendReply(OP_DONE, commandSeq);
+    }
+    commandSeq = 0;
+}
+
+void failCommand(const char* message) {
+    // Reject the current command; no done follows
+    reportCommandError(commandSeq, message);
+    commandSeq = 0;
+}
+
+int8_t parseMagnets(JsonVariant value, int8_t fallback) {
+    // "magnets": a mask (bit n = magnet n + 1), true = all, false = none
+    if (value.is<bool>()) {
+        return value.as<bool>() ? MAGNETS_ALL : 0;
+    }
+    if (value.is<int>()) {
+        return value.as<int>() & MAGNETS_ALL;
+    }
+    return fallback;
+}
+
+void processUARTCommand() {
+    // Parse JSON command in place: a mutable char* lets ArduinoJson point
+    // its strings into lineBuffer instead of copying them
+    lineBuffer[lineLength] = '\0';
+    DeserializationError error = deserializeJson(jsonDoc, lineBuffer, lineLength);
+    
+    if (error) {
+        LOG_W("JSON parse error: %s", error.c_str());
+        linkCounters.jsonErrors++;
+        reportLinkError();
+        return;
+    }
+    
+    linkErrors = 0;
+    
+    JsonObject cmd = jsonDoc.as<JsonObject>();
+    const char* cmdType = cmd["cmd"];
+    
+    if (cmdType == nullptr) {
+        LOG_W("No 'cmd' field in JSON");
+        return;
+    }
+    
+    // {"cmd":...,"seq":N} asks for ack/done/error replies tagged with N
+    beginCommand(cmd["seq"] | 0);
+    
+    // Route command
+    if (strcmp(cmdType, "home") == 0) {
+        queueTaggedCommand({CMD_HOME, 0, 0, 0, 0, PROFILE_KEEP, MAGNETS_KEEP, 0});
+    }
+    else if (strcmp(cmdType, "move_absolute") == 0 || strcmp(cmdType, "queue_move") == 0) {
+        MotionCommand move = {CMD_MOVE_ABSOLUTE, cmd["x"] | 0.0f, cmd["y"] | 0.0f,
+                              cmd["speed"] | 0.0f, cmd["accel"] | 0.0f, PROFILE_KEEP,
+                              parseMagnets(cmd["magnets"], MAGNETS_KEEP), 0};
+        
+        if (cmd.containsKey("profile")) {
+            const char* profile = cmd["profile"];
+            move.profile = (profile && strcmp(profile, "scurve") == 0) ? 1 : 0;
+        }
+        
+        queueTaggedCommand(move);
+    }
+    else if (strcmp(cmdType, "path") == 0) {
+        // {"cmd":"path","points":[[x,y],...],"speed":...}
+        // Queued as one blended motion; only the last point stops. A point
+        // may be [x,y,magnets]: the magnets hold until a later point changes them
+        JsonArray points = cmd["points"];
+        
+        if (points.isNull() || points.size() == 0) {
+            failCommand("Path has no points");
+            return;
+        }
+        if (points.size() > MAX_PATH_POINTS) {
+            // Never fits, unlike a full queue: retrying can't help
+            char message[48];
+            snprintf(message, sizeof(message), "Path too long (max %d points)", MAX_PATH_POINTS);
+            failCommand(message);
+            return;
+        }
+        
+        // The speed rides on the first point and applies to the rest; the
+        // last point carries the sequence ID, so done means the path ended
+        if (!reserveMotionCommands(points.size())) {
+            return;
+        }
+        
+        float speed = cmd["speed"] | 0.0f;
+        int8_t magnets = MAGNETS_KEEP;
+        size_t remaining = points.size();
+        for (JsonVariant point : points) {
+            JsonArray xy = point.as<JsonArray>();
+            magnets = parseMagnets(xy[2], magnets);
+            MotionCommand move = {CMD_MOVE_ABSOLUTE, xy[0] | 0.0f, xy[1] | 0.0f, speed, 0, PROFILE_KEEP, magnets, 0};
+            if (--remaining == 0) {
+                queueTaggedCommand(move);
+            } else {
+                queueMotionCommand(move);
+            }
+            speed = 0;
+        }
+    }
+    else if (strcmp(cmdType, "move_relative") == 0) {
+        queueTaggedCommand({CMD_MOVE_RELATIVE, cmd["dx"] | 0.0f, cmd["dy"] | 0.0f, 0, 0, PROFILE_KEEP, MAGNETS_KEEP, 0});
     }
     else if (strcmp(cmdType, "magnet_on") == 0) {
         if (cmd.containsKey("magnet")) {
@@ -507,29 +2629,387 @@ void processUARTCommand() {
             setAllMagnets(false);
         }
     }
+    else if (strcmp(cmdType, "set_magnet_power") == 0) {
+        // {"cmd":"set_magnet_power","magnet":1,"hold":40,"kick":150}, no magnet = all
+        setMagnetPower(cmd["magnet"] | 0, cmd["hold"] | 0, cmd["kick"] | 0);
+    }
     else if (strcmp(cmdType, "set_fan") == 0) {
+        // A speed overrides the thermal curve for that fan; without one
+        // (or with "auto": true) the fan goes back to automatic
         int fan = cmd["fan"] | 1;
-        int speed = cmd["speed"] | 128;
-        setFanSpeed(fan - 1, speed);
+        if (!cmd.containsKey("speed") || (cmd["auto"] | false)) {
+            setFanAuto(fan - 1);
+        } else if (fan >= 1 && fan <= 4) {
+            fanAuto[fan - 1] = false;
+            setFanSpeed(fan - 1, cmd["speed"] | 128);
+        }
     }
     else if (strcmp(cmdType, "stop") == 0) {
-        isMoving = false;
-        targetStepsX = currentStepsX;
-        targetStepsY = currentStepsY;
-        sendStatus("stopped", "Movement stopped");
+        requestStop();
     }
     else if (strcmp(cmdType, "get_position") == 0) {
         sendPositionUpdate();
     }
+    else if (strcmp(cmdType, "set_protocol") == 0) {
+        // Acknowledged in the old format, then outgoing messages switch
+        const char* mode = cmd["mode"] | "json";
+        bool binary = strcmp(mode, "binary") == 0;
+        sendStatus("protocol", binary ? "binary" : "json");
+        binaryProtocol = binary;
+    }
+    else if (strcmp(cmdType, "set_baud") == 0) {
+        requestBaudRate(cmd["baud"] | (uint32_t)UART_BAUD);
+    }
+    else if (strcmp(cmdType, "set_current") == 0) {
+        // {"cmd":"set_current","run":500,"hold":200,"boost":600,"hold_delay":500}
+        setMotorCurrents(cmd["run"] | 0, cmd["hold"] | 0, cmd["boost"] | 0, cmd["hold_delay"] | 0);
+    }
+    else if (strcmp(cmdType, "get_stats") == 0) {
+        // {"cmd":"get_stats","reset":true} clears the counters after reading
+        sendStats(cmd["reset"] | false);
+    }
+    else if (strcmp(cmdType, "reset_stats") == 0) {
+        resetStats();
+    }
+    else if (strcmp(cmdType, "set_telemetry") == 0) {
+        // {"cmd":"set_telemetry","rate":50} streams position while moving
+        setTelemetryRate(cmd["rate"] | 0);
+    }
+    else if (strcmp(cmdType, "set_stall") == 0) {
+        // {"cmd":"set_stall","detect":true,"sensorless":false,"threshold":80}
+        setStallGuard(cmd["detect"] | (bool)stallDetection,
+                      cmd["sensorless"] | (bool)sensorlessHoming,
+                      cmd["threshold"] | (int)stallThreshold);
+    }
+    else if (strcmp(cmdType, "get_config") == 0) {
+        sendConfig();
+    }
+    else if (strcmp(cmdType, "set_config") == 0) {
+        // Any subset of the get_config fields; "save": false to try them out
+        setConfig(cmd);
+    }
+    else if (strcmp(cmdType, "reset_config") == 0) {
+        resetConfig();
+    }
     else {
-        Serial.print("Unknown command: ");
-        Serial.println(cmdType);
+        LOG_W("Unknown command: %s", cmdType);
+        failCommand("Unknown command");
+    }
+}
+
+// ==================== BINARY PROTOCOL ====================
+
+int16_t readInt16(const uint8_t* p) {
+    return (int16_t)(p[0] | (p[1] << 8));
+}
+
+uint16_t readUint16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+void writeInt16(uint8_t* p, int16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+}
+
+bool feedFrameByte(uint8_t c) {
+    /**
+     * Feed one received byte to the binary frame parser.
+     *
+     * Returns true if the byte belongs to a binary frame (start, body or
+     * CRC), false if it should go to the JSON line buffer instead. Frames
+     * with a bad CRC are dropped and reported as an error status.
+     */
+    FrameParser& f = frameParser;
+    
+    switch (f.feed(c, millis())) {
+        case FRAME_TEXT:
+            return false;
+        
+        case FRAME_READY: {
+            linkErrors = 0;
+            uint32_t start = ESP.getCycleCount();
+            if (f.data[0] == OP_SEQ && f.length >= 4) {
+                // Tagged: [OP_SEQ][seq lo][seq hi][opcode][payload...]
+                beginCommand(readUint16(f.data + 1));
+                processBinaryFrame(f.data[3], f.data + 4, f.length - 4);
+            } else {
+                processBinaryFrame(f.data[0], f.data + 1, f.length - 1);
+            }
+            endCommand();
+            recordPerf(perfStats[PERF_COMMAND], ESP.getCycleCount() - start);
+            return true;
+        }
+        
+        case FRAME_BAD_CRC:
+            LOG_W("Binary frame CRC error");
+            linkCounters.crcErrors++;
+            sendStatus("error", "CRC error");
+            reportLinkError();
+            return true;
+        
+        default:
+            return true;
+    }
+}
+
+void sendFrame(uint8_t opcode, const uint8_t* payload, uint8_t len) {
+    uint8_t frame[FRAME_MAX_LEN + 4];
+    len = min(len, (uint8_t)(FRAME_MAX_LEN - 1));
+    
+    frame[0] = FRAME_SYNC;
+    frame[1] = len + 1;
+    frame[2] = opcode;
+    memcpy(frame + 3, payload, len);
+    
+    uint16_t crc = 0xFFFF;
+    for (int i = 1; i < len + 3; i++) {
+        crc = crc16Update(crc, frame[i]);
+    }
+    frame[len + 3] = crc & 0xFF;
+    frame[len + 4] = crc >> 8;
+    
+    Serial1.write(frame, len + 5);
+}
+
+void processBinaryFrame(uint8_t opcode, const uint8_t* payload, uint8_t len) {
+    // Same actions as processUARTCommand(), fixed-layout payloads
+    switch (opcode) {
+        case OP_SET_PROTOCOL:
+            if (len >= 1) {
+                bool binary = payload[0] != 0;
+                sendStatus("protocol", binary ? "binary" : "json");
+                binaryProtocol = binary;
+            }
+            break;
+        
+        case OP_SET_BAUD:
+            if (len >= 4) {
+                requestBaudRate((uint32_t)payload[0] | ((uint32_t)payload[1] << 8) |
+                                ((uint32_t)payload[2] << 16) | ((uint32_t)payload[3] << 24));
+            }
+            break;
+        
+        case OP_BAUD_TEST:
+            handleBaudTest(payload, len);
+            break;
+        
+        case OP_HOME:
+            queueTaggedCommand({CMD_HOME, 0, 0, 0, 0, PROFILE_KEEP, MAGNETS_KEEP, 0});
+            break;
+        
+        case OP_MOVE_ABSOLUTE:
+            if (len >= 6) {
+                queueTaggedCommand({CMD_MOVE_ABSOLUTE, readInt16(payload) / 10.0f, readInt16(payload + 2) / 10.0f,
+                                    (float)readUint16(payload + 4), 0, PROFILE_KEEP, MAGNETS_KEEP, 0});
+            }
+            break;
+        
+        case OP_MOVE_RELATIVE:
+            if (len >= 4) {
+                queueTaggedCommand({CMD_MOVE_RELATIVE, readInt16(payload) / 10.0f, readInt16(payload + 2) / 10.0f,
+                                    0, 0, PROFILE_KEEP, MAGNETS_KEEP, 0});
+            }
+            break;
+        
+        case OP_PATH:
+            if (len >= 6 && reserveMotionCommands((len - 2) / 4)) {
+                float speed = readUint16(payload);
+                for (int i = 2; i + 4 <= len; i += 4) {
+                    MotionCommand move = {CMD_MOVE_ABSOLUTE, readInt16(payload + i) / 10.0f,
+                                          readInt16(payload + i + 2) / 10.0f, speed, 0, PROFILE_KEEP, MAGNETS_KEEP, 0};
+                    if (i + 8 > len) {
+                        queueTaggedCommand(move);  // Last point
+                    } else {
+                        queueMotionCommand(move);
+                    }
+                    speed = 0;
+                }
+            }
+            break;
+        
+        case OP_MAGNET_PATH:
+            if (len >= 7 && reserveMotionCommands((len - 2) / 5)) {
+                float speed = readUint16(payload);
+                int8_t magnets = MAGNETS_KEEP;
+                for (int i = 2; i + 5 <= len; i += 5) {
+                    if (payload[i + 4] != 0xFF) {
+                        magnets = payload[i + 4] & MAGNETS_ALL;
+                    }
+                    MotionCommand move = {CMD_MOVE_ABSOLUTE, readInt16(payload + i) / 10.0f,
+                                          readInt16(payload + i + 2) / 10.0f, speed, 0, PROFILE_KEEP, magnets, 0};
+                    if (i + 10 > len) {
+                        queueTaggedCommand(move);  // Last point
+                    } else {
+                        queueMotionCommand(move);
+                    }
+                    speed = 0;
+                }
+            }
+            break;
+        
+        case OP_STOP:
+            requestStop();
+            break;
+        
+        case OP_GET_POSITION:
+            sendPositionUpdate();
+            break;
+        
+        case OP_MAGNET:
+            if (len >= 2) {
+                if (payload[0] == 0) {
+                    setAllMagnets(payload[1] != 0);
+                } else {
+                    setMagnet(payload[0] - 1, payload[1] != 0);
+                }
+            }
+            break;
+        
+        case OP_SET_MAGNET_POWER:
+            if (len >= 4) {
+                setMagnetPower(payload[0], payload[1], readUint16(payload + 2));
+            }
+            break;
+        
+        case OP_SET_FAN:
+            if (len >= 2 && payload[0] >= 1 && payload[0] <= 4) {
+                fanAuto[payload[0] - 1] = false;
+                setFanSpeed(payload[0] - 1, payload[1]);
+            } else if (len == 1) {
+                setFanAuto(payload[0] - 1);
+            }
+            break;
+        
+        case OP_SET_CURRENT:
+            if (len >= 8) {
+                setMotorCurrents(readUint16(payload), readUint16(payload + 2),
+                                 readUint16(payload + 4), readUint16(payload + 6));
+            }
+            break;
+        
+        case OP_SET_TELEMETRY:
+            if (len >= 1) {
+                setTelemetryRate(payload[0]);
+            }
+            break;
+        
+        case OP_SET_STALL:
+            if (len >= 2) {
+                setStallGuard(payload[0] & 0x01, payload[0] & 0x02, payload[1]);
+            }
+            break;
+        
+        default:
+            LOG_W("Unknown opcode: 0x%02X", opcode);
+            failCommand("Unknown command");
+            break;
+    }
+}
+
+// ==================== LINK SPEED ====================
+
+void applyBaudRate(uint32_t baud) {
+    Serial1.flush();                // Let pending replies leave at the old rate
+    Serial1.updateBaudRate(baud);
+    linkBaud = baud;
+    
+    // Anything half-received was garbled by the switch
+    frameParser.state = 0;
+    lineLength = 0;
+    lineOverflow = false;
+}
+
+void requestBaudRate(uint32_t baud) {
+    /**
+     * Switch the Pi link to a faster rate, tentatively.
+     *
+     * The acknowledgement goes out at the current rate, then both ends
+     * switch. The Pi sends CRC-checked OP_BAUD_TEST bursts that are echoed
+     * back, and an empty OP_BAUD_TEST to confirm. Without that confirmation
+     * within BAUD_CONFIRM_MS the previous rate is restored.
+     */
+    if (baud < UART_BAUD || baud > MAX_UART_BAUD) {
+        failCommand("Unsupported baud rate");
+        return;
+    }
+    
+    char message[12];
+    snprintf(message, sizeof(message), "%lu", (unsigned long)baud);
+    sendStatus("baud", message);
+    
+    if (!baudPending) {
+        fallbackBaud = linkBaud;
+    }
+    applyBaudRate(baud);
+    baudPending = true;
+    baudSwitchTime = millis();
+    LOG_I("UART: trying %lu baud", (unsigned long)baud);
+}
+
+void handleBaudTest(const uint8_t* payload, uint8_t len) {
+    if (len > 0) {
+        // Test burst: echo it so the Pi can check the return direction too
+        sendFrame(OP_BAUD_TEST, payload, len);
+        baudSwitchTime = millis();
+        return;
+    }
+    
+    if (baudPending) {
+        baudPending = false;
+        linkErrors = 0;
+        LOG_I("UART: %lu baud confirmed", (unsigned long)linkBaud);
+    }
+    sendStatus("baud", "confirmed");
+}
+
+void serviceLinkSpeed() {
+    if (baudPending && millis() - baudSwitchTime > BAUD_CONFIRM_MS) {
+        baudPending = false;
+        applyBaudRate(fallbackBaud);
+        LOG_W("UART: not confirmed, back to %lu baud", (unsigned long)fallbackBaud);
+    }
+}
+
+void reportLinkError() {
+    /**
+     * Called for every corrupted frame or unparseable line. A single error
+     * during negotiation, or BAUD_ERROR_LIMIT in a row afterwards, drops
+     * the link back to UART_BAUD, where the Pi can negotiate again.
+     */
+    if (linkBaud == UART_BAUD) {
+        return;
+    }
+    
+    if (baudPending || ++linkErrors >= BAUD_ERROR_LIMIT) {
+        baudPending = false;
+        linkErrors = 0;
+        applyBaudRate(UART_BAUD);
+        LOG_W("UART: too many errors, back to default baud rate");
+        sendStatus("baud", "fallback");
     }
 }
 
 // ==================== STATUS REPORTING ====================
 
 void sendStatus(const char* status, const char* message) {
+    if (binaryProtocol) {
+        uint8_t payload[FRAME_MAX_LEN - 1];
+        size_t statusLen = min(strlen(status), sizeof(payload) - 1);
+        memcpy(payload, status, statusLen);
+        payload[statusLen] = '\0';
+        
+        size_t len = statusLen + 1;
+        if (message) {
+            size_t messageLen = min(strlen(message), sizeof(payload) - len);
+            memcpy(payload + len, message, messageLen);
+            len += messageLen;
+        }
+        
+        sendFrame(OP_STATUS, payload, len);
+        return;
+    }
+    
     jsonDoc.clear();
     jsonDoc["type"] = "status";
     jsonDoc["status"] = status;
@@ -543,13 +3023,313 @@ void sendStatus(const char* status, const char* message) {
     Serial1.println();
 }
 
+void sendReply(uint8_t opcode, uint16_t seq, const char* message) {
+    /**
+     * Ack/done/error for a tagged command (OP_ACK, OP_DONE or OP_ERROR).
+     * Untagged commands (seq 0) get no replies. Uses its own small
+     * document, so it is safe while jsonDoc still holds the command.
+     */
+    if (seq == 0) {
+        return;
+    }
+    
+    if (binaryProtocol) {
+        uint8_t payload[FRAME_MAX_LEN - 1];
+        payload[0] = seq & 0xFF;
+        payload[1] = seq >> 8;
+        
+        size_t len = 2;
+        if (message) {
+            size_t messageLen = min(strlen(message), sizeof(payload) - len);
+            memcpy(payload + len, message, messageLen);
+            len += messageLen;
+        }
+        
+        sendFrame(opcode, payload, len);
+        return;
+    }
+    
+    static const char* const REPLY_TYPES[] = {"ack", "done", "error"};
+    StaticJsonDocument<192> reply;
+    reply["type"] = REPLY_TYPES[opcode - OP_ACK];
+    reply["seq"] = seq;
+    
+    if (message) {
+        reply["message"] = message;
+    }
+    
+    serializeJson(reply, Serial1);
+    Serial1.println();
+}
+
+void reportCommandError(uint16_t seq, const char* message) {
+    // Tagged commands fail with an error reply, untagged ones with the
+    // error status they always had
+    if (seq) {
+        sendReply(OP_ERROR, seq, message);
+    } else {
+        sendStatus("error", message);
+    }
+}
+
 void sendPositionUpdate() {
+    float x, y;
+    readPosition(x, y);
+    
+    if (binaryProtocol) {
+        uint8_t payload[5];
+        writeInt16(payload, lroundf(x * 10.0f));
+        writeInt16(payload + 2, lroundf(y * 10.0f));
+        payload[4] = isHomed ? 1 : 0;
+        sendFrame(OP_POSITION, payload, sizeof(payload));
+        return;
+    }
+    
     jsonDoc.clear();
     jsonDoc["type"] = "position";
-    jsonDoc["x"] = currentPosX;
-    jsonDoc["y"] = currentPosY;
+    jsonDoc["x"] = x;
+    jsonDoc["y"] = y;
     jsonDoc["homed"] = isHomed;
     
     serializeJson(jsonDoc, Serial1);
     Serial1.println();
-}
\ No newline at end of file
+}
+
+void setTelemetryRate(int rate) {
+    telemetryRate = constrain(rate, 0, TELEMETRY_MAX_HZ);
+    readPosition(telemetryX, telemetryY);
+    telemetryLast = micros();
+    LOG_I("Telemetry: %d Hz", telemetryRate);
+}
+
+void serviceTelemetry() {
+    /**
+     * Stream position, velocity and planner queue depth at telemetryRate
+     * while the stepper runs, then one record (velocity 0) once it has
+     * stopped. Runs in loop() on the UART core and only reads the step
+     * counters, so the motion task and the step ISR are not disturbed.
+     * Velocity is the position change since the previous record.
+     */
+    if (telemetryRate == 0) {
+        return;
+    }
+    
+    bool moving = stepperBusy;
+    unsigned long now = micros();
+    if (moving ? now - telemetryLast < 1000000UL / telemetryRate : !telemetryMoving) {
+        return;
+    }
+    
+    float x, y;
+    readPosition(x, y);
+    float dt = (now - telemetryLast) / 1000000.0f;
+    float vx = moving && dt > 0.0f ? (x - telemetryX) / dt : 0.0f;
+    float vy = moving && dt > 0.0f ? (y - telemetryY) / dt : 0.0f;
+    
+    telemetryX = x;
+    telemetryY = y;
+    telemetryLast = now;
+    telemetryMoving = moving;
+    
+    // Snapshot of the motion task's indices; a block off is harmless here
+    uint8_t queued = (blockHead + BLOCK_QUEUE_SIZE - blockTail) % BLOCK_QUEUE_SIZE;
+    
+    if (binaryProtocol) {
+        unsigned long time = millis();
+        uint8_t payload[14] = {
+            (uint8_t)time, (uint8_t)(time >> 8), (uint8_t)(time >> 16), (uint8_t)(time >> 24)
+        };
+        writeInt16(payload + 4, lroundf(x * 10.0f));
+        writeInt16(payload + 6, lroundf(y * 10.0f));
+        writeInt16(payload + 8, lroundf(vx));
+        writeInt16(payload + 10, lroundf(vy));
+        payload[12] = queued;
+        payload[13] = (moving ? 0x01 : 0) | (isHomed ? 0x02 : 0);
+        sendFrame(OP_TELEMETRY, payload, sizeof(payload));
+        return;
+    }
+    
+    jsonDoc.clear();
+    jsonDoc["type"] = "telemetry";
+    jsonDoc["time"] = millis();
+    jsonDoc["x"] = x;
+    jsonDoc["y"] = y;
+    jsonDoc["vx"] = vx;
+    jsonDoc["vy"] = vy;
+    jsonDoc["queued"] = queued;
+    jsonDoc["moving"] = moving;
+    jsonDoc["homed"] = (bool)isHomed;
+    
+    serializeJson(jsonDoc, Serial1);
+    Serial1.println();
+}
+
+void sendStallEvent(uint32_t motors) {
+    float x, y;
+    readPosition(x, y);
+    
+    bool stallA = motors & (1UL << MOTOR_A_DIAG_PIN);
+    bool stallB = motors & (1UL << MOTOR_B_DIAG_PIN);
+    
+    if (binaryProtocol) {
+        uint8_t payload[5];
+        writeInt16(payload, lroundf(x * 10.0f));
+        writeInt16(payload + 2, lroundf(y * 10.0f));
+        payload[4] = (stallA ? 0x01 : 0) | (stallB ? 0x02 : 0);
+        sendFrame(OP_STALL, payload, sizeof(payload));
+        return;
+    }
+    
+    jsonDoc.clear();
+    jsonDoc["type"] = "stall";
+    jsonDoc["controller"] = "motor";
+    jsonDoc["x"] = x;
+    jsonDoc["y"] = y;
+    
+    JsonArray stalled = jsonDoc.createNestedArray("motors");
+    if (stallA) stalled.add("A");
+    if (stallB) stalled.add("B");
+    
+    serializeJson(jsonDoc, Serial1);
+    Serial1.println();
+}
+
+// ==================== PERFORMANCE STATS ====================
+
+void IRAM_ATTR recordPerf(PerfStat& stat, uint32_t cycles) {
+    /**
+     * Add one sample to a timing histogram. Bucket 0 counts samples under
+     * 1 us, bucket b the range [2^(b-1), 2^b) us and the last bucket
+     * everything longer. One divide and a leading-zero count, cheap
+     * enough for the step ISR.
+     */
+    uint32_t us = cycles / cyclesPerUs;
+    int bucket = us ? 32 - __builtin_clz(us) : 0;
+    if (bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
+    
+    stat.buckets[bucket]++;
+    stat.count++;
+    stat.totalCycles += cycles;
+    if (cycles > stat.maxCycles) stat.maxCycles = cycles;
+}
+
+void onUARTError(hardwareSerial_error_t error) {
+    // Called from the UART driver's event task
+    if (error == UART_BUFFER_FULL_ERROR || error == UART_FIFO_OVF_ERROR) {
+        linkCounters.rxOverflows++;
+    } else if (error == UART_FRAME_ERROR || error == UART_PARITY_ERROR) {
+        linkCounters.rxErrors++;
+    }
+}
+
+void sendStats(bool reset) {
+    /**
+     * Reply to get_stats. Always a JSON line, whatever the protocol mode:
+     * the histograms don't fit in a frame, and the Pi's frame decoder
+     * passes text through. With reset the counters restart right after
+     * the copy, so periodic scrapes each cover one interval.
+     */
+    PerfStat snapshot[PERF_STATS];
+    
+    portENTER_CRITICAL(&stepperMux);
+    memcpy(snapshot, perfStats, sizeof(snapshot));
+    if (reset) memset(perfStats, 0, sizeof(perfStats));
+    portEXIT_CRITICAL(&stepperMux);
+    
+    jsonDoc.clear();
+    jsonDoc["type"] = "stats";
+    jsonDoc["controller"] = "motor";
+    jsonDoc["uptime_ms"] = millis();
+    jsonDoc["baud"] = linkBaud;
+    
+    JsonObject timings = jsonDoc.createNestedObject("timings");
+    for (int i = 0; i < PERF_STATS; i++) {
+        const PerfStat& stat = snapshot[i];
+        JsonObject entry = timings.createNestedObject(PERF_STAT_NAMES[i]);
+        entry["count"] = stat.count;
+        entry["avg_us"] = stat.count ? (float)stat.totalCycles / stat.count / cyclesPerUs : 0.0f;
+        entry["max_us"] = (float)stat.maxCycles / cyclesPerUs;
+        
+        JsonArray hist = entry.createNestedArray("hist");
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            hist.add(stat.buckets[b]);
+        }
+    }
+    
+    JsonObject link = jsonDoc.createNestedObject("link");
+    link["rx_overflows"] = linkCounters.rxOverflows;
+    link["rx_errors"] = linkCounters.rxErrors;
+    link["crc_errors"] = linkCounters.crcErrors;
+    link["json_errors"] = linkCounters.jsonErrors;
+    link["line_overflows"] = linkCounters.lineOverflows;
+    
+    serializeJson(jsonDoc, Serial1);
+    Serial1.println();
+    
+    if (reset) {
+        memset(&linkCounters, 0, sizeof(linkCounters));
+    }
+}
+
+void resetStats() {
+    portENTER_CRITICAL(&stepperMux);
+    memset(perfStats, 0, sizeof(perfStats));
+    portEXIT_CRITICAL(&stepperMux);
+    memset(&linkCounters, 0, sizeof(linkCounters));
+}
+
+// ==================== DEBUG LOG ====================
+
+void logPrintf(char level, const char* format, ...) {
+    /**
+     * Append one formatted line to the debug ring buffer. Use the LOG_x
+     * macros rather than calling this directly. Safe from any task, not
+     * from ISRs. If the line doesn't fit it is dropped and counted,
+     * never waited for.
+     */
+    char line[LOG_LINE_MAX];
+    int len = snprintf(line, sizeof(line), "[%c] ", level);
+    
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(line + len, sizeof(line) - len, format, args);
+    va_end(args);
+    
+    len = min(len + max(written, 0), (int)sizeof(line) - 2);
+    line[len++] = '\r';
+    line[len++] = '\n';
+    
+    portENTER_CRITICAL(&logMux);
+    if (logHead - logTail + len > LOG_BUFFER_SIZE) {
+        logDropped = logDropped + 1;
+    } else {
+        for (int i = 0; i < len; i++) {
+            logBuffer[(logHead + i) & (LOG_BUFFER_SIZE - 1)] = line[i];
+        }
+        logHead = logHead + len;
+    }
+    portEXIT_CRITICAL(&logMux);
+}
+
+void serviceLog() {
+    // Called from loop(): move what fits into the Serial TX FIFO
+    if (logDropped) {
+        portENTER_CRITICAL(&logMux);
+        uint32_t dropped = logDropped;
+        logDropped = 0;
+        portEXIT_CRITICAL(&logMux);
+        logPrintf('W', "%lu log lines dropped", (unsigned long)dropped);
+    }
+    
+    int room = Serial.availableForWrite();
+    while (room > 0 && logTail != logHead) {
+        uint32_t start = logTail & (LOG_BUFFER_SIZE - 1);
+        uint32_t chunk = min(min(logHead - logTail, (uint32_t)LOG_BUFFER_SIZE - start), (uint32_t)room);
+        Serial.write((const uint8_t*)logBuffer + start, chunk);
+        
+        portENTER_CRITICAL(&logMux);
+        logTail = logTail + chunk;
+        portEXIT_CRITICAL(&logMux);
+        room -= chunk;
+    }
+}
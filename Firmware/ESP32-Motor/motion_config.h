@@ -0,0 +1,27 @@
+/**
+ * Motion defaults for the motor controller: stepper specs, speeds and
+ * planner tuning
+ *
+ * Shared by main.cpp and the native benchmark in bench/, so the bench
+ * always times the planner configuration the board runs. Speeds are in
+ * steps/second; steps/mm and the speed limits are only defaults for a
+ * controller with nothing stored (set_config).
+ */
+
+#pragma once
+
+// Stepper motor specs
+#define STEPS_PER_REV       200     // 1.8° stepper
+#define MICROSTEPS          16      // TMC2226 microstepping
+#define STEPS_PER_MM        80      // Steps per mm (default, calibrate with set_config)
+
+// Speed settings (steps/second)
+#define DEFAULT_SPEED       4000    // Default cruise speed (ramped, see ACCELERATION)
+#define MAX_SPEED           8000    // Maximum speed
+#define START_SPEED         250     // Speed motors can start/stop at without ramping
+#define ACCELERATION        2000    // Steps/second²
+#define S_CURVE_ACCEL       false   // true = jerk-limited S-curve ramps, false = trapezoidal
+
+// Look-ahead planner
+#define SEGMENT_US          2500    // Planner time slice per step segment
+#define JUNCTION_DEVIATION  0.05    // mm, corner rounding allowed when blending
@@ -0,0 +1,222 @@
+/**
+ * Motion math for the motor controller: H-Bot kinematics, velocity
+ * profiles, segment slicing and the Bresenham step event
+ *
+ * Everything here is pure computation on the structs below, with no
+ * Arduino or hardware access, so the native benchmark in bench/ builds the
+ * same code the step timer and motion task run. Limits (START_SPEED from
+ * motion_config.h, the configured max speed and steps/mm) are passed in as
+ * parameters.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+
+// Called from the step ISR: must end up inlined into IRAM code
+#define MOTION_INLINE       inline __attribute__((always_inline))
+
+// Step generator state for one block (shared with the timer ISR)
+// The dominant motor steps on every tick; Bresenham error counters spread
+// the other motor's steps evenly so the gantry follows a straight line.
+struct StepBlock {
+    uint32_t stepsA;        // Total motor A steps in the block
+    uint32_t stepsB;        // Total motor B steps in the block
+    uint32_t ticks;         // Bresenham step events (= dominant motor steps)
+    uint32_t ticksLeft;     // Step events not yet executed
+    int32_t counterA;       // Bresenham error accumulators
+    int32_t counterB;
+    int8_t dirA;            // +1 forward, -1 backward
+    int8_t dirB;
+};
+
+// Accel/cruise/decel profile of the active block (in step ticks)
+struct MotionProfile {
+    uint32_t ticks;         // Total step ticks in the block
+    float entrySpeed;       // Ticks/s at block start
+    float cruiseSpeed;      // Peak ticks/s actually reached
+    float exitSpeed;        // Ticks/s at block end
+    float accelTime;        // Duration of the accel ramp (s)
+    float decelTime;        // Duration of the decel ramp (s)
+    uint32_t decelStart;    // Tick at which the decel ramp begins
+    bool sCurve;
+};
+
+// Segment preparation progress through the active profile
+struct ProfileCursor {
+    uint32_t ticksPlanned;
+    float accelElapsed;     // Time spent in the accel ramp (s)
+    float decelElapsed;     // Time spent in the decel ramp (s)
+};
+
+// Bits returned by stepBlockTick()
+#define STEP_A              0x01
+#define STEP_B              0x02
+
+// ==================== KINEMATICS ====================
+
+inline void calculateHBotSteps(long targetX, long targetY, long& stepsA, long& stepsB) {
+    /**
+     * Inverse kinematics: Cartesian position (in steps) to motor positions.
+     *
+     * Motor A: controls X + Y diagonal
+     * Motor B: controls X - Y diagonal
+     *
+     * To move +X: A forward, B forward
+     * To move +Y: A forward, B backward
+     */
+    stepsA = targetX + targetY;
+    stepsB = targetX - targetY;
+}
+
+inline void calculateHBotPosition(long stepsA, long stepsB, float stepsPerMm, float& x, float& y) {
+    /**
+     * Forward kinematics: motor positions to Cartesian position (in mm).
+     *
+     * Mid-move A + B can be odd (Bresenham steps the motors on different
+     * ticks), which is a half step in X and Y, so this stays in floats.
+     */
+    x = (stepsA + stepsB) / (2.0f * stepsPerMm);
+    y = (stepsA - stepsB) / (2.0f * stepsPerMm);
+}
+
+// ==================== PLANNING ====================
+
+inline float junctionSpeed(float prevUnitX, float prevUnitY, float unitX, float unitY,
+                           float accel, float deviation) {
+    /**
+     * Grbl-style junction deviation: the largest speed at which a circle
+     * of radius derived from 'deviation' (mm) can be followed through the
+     * corner between two unit directions. 0 for a full reversal, infinite
+     * for a straight continuation.
+     */
+    float cosTheta = -(prevUnitX * unitX + prevUnitY * unitY);
+    
+    if (cosTheta > 0.999999f) {
+        return 0.0f;  // Full reversal
+    }
+    if (cosTheta < -0.999999f) {
+        return INFINITY;  // Straight continuation
+    }
+    
+    float sinHalf = sqrtf(0.5f * (1.0f - cosTheta));
+    return sqrtf(accel * deviation * sinHalf / (1.0f - sinHalf));
+}
+
+inline void planProfile(MotionProfile& profile, uint32_t ticks, float entrySpeed,
+                        float nominalSpeed, float exitSpeed, float accel, bool sCurve) {
+    /**
+     * Split a block of 'ticks' step ticks into accel/cruise/decel phases.
+     *
+     * Trapezoidal ramps change speed linearly at 'accel'. S-curve ramps
+     * follow a smoothstep in time, which limits jerk; the peak acceleration
+     * of a smoothstep is 1.5x its average, so the average is lowered to
+     * keep the peak at 'accel'. Falls back to a triangle profile when the
+     * block is too short to reach the nominal speed.
+     */
+    float rampAccel = sCurve ? accel / 1.5f : accel;
+    
+    float cruise = std::max(nominalSpeed, std::max(entrySpeed, exitSpeed));
+    float accelDist = (cruise * cruise - entrySpeed * entrySpeed) / (2.0f * rampAccel);
+    float decelDist = (cruise * cruise - exitSpeed * exitSpeed) / (2.0f * rampAccel);
+    
+    if (accelDist + decelDist > ticks) {
+        // Triangle profile: peak where the accel and decel ramps meet
+        cruise = sqrtf((2.0f * rampAccel * ticks + entrySpeed * entrySpeed +
+                        exitSpeed * exitSpeed) / 2.0f);
+        cruise = std::max(cruise, std::max(entrySpeed, exitSpeed));
+        decelDist = (cruise * cruise - exitSpeed * exitSpeed) / (2.0f * rampAccel);
+    }
+    
+    profile.ticks = ticks;
+    profile.entrySpeed = entrySpeed;
+    profile.cruiseSpeed = cruise;
+    profile.exitSpeed = exitSpeed;
+    profile.accelTime = (cruise - entrySpeed) / rampAccel;
+    profile.decelTime = (cruise - exitSpeed) / rampAccel;
+    profile.decelStart = ticks - std::min((uint32_t)decelDist, ticks);
+    profile.sCurve = sCurve;
+}
+
+inline float rampShape(float u, bool sCurve) {
+    u = std::min(std::max(u, 0.0f), 1.0f);
+    return sCurve ? u * u * (3.0f - 2.0f * u) : u;
+}
+
+inline uint32_t nextSegment(const MotionProfile& p, ProfileCursor& c, float dt,
+                            float minSpeed, float maxSpeed, uint32_t& intervalUs) {
+    /**
+     * Slice the next segment off a profile: ~dt seconds at the speed
+     * sampled mid-segment, clamped to [minSpeed, maxSpeed] ticks/s.
+     * Returns its tick count (never past the decel start or the block
+     * end) with the step interval in intervalUs, and advances the cursor.
+     */
+    float speed;
+    
+    if (c.ticksPlanned >= p.decelStart) {
+        float u = (c.decelElapsed + dt / 2.0f) / std::max(p.decelTime, dt);
+        speed = p.cruiseSpeed - (p.cruiseSpeed - p.exitSpeed) * rampShape(u, p.sCurve);
+    } else if (c.accelElapsed < p.accelTime) {
+        float u = (c.accelElapsed + dt / 2.0f) / p.accelTime;
+        speed = p.entrySpeed + (p.cruiseSpeed - p.entrySpeed) * rampShape(u, p.sCurve);
+    } else {
+        speed = p.cruiseSpeed;
+    }
+    speed = std::min(std::max(speed, minSpeed), maxSpeed);
+    
+    // Don't run past the start of the decel ramp or the end of the block
+    uint32_t limit = (c.ticksPlanned < p.decelStart ? p.decelStart : p.ticks) - c.ticksPlanned;
+    uint32_t ticks = std::max((uint32_t)(speed * dt + 0.5f), (uint32_t)1);
+    ticks = std::min(std::min(ticks, limit), (uint32_t)UINT16_MAX);
+    
+    float segmentTime = ticks / speed;
+    if (c.ticksPlanned >= p.decelStart) {
+        c.decelElapsed += segmentTime;
+    } else if (c.accelElapsed < p.accelTime) {
+        c.accelElapsed += segmentTime;
+    }
+    
+    c.ticksPlanned += ticks;
+    intervalUs = (uint32_t)(1000000.0f / speed);
+    return ticks;
+}
+
+// ==================== STEP EVENTS ====================
+
+MOTION_INLINE void loadStepBlock(StepBlock& b, long stepsA, long stepsB, uint32_t ticks) {
+    // Signed block steps in, Bresenham state for stepBlockTick() out
+    b.stepsA = labs(stepsA);
+    b.stepsB = labs(stepsB);
+    b.ticks = ticks;
+    b.ticksLeft = ticks;
+    b.counterA = -(int32_t)(ticks >> 1);
+    b.counterB = -(int32_t)(ticks >> 1);
+    b.dirA = stepsA > 0 ? 1 : -1;
+    b.dirB = stepsB > 0 ? 1 : -1;
+}
+
+MOTION_INLINE uint8_t stepBlockTick(StepBlock& b) {
+    // One Bresenham step event; returns which motors step (STEP_A/STEP_B)
+    uint8_t steps = 0;
+    
+    if (b.ticksLeft > 0) {
+        b.ticksLeft--;
+        
+        b.counterA += b.stepsA;
+        if (b.counterA > 0) {
+            b.counterA -= b.ticks;
+            steps |= STEP_A;
+        }
+        
+        b.counterB += b.stepsB;
+        if (b.counterB > 0) {
+            b.counterB -= b.ticks;
+            steps |= STEP_B;
+        }
+    }
+    
+    return steps;
+}
@@ -0,0 +1,382 @@
+/**
+ * Host benchmark for the sensor controller's pure logic
+ *
+ * Builds board_logic.h and frame_parser.h exactly as the firmware does,
+ * checks their results, and times them on the development machine, so
+ * scan, LED mapping and parser changes can be compared before flashing.
+ * Run with:
+ *
+ *     pio run -e native -t exec
+ *
+ * Exits non-zero if a check fails or a timing goes over its BUDGET_*.
+ * Numbers are host timings: compare them between builds, not against the
+ * ESP32 (use get_stats on the board for that).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <ArduinoJson.h>
+#include "sensor_config.h"
+#include "board_logic.h"
+#include "frame_parser.h"
+
+// Timing budgets for an -O2 host build, several times the figures of a
+// typical development machine: only a real regression should trip them
+#define BUDGET_SCAN_NS      50.0    // Per scan: debounce and change detection
+#define BUDGET_SQUARE_NS    10.0    // Per square corner lookup
+#define BUDGET_DECODE_US    10.0    // Per base64 RLE set_frame upload
+#define BUDGET_FRAME_NS     2000.0  // Per show_evaluation binary frame
+#define BUDGET_JSON_US      20.0    // Per JSON highlight command
+
+// Keeps results alive so the optimizer can't drop the work being timed
+volatile uint32_t sink;
+int failures = 0;
+
+static double elapsedSeconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void check(bool ok, const char* what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void checkBudget(double measured, double budget, const char* what) {
+    if (measured > budget) {
+        printf("FAIL: %s %.3f over budget %.3f\n", what, measured, budget);
+        failures++;
+    }
+}
+
+static size_t encodeBase64(const uint8_t* in, size_t len, char* out) {
+    // What the backend sends: standard alphabet, '=' padded
+    static const char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t outLen = 0;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t bits = (uint32_t)in[i] << 16;
+        if (i + 1 < len) bits |= in[i + 1] << 8;
+        if (i + 2 < len) bits |= in[i + 2];
+        out[outLen++] = ALPHABET[(bits >> 18) & 63];
+        out[outLen++] = ALPHABET[(bits >> 12) & 63];
+        out[outLen++] = i + 1 < len ? ALPHABET[(bits >> 6) & 63] : '=';
+        out[outLen++] = i + 2 < len ? ALPHABET[bits & 63] : '=';
+    }
+    return outLen;
+}
+
+// ==================== CHECKS ====================
+
+static void checkDebounce() {
+    // A one-scan glitch is dropped; a change is taken on exactly the
+    // SENSOR_DEBOUNCE-th matching scan
+    const uint64_t start = 0xFFFF00000000FFFFULL;
+    const uint64_t moved = start ^ (1ULL << 12) ^ (1ULL << 28);  // e2-e4
+    uint64_t history[SENSOR_DEBOUNCE_MAX];
+    uint8_t index = 0;
+    uint64_t board = start;
+    for (uint64_t& scan : history) {
+        scan = start;
+    }
+    
+    auto scan = [&](uint64_t raw) {
+        index = (index + 1) % SENSOR_DEBOUNCE_MAX;
+        history[index] = raw;
+        board = debounceBoard(history, SENSOR_DEBOUNCE_MAX, index, SENSOR_DEBOUNCE, board);
+    };
+    
+    scan(start ^ (1ULL << 40));
+    scan(start);
+    check(board == start, "debounce drops a one-scan glitch");
+    
+    bool ok = true;
+    for (int i = 1; i <= SENSOR_DEBOUNCE; i++) {
+        scan(moved);
+        ok &= board == (i < SENSOR_DEBOUNCE ? start : moved);
+    }
+    check(ok, "debounce changes after SENSOR_DEBOUNCE matching scans");
+    
+    int changes[4][2];
+    int count = 0;
+    forEachChangedSquare(start, moved, [&](int square, bool placed) {
+        if (count < 4) {
+            changes[count][0] = square;
+            changes[count][1] = placed;
+        }
+        count++;
+    });
+    check(count == 2 && changes[0][0] == 12 && !changes[0][1] && changes[1][0] == 28 && changes[1][1],
+          "changed squares: e2 lifted, then e4 placed");
+}
+
+static void checkLEDMapping() {
+    // Serpentine corners of a1 and h8 on the shared-corner grid
+    SquareLEDs a1 = squareCorners(0, 0, LED_GRID_SIZE);
+    SquareLEDs h8 = squareCorners(BOARD_SIZE - 1, BOARD_SIZE - 1, LED_GRID_SIZE);
+    check(a1.led[0] == 0 && a1.led[1] == 1 && a1.led[2] == 2 * LED_GRID_SIZE - 1 &&
+          a1.led[3] == 2 * LED_GRID_SIZE - 2, "a1 corner LEDs");
+    check(h8.led[3] == LED_COUNT - 1, "h8 bottom-right corner is the last LED");
+    
+    constexpr SquareLEDTable<BOARD_SIZE> table = buildSquareLEDs<BOARD_SIZE>();
+    bool tableMatches = true;
+    for (int square = 0; square < BOARD_SIZE * BOARD_SIZE; square++) {
+        SquareLEDs corners = squareCorners(square % BOARD_SIZE, square / BOARD_SIZE, LED_GRID_SIZE);
+        tableMatches = tableMatches && memcmp(table[square].led, corners.led, sizeof(corners.led)) == 0;
+    }
+    check(tableMatches, "compile-time square table matches squareCorners()");
+    
+    const MuxBank banks[] = {{17, 0}, {18, 16}, {19, 32}, {21, 48}, {22, 64}};
+    check(layoutSensorCount(banks, 4, 16) == 64 && layoutSensorCount(banks, 5, 16) == 80,
+          "sensor count of a bank layout");
+}
+
+static void checkFrameDecoding() {
+    // Base64 round trip (with and without padding), runs expanded in
+    // order, and malformed input rejected
+    const uint8_t runs[] = {3, 10, 20, 30, 1, 255, 0, 128, 0, 1, 2, 3};
+    char text[32];
+    size_t textLen = encodeBase64(runs, sizeof(runs), text);
+    uint8_t packed[sizeof(runs)];
+    int packedLen = decodeBase64(text, textLen, packed, sizeof(packed));
+    check(packedLen == (int)sizeof(runs) && memcmp(packed, runs, sizeof(runs)) == 0,
+          "base64 round trip");
+    
+    uint8_t short1[2];
+    check(decodeBase64("AQI", 3, short1, sizeof(short1)) == 2 && short1[0] == 1 && short1[1] == 2,
+          "unpadded base64");
+    check(decodeBase64("AQ*=", 4, short1, sizeof(short1)) < 0, "bad base64 character rejected");
+    
+    const uint8_t expected[] = {10, 20, 30, 10, 20, 30, 10, 20, 30, 255, 0, 128};
+    uint8_t pixels[16];
+    check(expandRuns(runs, sizeof(runs), 3, pixels, sizeof(pixels)) == (int)sizeof(expected) &&
+          memcmp(pixels, expected, sizeof(expected)) == 0, "RLE runs expanded");
+    check(expandRuns(runs, sizeof(runs) - 1, 3, pixels, sizeof(pixels)) < 0, "truncated run rejected");
+    check(expandRuns(runs, sizeof(runs), 3, pixels, 6) < 0, "oversized frame rejected");
+}
+
+static void checkFrames() {
+    // CRC16-CCITT check value, and a frame parsed whole or rejected on a
+    // flipped bit
+    uint16_t crc = 0xFFFF;
+    for (const char* c = "123456789"; *c; c++) {
+        crc = crc16Update(crc, *c);
+    }
+    check(crc == 0x29B1, "CRC16-CCITT of \"123456789\"");
+    
+    // scan_sensors (0x20), no payload
+    const uint8_t frame[] = {FRAME_SYNC, 0x01, 0x20, 0x5C, 0x0A};
+    uint16_t frameCrc = crc16Update(crc16Update(0xFFFF, frame[1]), frame[2]);
+    check(frameCrc == (frame[3] | frame[4] << 8), "CRC of a known frame");
+    
+    FrameParser parser = {};
+    FrameStatus status = FRAME_TEXT;
+    for (uint8_t c : frame) {
+        status = parser.feed(c, 0);
+    }
+    check(status == FRAME_READY && parser.data[0] == 0x20, "known frame parsed");
+    
+    for (size_t i = 0; i < sizeof(frame); i++) {
+        status = parser.feed(i == 2 ? frame[i] ^ 0x01 : frame[i], 0);
+    }
+    check(status == FRAME_BAD_CRC, "corrupted frame rejected");
+}
+
+// ==================== SENSORS ====================
+
+static double benchScan() {
+    // Raw scans with a few noisy squares and a piece moving every 50 scans,
+    // through the same debounce and change reporting as inputTask
+    const int scans = 5000000;
+    uint64_t history[SENSOR_DEBOUNCE_MAX] = {};
+    uint8_t historyIndex = 0;
+    uint64_t board = 0xFFFF00000000FFFFULL;
+    uint64_t reported = board;
+    uint64_t raw = board;
+    uint32_t events = 0;
+    uint32_t noise = 0x12345678;
+    
+    for (int i = 0; i < SENSOR_DEBOUNCE_MAX; i++) {
+        history[i] = board;
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    
+    for (int i = 0; i < scans; i++) {
+        if (i % 50 == 0) {
+            int from = (i / 50) % 64;
+            raw ^= (1ULL << from) | (1ULL << ((from + 17) % 64));
+        }
+        noise = noise * 1664525 + 1013904223;
+        uint64_t scan = raw ^ ((uint64_t)(noise >> 28 == 0) << (noise & 63));
+        
+        history[historyIndex] = scan;
+        board = debounceBoard(history, SENSOR_DEBOUNCE_MAX, historyIndex, SENSOR_DEBOUNCE, board);
+        historyIndex = (historyIndex + 1) % SENSOR_DEBOUNCE_MAX;
+        
+        if (board != reported) {
+            forEachChangedSquare(reported, board, [&events](int square, bool placed) {
+                events += square + placed;
+            });
+            reported = board;
+        }
+    }
+    
+    double seconds = elapsedSeconds(start);
+    sink = events;
+    printf("scan + debounce: %10.0f scans/s  (%.1f ns/scan)\n",
+           scans / seconds, seconds * 1e9 / scans);
+    return seconds * 1e9 / scans;
+}
+
+// ==================== LED GRID ====================
+
+static double benchLEDMapping() {
+    // Corner lookups for every square, as setLEDSquare() does per frame
+    const int frames = 1000000;
+    uint32_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    
+    for (int frame = 0; frame < frames; frame++) {
+        for (int square = 0; square < BOARD_SIZE * BOARD_SIZE; square++) {
+            SquareLEDs corners = squareCorners(square % BOARD_SIZE, (square + frame) / BOARD_SIZE % BOARD_SIZE,
+                                               LED_GRID_SIZE);
+            total += corners.led[0] + corners.led[3];
+        }
+    }
+    
+    double seconds = elapsedSeconds(start);
+    sink = total;
+    printf("LED mapping:     %10.0f boards/s  (%.2f ns/square)\n",
+           frames / seconds, seconds * 1e9 / (frames * 64.0));
+    return seconds * 1e9 / (frames * 64.0);
+}
+
+static double benchFrameDecode() {
+    // A full set_frame "leds" upload: base64 text to RLE runs to 81 x RGB,
+    // a gradient with a few flat rows so the runs vary in length
+    uint8_t runs[LED_COUNT * 4];
+    size_t runsLen = 0;
+    for (int led = 0; led < LED_COUNT; ) {
+        uint8_t count = (led / LED_GRID_SIZE) % 3 == 0 ? LED_GRID_SIZE : 1;
+        runs[runsLen++] = count;
+        runs[runsLen++] = (uint8_t)(led * 3);
+        runs[runsLen++] = (uint8_t)(255 - led * 3);
+        runs[runsLen++] = 64;
+        led += count;
+    }
+    
+    char text[sizeof(runs) * 4 / 3 + 4];
+    size_t textLen = encodeBase64(runs, runsLen, text);
+    
+    const int frames = 500000;
+    uint8_t packed[sizeof(runs)];
+    uint8_t pixels[LED_COUNT * 3];
+    uint32_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    
+    uint32_t decoded = 0;
+    for (int i = 0; i < frames; i++) {
+        int packedLen = decodeBase64(text, textLen, packed, sizeof(packed));
+        int len = expandRuns(packed, packedLen, 3, pixels, sizeof(pixels));
+        decoded += len == (int)sizeof(pixels);
+        total += len + pixels[i % sizeof(pixels)];
+    }
+    
+    double seconds = elapsedSeconds(start);
+    sink = total;
+    printf("frame decode:    %10.0f frames/s  (%zu chars -> %zu bytes)\n",
+           frames / seconds, textLen, sizeof(pixels));
+    check(decoded == (uint32_t)frames, "every benchmark frame decoded to LED_COUNT pixels");
+    return seconds * 1e6 / frames;
+}
+
+// ==================== PARSERS ====================
+
+static size_t buildFrame(uint8_t* out, uint8_t opcode, const uint8_t* payload, uint8_t len) {
+    out[0] = FRAME_SYNC;
+    out[1] = len + 1;
+    out[2] = opcode;
+    memcpy(out + 3, payload, len);
+    uint16_t crc = 0xFFFF;
+    for (int i = 1; i < len + 3; i++) {
+        crc = crc16Update(crc, out[i]);
+    }
+    out[len + 3] = crc & 0xFF;
+    out[len + 4] = crc >> 8;
+    return len + 5;
+}
+
+static double benchFrameParser() {
+    // A show_evaluation frame: 64 squares at 4 bits each
+    uint8_t payload[32];
+    for (size_t i = 0; i < sizeof(payload); i++) {
+        payload[i] = (uint8_t)(i * 37);
+    }
+    uint8_t frame[FRAME_MAX_LEN + 5];
+    size_t frameLen = buildFrame(frame, 0x27, payload, sizeof(payload));
+    
+    const int frames = 500000;
+    FrameParser parser = {};
+    uint32_t ready = 0;
+    auto start = std::chrono::steady_clock::now();
+    
+    for (int i = 0; i < frames; i++) {
+        for (size_t j = 0; j < frameLen; j++) {
+            ready += parser.feed(frame[j], 0) == FRAME_READY;
+        }
+    }
+    
+    double seconds = elapsedSeconds(start);
+    sink = ready;
+    printf("binary frames:   %10.0f frames/s  (%.1f MB/s)\n",
+           frames / seconds, frames * frameLen / seconds / 1e6);
+    check(ready == (uint32_t)frames, "every benchmark frame parsed");
+    return seconds * 1e9 / frames;
+}
+
+static double benchJsonParser() {
+    const char* line = "{\"cmd\":\"highlight_squares\",\"color\":[0,255,0],\"duration\":2000,"
+                       "\"squares\":[[4,1],[4,2],[4,3],[3,2],[5,2],[2,3],[6,3]]}";
+    const size_t lineLen = strlen(line);
+    const int lines = 200000;
+    
+    StaticJsonDocument<2048> doc;
+    uint32_t squares = 0;
+    auto start = std::chrono::steady_clock::now();
+    
+    for (int i = 0; i < lines; i++) {
+        if (deserializeJson(doc, line, lineLen) == DeserializationError::Ok) {
+            squares += doc["squares"].size();
+        }
+    }
+    
+    double seconds = elapsedSeconds(start);
+    sink = squares;
+    printf("JSON commands:   %10.0f lines/s  (%.1f MB/s)\n",
+           lines / seconds, lines * lineLen / seconds / 1e6);
+    check(squares == (uint32_t)lines * 7, "every benchmark JSON command parsed");
+    return seconds * 1e6 / lines;
+}
+
+int main() {
+    printf("Sensor controller benchmark\n");
+    checkDebounce();
+    checkLEDMapping();
+    checkFrameDecoding();
+    checkFrames();
+    
+    checkBudget(benchScan(), BUDGET_SCAN_NS, "ns/scan");
+    checkBudget(benchLEDMapping(), BUDGET_SQUARE_NS, "ns/square");
+    checkBudget(benchFrameDecode(), BUDGET_DECODE_US, "us/frame decode");
+    checkBudget(benchFrameParser(), BUDGET_FRAME_NS, "ns/binary frame");
+    checkBudget(benchJsonParser(), BUDGET_JSON_US, "us/JSON command");
+    
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,167 @@
+/**
+ * Board logic for the sensor controller: the sensor scan layout, debounce,
+ * change detection, the LED grid mapping and set_frame decoding
+ *
+ * Everything here is pure computation on bitboards (bit = rank * 8 + file)
+ * and grid coordinates, with no Arduino or hardware access, so the native
+ * benchmark in bench/ builds the same code the input task and LED layers
+ * run.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// ==================== SENSOR LAYOUT ====================
+
+// One multiplexer bank of the scan: every bank shares the select lines,
+// and channel c of a bank is sensor firstSensor + c. Sensors are kept in
+// 64-bit words (sensor n = bit n % 64 of word n / 64); word 0 holds the
+// board squares, bit = rank * 8 + file.
+struct MuxBank {
+    uint8_t outPin;             // Common output of the multiplexer
+    uint16_t firstSensor;       // Sensor read on channel 0
+};
+
+constexpr uint16_t layoutSensorCount(const MuxBank* banks, size_t count, uint16_t channels,
+                                     uint16_t end = 0) {
+    // One past the highest sensor any bank covers
+    return count == 0 ? end
+         : layoutSensorCount(banks + 1, count - 1, channels,
+                             banks[0].firstSensor + channels > end ? banks[0].firstSensor + channels : end);
+}
+
+// ==================== SENSORS ====================
+
+inline uint64_t debounceBoard(const uint64_t* history, uint8_t historySize, uint8_t newest,
+                              uint8_t samples, uint64_t board) {
+    /**
+     * Filter all 64 squares at once. 'history' is a ring of raw scans with
+     * the latest at 'newest'. A square only takes a new value after
+     * reading it in the last 'samples' scans in a row; every other square
+     * keeps its value from 'board'.
+     */
+    uint64_t allSet = ~0ULL;
+    uint64_t allClear = ~0ULL;
+    uint8_t index = newest;
+    for (uint8_t i = 0; i < samples; i++) {
+        allSet &= history[index];
+        allClear &= ~history[index];
+        index = (index + historySize - 1) % historySize;
+    }
+    
+    // Stable squares take their new value, the rest keep the old one
+    return allSet | (board & ~allClear);
+}
+
+template <typename F>
+inline void forEachChangedSquare(uint64_t before, uint64_t after, F callback) {
+    // callback(square, occupied) once per changed square, lowest square first
+    for (uint64_t bits = before ^ after; bits; bits &= bits - 1) {
+        int square = __builtin_ctzll(bits);
+        callback(square, ((after >> square) & 1) != 0);
+    }
+}
+
+// ==================== LED GRID ====================
+
+struct SquareLEDs {
+    uint8_t led[4];             // Top-left, top-right, bottom-left, bottom-right
+};
+
+constexpr uint8_t serpentineIndex(int x, int y, int width) {
+    // Strip position of grid point (x, y): even rows run left-to-right,
+    // odd rows right-to-left
+    return (y % 2 == 0) ? y * width + x
+                        : y * width + (width - 1 - x);
+}
+
+constexpr SquareLEDs squareCorners(int file, int rank, int width) {
+    // A square's four corner LEDs on a (board + 1)-wide grid
+    return {{serpentineIndex(file, rank, width), serpentineIndex(file + 1, rank, width),
+             serpentineIndex(file, rank + 1, width), serpentineIndex(file + 1, rank + 1, width)}};
+}
+
+// Square -> corner LED table for a size x size board on its (size + 1)-wide
+// grid, indexed by rank * size + file. The index list is a stand-in for
+// std::index_sequence, which the firmware's C++11 toolchain lacks.
+template <size_t Size>
+struct SquareLEDTable {
+    SquareLEDs square[Size * Size];
+    
+    constexpr const SquareLEDs& operator[](size_t index) const { return square[index]; }
+};
+
+template <size_t... I> struct IndexList {};
+template <size_t N, size_t... I> struct MakeIndexList : MakeIndexList<N - 1, N - 1, I...> {};
+template <size_t... I> struct MakeIndexList<0, I...> { typedef IndexList<I...> type; };
+
+template <size_t Size, size_t... Square>
+constexpr SquareLEDTable<Size> buildSquareLEDs(IndexList<Square...>) {
+    return {{squareCorners(Square % Size, Square / Size, Size + 1)...}};
+}
+
+template <size_t Size>
+constexpr SquareLEDTable<Size> buildSquareLEDs() {
+    return buildSquareLEDs<Size>(typename MakeIndexList<Size * Size>::type());
+}
+
+// ==================== FRAME DECODING ====================
+
+inline int base64Value(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+inline int decodeBase64(const char* in, size_t inLen, uint8_t* out, size_t outMax) {
+    /**
+     * Standard base64 (RFC 4648, '=' padding optional) into 'out'.
+     * Returns the decoded length, or -1 for a character outside the
+     * alphabet or more than 'outMax' bytes.
+     */
+    uint32_t bits = 0;
+    int bitCount = 0;
+    size_t len = 0;
+    
+    for (size_t i = 0; i < inLen && in[i] != '='; i++) {
+        int value = base64Value(in[i]);
+        if (value < 0) return -1;
+        
+        bits = (bits << 6) | value;
+        bitCount += 6;
+        if (bitCount >= 8) {
+            bitCount -= 8;
+            if (len >= outMax) return -1;
+            out[len++] = (bits >> bitCount) & 0xFF;
+        }
+    }
+    return (int)len;
+}
+
+inline int expandRuns(const uint8_t* in, size_t inLen, size_t unit, uint8_t* out, size_t outMax) {
+    /**
+     * Run-length decoding: each run is a count byte followed by one
+     * 'unit'-byte value (a palette index, or r, g, b), repeated 'count'
+     * times. Returns the expanded length, or -1 for a truncated run or
+     * more than 'outMax' bytes.
+     */
+    size_t len = 0;
+    
+    for (size_t i = 0; i < inLen; i += 1 + unit) {
+        if (i + 1 + unit > inLen) return -1;
+        
+        size_t count = in[i];
+        if (len + count * unit > outMax) return -1;
+        for (size_t n = 0; n < count; n++) {
+            memcpy(out + len, in + i + 1, unit);
+            len += unit;
+        }
+    }
+    return (int)len;
+}
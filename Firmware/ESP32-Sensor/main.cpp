@@ -3,9 +3,21 @@
  * 
  * Responsibilities:
  * - Scan 64 Hall Effect sensors via 4x CD74HC4067 multiplexers
+ *   (continuously, from a dedicated task: 16 channel steps per scan;
+ *   the bank layout is a table, so extra banks and chained controllers
+ *   extend it past the board)
  * - Control 64 WS2812B LEDs for board visualization
+ *   (layered, non-blocking animations with auto-expiring effects,
+ *   whole host-rendered frames in one set_frame command,
+ *   sent by the RMT peripheral in the background)
  * - Read 6 buttons and 2 rotary encoders
- * - Communicate with Raspberry Pi via UART (JSON protocol)
+ * - Communicate with Raspberry Pi via UART (JSON or binary framed protocol)
+ * - LED, theme and sensor settings kept in NVS across reboots
+ * 
+ * Tasks:
+ * - Core 0: inputTask() - sensor scan, debounce, buttons, encoders
+ * - Core 1: loop() - UART protocol, LED animation and output
+ * - They exchange events and commands through lock-free SPSC queues only
  * 
  * Hardware:
  * - ESP32-S3 DevKit C-1
@@ -18,8 +30,53 @@
  */
 
 #include <Arduino.h>
-#include <Adafruit_NeoPixel.h>
 #include <ArduinoJson.h>
+#include <Preferences.h>
+#include "soc/gpio_struct.h"
+#include <atomic>
+#include <stdarg.h>
+#include "frame_parser.h"
+#include "sensor_config.h"
+#include "board_logic.h"
+
+// ==================== LOGGING ====================
+
+// Debug output on Serial, leveled like the Arduino core's log_x() and
+// driven by the same CORE_DEBUG_LEVEL build flag (see platformio.ini):
+// 0 = none, 1 = error, 2 = warning, 3 = info, 4 = debug, 5 = verbose.
+// Calls above the build level compile to nothing, arguments included.
+#ifndef CORE_DEBUG_LEVEL
+#define CORE_DEBUG_LEVEL    0
+#endif
+
+#define LOG_BUFFER_SIZE     2048    // Debug ring buffer (power of two), drained by loop()
+#define LOG_LINE_MAX        128     // Longest formatted line, longer ones are cut
+
+#if CORE_DEBUG_LEVEL >= 1
+#define LOG_E(...)          logPrintf('E', __VA_ARGS__)
+#else
+#define LOG_E(...)          do {} while (0)
+#endif
+#if CORE_DEBUG_LEVEL >= 2
+#define LOG_W(...)          logPrintf('W', __VA_ARGS__)
+#else
+#define LOG_W(...)          do {} while (0)
+#endif
+#if CORE_DEBUG_LEVEL >= 3
+#define LOG_I(...)          logPrintf('I', __VA_ARGS__)
+#else
+#define LOG_I(...)          do {} while (0)
+#endif
+#if CORE_DEBUG_LEVEL >= 4
+#define LOG_D(...)          logPrintf('D', __VA_ARGS__)
+#else
+#define LOG_D(...)          do {} while (0)
+#endif
+#if CORE_DEBUG_LEVEL >= 5
+#define LOG_V(...)          logPrintf('V', __VA_ARGS__)
+#else
+#define LOG_V(...)          do {} while (0)
+#endif
 
 // ==================== PIN DEFINITIONS ====================
 
@@ -29,17 +86,15 @@
 #define MUX_S2_PIN    4
 #define MUX_S3_PIN    5
 
-// Multiplexer enable/output pins (one per multiplexer)
+// Multiplexer enable/output pins (one output per multiplexer, see MUX_BANKS)
 #define MUX_EN_PIN    16  // Enable (active LOW)
 #define MUX1_OUT_PIN  17  // Multiplexer 1 output (rows 0-1)
 #define MUX2_OUT_PIN  18  // Multiplexer 2 output (rows 2-3)
 #define MUX3_OUT_PIN  19  // Multiplexer 3 output (rows 4-5)
 #define MUX4_OUT_PIN  21  // Multiplexer 4 output (rows 6-7)
 
-// LED control
+// LED control (grid size and LED count: sensor_config.h)
 #define LED_DATA_PIN  22
-#define LED_COUNT     81  // 9x9 grid (4 LEDs per square, shared corners)
-#define LED_GRID_SIZE 9   // 9x9 physical LED grid
 
 // Buttons (active LOW with internal pullup)
 #define BTN1_PIN      25
@@ -62,40 +117,282 @@
 #define UART_RX_PIN   1   // RX from Pi
 #define UART_TX_PIN   3   // TX to Pi
 #define UART_BAUD     115200
+#define UART_RX_BUFFER 1024   // Driver ring buffer, filled by the UART RX ISR
+#define LINE_BUFFER_SIZE 512  // Longest JSON command line accepted
+#define MAX_UART_BAUD 2000000 // Upper limit for set_baud
+#define BAUD_CONFIRM_MS 1000  // Revert an unconfirmed rate change after this
+#define BAUD_ERROR_LIMIT 3    // Consecutive bad frames/lines before falling back
+#define STATS_BUCKETS 14      // get_stats histogram: <1 us, then powers of two up to >= 4 ms
+
+// ==================== BINARY PROTOCOL ====================
+
+// Frame: [SYNC][LEN][OPCODE][PAYLOAD...][CRC16 lo][CRC16 hi]
+// LEN counts OPCODE + PAYLOAD; CRC16-CCITT covers LEN..PAYLOAD
+// (parser and FRAME_* limits in frame_parser.h).
+// Multi-byte fields are little-endian; squares are rank * 8 + file.
+// A command wrapped in OP_SEQ is answered with OP_ACK on receipt, then
+// exactly one OP_DONE or OP_ERROR (see beginCommand()).
+
+// Pi -> sensor controller
+#define OP_SET_PROTOCOL     0x01    // u8 mode (0 = JSON, 1 = binary)
+#define OP_SET_BAUD         0x02    // u32 baud
+#define OP_BAUD_TEST        0x03    // Test pattern, echoed back; empty = confirm
+#define OP_SEQ              0x04    // u16 seq (1-65535), then a command's opcode + payload
+#define OP_SCAN_SENSORS     0x20
+#define OP_HIGHLIGHT        0x21    // u8 r, g, b, u16 duration, N x u8 square
+#define OP_FLASH_ALL        0x22    // u8 r, g, b, count
+#define OP_LEDS_OFF         0x23
+#define OP_SET_BRIGHTNESS   0x24    // u8 brightness
+#define OP_SET_LED_FPS      0x26    // u8 fps
+#define OP_SHOW_EVALUATION  0x27    // 32 x u8, 4-bit class per square, low nibble first
+#define OP_CLEAR_EVALUATION 0x28
+#define OP_SET_FRAME        0x29    // u8 flags (bit 0 = squares, bit 1 = RLE), u16 duration,
+                                    // [squares: u8 N, N x (r, g, b)], frame data (see showFrame())
+#define OP_CLEAR_FRAME      0x2A
+#define OP_SET_REPORTING    0x25    // u8 flags (bit 0 = deltas, bit 1 = snapshots), [u8 debounce]
+
+// Sensor controller -> Pi
+#define OP_STATUS           0x80    // status '\0' [message]
+#define OP_ACK              0x83    // u16 seq: command received
+#define OP_DONE             0x84    // u16 seq: command finished
+#define OP_ERROR            0x85    // u16 seq, message: command failed
+#define OP_SENSOR_UPDATE    0x90    // 8 x u8, one byte per rank, bit n = file n
+#define OP_BUTTON           0x91    // u8 button, u8 pressed
+#define OP_ENCODER          0x92    // u8 encoder, i8 delta
+#define OP_SQUARE_EVENT     0x93    // u8 square, u8 placed, u32 time (ms)
+#define OP_SENSOR_BITS      0x94    // u16 first sensor (multiple of 64), 8 x u8, bit n = sensor first + n
+#define OP_SENSOR_EVENT     0x95    // u16 sensor, u8 placed, u32 time (ms): sensors from BOARD_SENSORS up
 
 // ==================== CONSTANTS ====================
 
-#define BOARD_SIZE    8
-#define SCAN_INTERVAL_MS    100   // Scan sensors every 100ms
+#define BOARD_SENSORS       64    // Sensors 0-63 are the squares, higher ones extension sensors
+#define SENSOR_BASE_MAX     960   // Highest sensor_base for a chained controller
+#define SCAN_INTERVAL_MS    2     // Input task period
+#define MUX_SETTLE_US       2     // Select-line settle time before sampling
+#define MUX_CHANNELS        16
+#define INPUT_TASK_CORE     0     // Keep input off the loop() core
+#define INPUT_TASK_PRIORITY 2
+#define EVENT_QUEUE_SIZE    32    // Input task -> loop()
+#define COMMAND_QUEUE_SIZE  8     // loop() -> input task
 #define BUTTON_DEBOUNCE_MS  50    // Button debounce time
 #define LED_BRIGHTNESS      128   // Default brightness (0-255)
+#define LED_FPS             50    // Default frame rate cap (set_led_fps)
+#define RMT_TICK_NS         100   // WS2812B bit timing in 100 ns ticks:
+#define WS2812_T0H          4     //   0 bit: 400 ns high, 800 ns low
+#define WS2812_T0L          8
+#define WS2812_T1H          8     //   1 bit: 800 ns high, 400 ns low
+#define WS2812_T1L          4
+#define WS2812_BITS         (LED_COUNT * 24)
+#define FLASH_PERIOD_MS     400   // One on/off cycle of flash_all
+#define HIGHLIGHT_MS        2000  // Default highlight_squares duration
+
+// LED layers, composited bottom to top
+#define LAYER_FRAME         0     // set_frame
+#define LAYER_EVALUATION    1     // show_evaluation_colors
+#define LAYER_HIGHLIGHT     2     // highlight_squares
+#define LAYER_EFFECT        3     // flash_all and other full-board effects
+#define LED_LAYERS          4
+
+#define EVAL_PALETTE_SIZE   16    // Class 0 = no overlay on that square
+
+// Settings kept in NVS (get_config / set_config)
+#define CONFIG_NAMESPACE    "sensor"
+#define CONFIG_VERSION      2     // Bump when SensorConfig changes layout
+#define THEME_CUSTOM        0xFF  // Theme colors changed from a named theme
+
+// ==================== SENSOR LAYOUT ====================
+
+// The scan, as data: one row per multiplexer bank (see MuxBank in
+// board_logic.h). All banks share S0-S3, so a scan is MUX_CHANNELS select
+// steps however many banks are fitted, each sampling every bank in one
+// GPIO read; more banks only add a bit test per bank and step. Sensors
+// from BOARD_SENSORS up are extension sensors (graveyard slots, extra
+// tables), reported by index rather than square.
+constexpr MuxBank MUX_BANKS[] = {
+    {MUX1_OUT_PIN, 0},          // Ranks 1-2
+    {MUX2_OUT_PIN, 16},         // Ranks 3-4
+    {MUX3_OUT_PIN, 32},         // Ranks 5-6
+    {MUX4_OUT_PIN, 48},         // Ranks 7-8
+    // {MUX5_OUT_PIN, 64},      // e.g. a 16-slot graveyard bank
+};
+#define MUX_BANK_COUNT      (sizeof(MUX_BANKS) / sizeof(MUX_BANKS[0]))
+
+constexpr uint16_t SENSOR_COUNT = layoutSensorCount(MUX_BANKS, MUX_BANK_COUNT, MUX_CHANNELS);
+#define SENSOR_WORDS        ((SENSOR_COUNT + 63) / 64)
 
 // ==================== GLOBAL VARIABLES ====================
 
-// Sensor state (8x8 matrix, true = piece detected)
-bool sensorState[BOARD_SIZE][BOARD_SIZE];
-bool lastSensorState[BOARD_SIZE][BOARD_SIZE];
+// Sensor state in 64-bit words, bit set = piece detected: sensor n is bit
+// n % 64 of word n / 64, so word 0 is the board with bit rank * 8 + file.
+// Owned by loop(), updated from the input task's board events.
+uint64_t sensorBits[SENSOR_WORDS];
+uint64_t lastSensorBits[SENSOR_WORDS];  // Last state reported to the Pi
+
+// Position of this controller's sensors in a chain (set_config
+// "sensor_base", multiple of 64): a second sensor ESP32 at 64 reports its
+// sensors as 64 and up, so the Pi merges both into one sensor space.
+uint16_t sensorBase = 0;
 
-// LED control
-Adafruit_NeoPixel strip(LED_COUNT, LED_DATA_PIN, NEO_GRB + NEO_KHZ800);
+// Which reports a board change produces (set_sensor_reporting)
+bool reportDeltas = true;           // square_lifted / square_placed events
+bool reportSnapshots = true;        // Full sensor_update matrix
+uint8_t debounceSetting = SENSOR_DEBOUNCE;  // loop()'s copy of debounceSamples
 
-// Button states
+// LED output: serviceLEDs() composites into ledFrame, pushLEDFrame()
+// encodes it into whichever RMT buffer isn't being sent and starts the
+// transfer. Nothing is sent unless the frame is dirty.
+rmt_obj_t* ledRmt = nullptr;
+uint32_t ledFrame[LED_COUNT];               // 0x00RRGGBB
+rmt_data_t rmtBuffers[2][WS2812_BITS];
+uint8_t rmtBufferIndex = 0;
+uint8_t ledBrightness = LED_BRIGHTNESS;
+bool frameDirty = false;
+unsigned long lastFramePush = 0;
+unsigned long ledFrameInterval = 1000 / LED_FPS;
+uint8_t ledFps = LED_FPS;
+
+// Button states (owned by inputTask)
 bool buttonStates[6] = {false};
 bool lastButtonStates[6] = {false};
 unsigned long lastButtonPress[6] = {0};
 
-// Rotary encoder states
+// Rotary encoder states (positions written by the ISRs, deltas taken by
+// inputTask)
 volatile int encoder1Position = 0;
 volatile int encoder2Position = 0;
 int lastEncoder1Position = 0;
 int lastEncoder2Position = 0;
 
-// Timing
-unsigned long lastScanTime = 0;
+// Debounce state, owned by inputTask(): per sensor word, the last
+// SENSOR_DEBOUNCE_MAX raw scans and the filtered bits built from them
+uint64_t scanHistory[SENSOR_WORDS][SENSOR_DEBOUNCE_MAX];
+uint8_t scanHistoryIndex = 0;
+uint64_t debouncedBits[SENSOR_WORDS];
+uint64_t deliveredBits[SENSOR_WORDS];   // Last bits queued for loop()
+uint8_t debounceSamples = SENSOR_DEBOUNCE;
+
+// Single-producer single-consumer ring buffer, safe across cores without
+// locks: only the producer writes head, only the consumer writes tail.
+// Holds N - 1 items.
+template <typename T, size_t N>
+struct SpscQueue {
+    T items[N];
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    
+    bool push(const T& item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t next = (h + 1) % N;
+        if (next == tail.load(std::memory_order_acquire)) return false;   // Full
+        items[h] = item;
+        head.store(next, std::memory_order_release);
+        return true;
+    }
+    
+    bool pop(T& item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return false;      // Empty
+        item = items[t];
+        tail.store((t + 1) % N, std::memory_order_release);
+        return true;
+    }
+};
+
+enum InputEventType : uint8_t {
+    EVENT_BOARD,        // Debounced sensors changed: index = word, board = its bits, time
+    EVENT_BUTTON,       // index = button (1-6), value = pressed
+    EVENT_ENCODER       // index = encoder (1-2), value = delta
+};
+
+struct InputEvent {
+    InputEventType type;
+    uint8_t index;
+    int16_t value;
+    uint32_t time;
+    uint64_t board;
+};
+
+enum InputCommandType : uint8_t {
+    INPUT_SET_DEBOUNCE  // value = samples
+};
+
+struct InputCommand {
+    InputCommandType type;
+    uint8_t value;
+};
+
+SpscQueue<InputEvent, EVENT_QUEUE_SIZE> inputEvents;
+SpscQueue<InputCommand, COMMAND_QUEUE_SIZE> inputCommands;
+TaskHandle_t inputTaskHandle = nullptr;
+
+// Debug log ring buffer. Any task may append (under logMux); loop() drains
+// it to Serial only as fast as the TX FIFO takes it, so logging never
+// blocks. Indices run freely and are masked on access.
+char logBuffer[LOG_BUFFER_SIZE];
+volatile uint32_t logHead = 0;
+volatile uint32_t logTail = 0;
+volatile uint32_t logDropped = 0;   // Lines lost to a full buffer
+portMUX_TYPE logMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Timing histograms for get_stats, from the CPU cycle counter. The input
+// task records the scan stat, loop() the others; all of them are copied
+// and cleared under statsMux.
+enum PerfStatId : uint8_t {
+    PERF_LOOP,                      // One loop() pass
+    PERF_SCAN,                      // Full 8x8 read plus debounce
+    PERF_COMMAND,                   // One UART command, parsed and executed
+    PERF_LED_FRAME,                 // Encoding and starting one LED frame
+    PERF_STATS
+};
+
+struct PerfStat {
+    uint32_t count;
+    uint32_t maxCycles;
+    uint64_t totalCycles;
+    uint32_t buckets[STATS_BUCKETS];
+};
+
+PerfStat perfStats[PERF_STATS];
+const char* const PERF_STAT_NAMES[PERF_STATS] = {"loop", "scan", "command", "led_frame"};
+uint32_t cyclesPerUs = 240;         // Set from the CPU clock in setup()
+portMUX_TYPE statsMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Link error counters for get_stats
+struct LinkCounters {
+    uint32_t rxOverflows;           // RX FIFO/ring overflow events (bytes were lost)
+    uint32_t rxErrors;              // Framing or parity errors
+    uint32_t crcErrors;             // Binary frames dropped on CRC
+    uint32_t jsonErrors;            // Unparseable JSON lines
+    uint32_t lineOverflows;         // JSON lines longer than LINE_BUFFER_SIZE
+} linkCounters;
+
+// GPIO mask for the shared select lines (GPIO0-31, one register write)
+const uint32_t MUX_SELECT_MASK = (1UL << MUX_S0_PIN) | (1UL << MUX_S1_PIN) |
+                                 (1UL << MUX_S2_PIN) | (1UL << MUX_S3_PIN);
 
 // JSON buffer
 StaticJsonDocument<2048> jsonDoc;
-String inputBuffer = "";
+// Fixed line buffer: commands are parsed in place, nothing is allocated
+char lineBuffer[LINE_BUFFER_SIZE];
+size_t lineLength = 0;
+bool lineOverflow = false;     // Discarding until the next newline
+
+// Binary protocol state (JSON commands are always accepted; this selects
+// the format of outgoing messages)
+bool binaryProtocol = false;
+
+// Link speed negotiation (set_baud): a new rate is kept only once the Pi
+// has confirmed it with a CRC-checked test burst
+uint32_t linkBaud = UART_BAUD;
+uint32_t fallbackBaud = UART_BAUD;
+bool baudPending = false;
+unsigned long baudSwitchTime = 0;
+uint8_t linkErrors = 0;             // Consecutive corrupted frames/lines
+
+FrameParser frameParser;
+
+// Sequence ID of the command being run by loop() (0 = untagged)
+uint16_t commandSeq = 0;
 
 // LED theme/colors
 struct LEDTheme {
@@ -106,50 +403,208 @@ struct LEDTheme {
     uint32_t legalMoveColor;
 } currentTheme;
 
+// Named themes for set_theme; names match the backend's led_theme setting
+// (case-insensitive)
+struct NamedTheme {
+    const char* name;
+    LEDTheme colors;
+};
+
+const NamedTheme LED_THEMES[] = {
+    {"classic", {0x000000, 0xFFFFFF, 0x646464, 0x00FF00, 0x0064FF}},
+    {"modern",  {0x000000, 0xFFF0DC, 0x2040FF, 0x00FFC8, 0xC800FF}},
+    {"rainbow", {0x000000, 0xFFFFFF, 0xFF00FF, 0xFFFF00, 0x00FFFF}}
+};
+#define LED_THEME_COUNT     (sizeof(LED_THEMES) / sizeof(LED_THEMES[0]))
+
+uint8_t themeIndex = 0;             // LED_THEMES entry, or THEME_CUSTOM
+
+// LED animation: each layer covers some LEDs with a color and a timed
+// effect. serviceLEDs() composites the active layers once per frame,
+// so effects never block loop().
+enum LEDEffect : uint8_t {
+    EFFECT_SOLID,       // Constant color
+    EFFECT_FLASH,       // On for half of each period, off for the other
+    EFFECT_PULSE,       // Triangle wave brightness over each period
+    EFFECT_FADE         // Linear fade-out over the duration
+};
+
+// How a layer combines squares that share a corner LED
+enum LEDBlend : uint8_t {
+    BLEND_PRIORITY,     // Higher priority wins, later square on a tie
+    BLEND_MAX,          // Per-channel maximum
+    BLEND_AVERAGE       // Average of all squares on that corner
+};
+
+struct LEDLayer {
+    bool active;
+    LEDEffect effect;
+    LEDBlend blend;
+    unsigned long startTime;
+    unsigned long duration;     // ms, 0 = until cleared
+    uint16_t period;            // ms, for flash/pulse
+    bool covered[LED_COUNT];    // LEDs this layer draws
+    uint32_t color[LED_COUNT];
+    uint8_t weight[LED_COUNT];  // Priority, or square count when averaging
+};
+
+constexpr uint8_t ledGridIndex(int x, int y) {
+    return serpentineIndex(x, y, LED_GRID_SIZE);
+}
+
+// Square -> corner LED table for the shared-corner grid, built at compile
+// time from BOARD_SIZE (serpentine mapping in board_logic.h)
+static_assert(LED_GRID_SIZE == BOARD_SIZE + 1, "the LED grid has one corner row more than the board");
+static_assert(LED_COUNT == LED_GRID_SIZE * LED_GRID_SIZE, "one LED per grid point");
+
+constexpr SquareLEDTable<BOARD_SIZE> SQUARE_LEDS = buildSquareLEDs<BOARD_SIZE>();
+
+static_assert(SQUARE_LEDS[0].led[3] == 16, "a1 bottom-right corner is the second row's 8th LED");
+static_assert(SQUARE_LEDS[BOARD_SIZE * BOARD_SIZE - 1].led[3] == LED_COUNT - 1, "h8 bottom-right corner is the last LED");
+
+LEDLayer ledLayers[LED_LAYERS];
+
+// Live evaluation overlay: one palette class per square (rank * 8 + file),
+// drawn into LAYER_EVALUATION. Defaults match the backend's classification
+// colors: brilliant, excellent, good, neutral, inaccuracy, mistake, blunder.
+uint8_t evalClasses[BOARD_SIZE * BOARD_SIZE];
+const uint32_t DEFAULT_EVAL_PALETTE[EVAL_PALETTE_SIZE] = {
+    0x000000, 0xFFD700, 0x00FF00, 0x64C864,
+    0xC8C8C8, 0xFFA500, 0xFF6400, 0xFF0000
+};
+uint32_t evalPalette[EVAL_PALETTE_SIZE];       // Set from the config at boot
+unsigned long lastLEDFrame = 0;
+bool ledsChanged = true;        // Layers changed since the last frame
+
+// Stored settings: one versioned blob in NVS, only touched by loop().
+// A flash write pauses both cores for a few ms, which only delays the
+// next scan and LED frame; nothing here is timing-critical like steps.
+struct SensorConfig {
+    uint8_t version;
+    uint8_t brightness;
+    uint8_t fps;
+    uint8_t debounce;
+    bool reportDeltas;
+    bool reportSnapshots;
+    uint8_t theme;                  // LED_THEMES entry, or THEME_CUSTOM
+    LEDTheme themeColors;
+    uint32_t evalPalette[EVAL_PALETTE_SIZE];
+    uint16_t sensorBase;            // Chain position, multiple of 64
+};
+
+Preferences configStore;
+bool configStored = false;          // Running configuration came from NVS
+
 // ==================== FUNCTION DECLARATIONS ====================
 
 void setupPins();
 void setupLEDs();
-void scanSensors();
+void inputTask(void* param);
+void processInputEvents();
+void reportSensorChange(uint8_t word, uint64_t bits, unsigned long timestamp);
+void readSensors(uint64_t* raw);
+void debounceSensors(const uint64_t* raw);
 void readButtons();
+void readEncoders();
+void setDebounceSamples(int samples);
 void sendSensorUpdate();
+void sendSensorBits(uint8_t word);
+void sendSensorSnapshot();
+void sendSquareEvent(int sensor, bool placed, unsigned long timestamp);
 void sendButtonEvent(int buttonIndex, bool pressed);
 void sendEncoderEvent(int encoderIndex, int delta);
 void processUARTCommand();
+void feedLineByte(char c);
+bool feedFrameByte(uint8_t c);
+void processBinaryFrame(uint8_t opcode, const uint8_t* payload, uint8_t len);
+void sendFrame(uint8_t opcode, const uint8_t* payload, uint8_t len);
+void requestBaudRate(uint32_t baud);
+void handleBaudTest(const uint8_t* payload, uint8_t len);
+void serviceLinkSpeed();
+void reportLinkError();
+uint16_t readUint16(const uint8_t* p);
+void sendStatus(const char* status, const char* message = nullptr);
+void sendReply(uint8_t opcode, uint16_t seq, const char* message = nullptr);
+void beginCommand(uint16_t seq);
+void endCommand();
+void failCommand(const char* message);
 void handleLEDCommand(JsonObject& cmd);
+void flashAll(uint32_t color, int count);
+void showEvaluation(const uint8_t* classes, LEDBlend blend = BLEND_PRIORITY);
+void clearEvaluation();
+void redrawEvaluationLED(int x, int y);
+void setEvaluationPalette(JsonArray colors);
+void redrawEvaluation();
+bool showFrame(bool squares, const uint8_t* data, size_t len, bool rle, const uint32_t* palette,
+               uint8_t paletteSize, unsigned long duration, LEDBlend blend = BLEND_MAX);
+LEDLayer& beginLayer(uint8_t layer, LEDEffect effect, unsigned long duration, uint16_t period = 0);
+void clearLayer(uint8_t layer);
+void clearAllLayers();
+LEDEffect parseEffect(const char* name);
+LEDBlend parseBlend(const char* name);
+void blendLED(LEDLayer& layer, uint8_t led, uint32_t color, uint8_t priority);
+uint8_t layerIntensity(const LEDLayer& layer, unsigned long elapsed);
+void serviceLEDs();
 void handleConfigCommand(JsonObject& cmd);
-void setLEDSquare(int file, int rank, uint32_t color);
+void defaultConfig(SensorConfig& config);
+void captureConfig(SensorConfig& config);
+void applyConfig(const SensorConfig& config);
+void setSensorBase(int base);
+void loadConfig();
+void saveConfig();
+void sendConfig();
+bool applyTheme(const char* name, JsonObject colors);
+void setLEDSquare(LEDLayer& layer, int file, int rank, uint32_t color, uint8_t priority = 0);
 void updateLEDs();
-uint8_t readMultiplexer(uint8_t muxIndex, uint8_t channel);
+uint32_t ledColor(uint8_t r, uint8_t g, uint8_t b);
+void showLEDs();
+void pushLEDFrame();
+void setLEDFps(int fps);
+uint64_t readMuxChannel(uint8_t channel);
 void IRAM_ATTR encoder1ISR();
 void IRAM_ATTR encoder2ISR();
+void recordPerf(PerfStat& stat, uint32_t cycles);
+void onUARTError(hardwareSerial_error_t error);
+void sendStats(bool reset);
+void resetStats();
+void logPrintf(char level, const char* format, ...);
+void serviceLog();
 
 // ==================== SETUP ====================
 
 void setup() {
     // Initialize serial for debugging
     Serial.begin(115200);
-    Serial.println("\n\n=== ESP32 Sensor Controller Starting ===");
+    LOG_I("=== ESP32 Sensor Controller Starting ===");
     
     // Initialize UART for Pi communication
+    Serial1.setRxBufferSize(UART_RX_BUFFER);
     Serial1.begin(UART_BAUD, SERIAL_8N1, UART_RX_PIN, UART_TX_PIN);
+    Serial1.onReceiveError(onUARTError);
+    cyclesPerUs = ESP.getCpuFreqMHz();
+    
+    // Stored settings over the build defaults (LED theme, brightness, debounce)
+    loadConfig();
     
     // Setup hardware
     setupPins();
     setupLEDs();
     
-    // Initialize sensor state to all empty
-    memset(sensorState, 0, sizeof(sensorState));
-    memset(lastSensorState, 0, sizeof(lastSensorState));
+    // Start from the board as it is, so boot doesn't report every piece
+    // as just placed
+    readSensors(debouncedBits);
+    for (int word = 0; word < SENSOR_WORDS; word++) {
+        for (int i = 0; i < SENSOR_DEBOUNCE_MAX; i++) {
+            scanHistory[word][i] = debouncedBits[word];
+        }
+        sensorBits[word] = lastSensorBits[word] = deliveredBits[word] = debouncedBits[word];
+    }
     
-    // Set default LED theme
-    currentTheme.backgroundColor = strip.Color(0, 0, 0);        // Black
-    currentTheme.whitePieceColor = strip.Color(255, 255, 255);  // White
-    currentTheme.blackPieceColor = strip.Color(100, 100, 100);  // Gray
-    currentTheme.highlightColor = strip.Color(0, 255, 0);       // Green
-    currentTheme.legalMoveColor = strip.Color(0, 100, 255);     // Blue
+    // All input polling runs on the other core; loop() only gets events
+    xTaskCreatePinnedToCore(inputTask, "input", 4096, nullptr, INPUT_TASK_PRIORITY,
+                            &inputTaskHandle, INPUT_TASK_CORE);
     
-    Serial.println("Setup complete. Ready for commands.");
+    LOG_I("Setup complete. Ready for commands.");
     
     // Send ready signal to Pi
     StaticJsonDocument<128> readyMsg;
@@ -163,41 +618,32 @@ void setup() {
 // ==================== MAIN LOOP ====================
 
 void loop() {
-    unsigned long currentTime = millis();
-    
-    // Scan sensors at regular interval
-    if (currentTime - lastScanTime >= SCAN_INTERVAL_MS) {
-        scanSensors();
-        lastScanTime = currentTime;
-    }
+    uint32_t loopStart = ESP.getCycleCount();
     
-    // Read buttons
-    readButtons();
+    // Report sensor, button and encoder changes from the input task
+    processInputEvents();
     
-    // Check for encoder changes
-    if (encoder1Position != lastEncoder1Position) {
-        int delta = encoder1Position - lastEncoder1Position;
-        sendEncoderEvent(1, delta);
-        lastEncoder1Position = encoder1Position;
-    }
+    // Advance LED animations, then send the frame if it changed
+    serviceLEDs();
+    pushLEDFrame();
     
-    if (encoder2Position != lastEncoder2Position) {
-        int delta = encoder2Position - lastEncoder2Position;
-        sendEncoderEvent(2, delta);
-        lastEncoder2Position = encoder2Position;
-    }
+    // Debug output, as far as the TX FIFO has room
+    serviceLog();
     
     // Process UART commands from Pi
+    serviceLinkSpeed();
     while (Serial1.available()) {
         char c = Serial1.read();
         
-        if (c == '\n') {
-            processUARTCommand();
-            inputBuffer = "";
-        } else {
-            inputBuffer += c;
+        // Binary frames start with FRAME_SYNC outside of a JSON line
+        if (lineLength == 0 && !lineOverflow && feedFrameByte(c)) {
+            continue;
         }
+        
+        feedLineByte(c);
     }
+    
+    recordPerf(perfStats[PERF_LOOP], ESP.getCycleCount() - loopStart);
 }
 
 // ==================== PIN SETUP ====================
@@ -239,85 +685,202 @@ void setupPins() {
     attachInterrupt(digitalPinToInterrupt(ENC1_A_PIN), encoder1ISR, CHANGE);
     attachInterrupt(digitalPinToInterrupt(ENC2_A_PIN), encoder2ISR, CHANGE);
     
-    Serial.println("Pins configured");
+    LOG_I("Pins configured");
 }
 
 void setupLEDs() {
-    strip.begin();
-    strip.setBrightness(LED_BRIGHTNESS);
-    strip.clear();
-    strip.show();
+    ledRmt = rmtInit(LED_DATA_PIN, RMT_TX_MODE, RMT_MEM_64);
+    rmtSetTick(ledRmt, RMT_TICK_NS);
     
     // Test pattern: flash all LEDs
     for (int i = 0; i < LED_COUNT; i++) {
-        strip.setPixelColor(i, strip.Color(50, 50, 50));
+        ledFrame[i] = ledColor(50, 50, 50);
     }
-    strip.show();
+    showLEDs();
+    pushLEDFrame();
     delay(200);
-    strip.clear();
-    strip.show();
+    memset(ledFrame, 0, sizeof(ledFrame));
+    showLEDs();
+    pushLEDFrame();
     
-    Serial.println("LEDs initialized");
+    LOG_I("LEDs initialized");
 }
 
 // ==================== SENSOR SCANNING ====================
 
-void scanSensors() {
-    bool changed = false;
+void inputTask(void* param) {
+    /**
+     * Everything that samples hardware inputs, pinned to INPUT_TASK_CORE.
+     *
+     * A full scan is 16 channel steps of roughly MUX_SETTLE_US each,
+     * whatever the number of banks, so running every SCAN_INTERVAL_MS
+     * keeps lift/drop latency well under 10 ms. Nothing here waits on
+     * UART or LED work on the other core.
+     */
+    TickType_t lastWake = xTaskGetTickCount();
     
-    // Scan all 64 sensors (8x8 matrix)
-    for (int rank = 0; rank < BOARD_SIZE; rank++) {
-        for (int file = 0; file < BOARD_SIZE; file++) {
-            // Calculate which multiplexer and channel
-            // Layout: 4 multiplexers, each handles 2 ranks (16 sensors)
-            int muxIndex = rank / 2;        // 0-3
-            int channel = (rank % 2) * 8 + file;  // 0-15
-            
-            // Read sensor (active LOW, so invert)
-            bool pieceDetected = !readMultiplexer(muxIndex, channel);
+    for (;;) {
+        InputCommand command;
+        while (inputCommands.pop(command)) {
+            if (command.type == INPUT_SET_DEBOUNCE) {
+                debounceSamples = command.value;
+            }
+        }
+        
+        uint32_t scanStart = ESP.getCycleCount();
+        uint64_t raw[SENSOR_WORDS];
+        readSensors(raw);
+        debounceSensors(raw);
+        uint32_t scanCycles = ESP.getCycleCount() - scanStart;
+        
+        portENTER_CRITICAL(&statsMux);
+        recordPerf(perfStats[PERF_SCAN], scanCycles);
+        portEXIT_CRITICAL(&statsMux);
+        
+        // Only changed words are queued. If the queue is full the change
+        // is retried next scan; loop() diffs words, so intermediate states
+        // can be coalesced safely
+        for (uint8_t word = 0; word < SENSOR_WORDS; word++) {
+            if (debouncedBits[word] != deliveredBits[word]) {
+                InputEvent event = {EVENT_BOARD, word, 0, (uint32_t)millis(), debouncedBits[word]};
+                if (inputEvents.push(event)) {
+                    deliveredBits[word] = debouncedBits[word];
+                }
+            }
+        }
+        
+        readButtons();
+        readEncoders();
+        
+        vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(SCAN_INTERVAL_MS));
+    }
+}
+
+void processInputEvents() {
+    InputEvent event;
+    while (inputEvents.pop(event)) {
+        switch (event.type) {
+            case EVENT_BOARD:
+                reportSensorChange(event.index, event.board, event.time);
+                break;
             
-            sensorState[rank][file] = pieceDetected;
+            case EVENT_BUTTON:
+                sendButtonEvent(event.index, event.value != 0);
+                break;
             
-            // Check for changes
-            if (sensorState[rank][file] != lastSensorState[rank][file]) {
-                changed = true;
-            }
+            case EVENT_ENCODER:
+                sendEncoderEvent(event.index, event.value);
+                break;
         }
     }
+}
+
+void setDebounceSamples(int samples) {
+    debounceSetting = constrain(samples, 1, SENSOR_DEBOUNCE_MAX);
+    InputCommand command = {INPUT_SET_DEBOUNCE, debounceSetting};
+    inputCommands.push(command);
+}
+
+void readSensors(uint64_t* raw) {
+    // One pass over the channels; each step samples the same channel of
+    // every bank in MUX_BANKS at once. Sensors are active LOW.
+    memset(raw, 0, SENSOR_WORDS * sizeof(uint64_t));
     
-    // If board state changed, send update to Pi
-    if (changed) {
-        sendSensorUpdate();
+    for (uint8_t channel = 0; channel < MUX_CHANNELS; channel++) {
+        uint64_t inputs = readMuxChannel(channel);
         
-        // Update last known state
-        memcpy(lastSensorState, sensorState, sizeof(sensorState));
+        for (const MuxBank& bank : MUX_BANKS) {
+            if (!((inputs >> bank.outPin) & 1)) {
+                uint16_t sensor = bank.firstSensor + channel;
+                raw[sensor / 64] |= 1ULL << (sensor % 64);
+            }
+        }
+    }
+}
+
+void debounceSensors(const uint64_t* raw) {
+    /**
+     * Filter all sensors at once, one 64-bit word at a time. A sensor
+     * only takes a new value after reading it in the last debounceSamples
+     * scans in a row, so a sliding or bouncing piece produces exactly one
+     * lift and one place, and single-scan glitches are dropped. Adds
+     * (debounceSamples - 1) * SCAN_INTERVAL_MS of latency.
+     */
+    for (int word = 0; word < SENSOR_WORDS; word++) {
+        scanHistory[word][scanHistoryIndex] = raw[word];
+        debouncedBits[word] = debounceBoard(scanHistory[word], SENSOR_DEBOUNCE_MAX, scanHistoryIndex,
+                                            debounceSamples, debouncedBits[word]);
     }
+    scanHistoryIndex = (scanHistoryIndex + 1) % SENSOR_DEBOUNCE_MAX;
 }
 
-uint8_t readMultiplexer(uint8_t muxIndex, uint8_t channel) {
-    // Set multiplexer channel (S0-S3)
-    digitalWrite(MUX_S0_PIN, channel & 0x01);
-    digitalWrite(MUX_S1_PIN, (channel >> 1) & 0x01);
-    digitalWrite(MUX_S2_PIN, (channel >> 2) & 0x01);
-    digitalWrite(MUX_S3_PIN, (channel >> 3) & 0x01);
+uint64_t readMuxChannel(uint8_t channel) {
+    // Set multiplexer channel (S0-S3) in one register write each way
+    uint32_t select = ((channel & 0x01) ? (1UL << MUX_S0_PIN) : 0) |
+                      ((channel & 0x02) ? (1UL << MUX_S1_PIN) : 0) |
+                      ((channel & 0x04) ? (1UL << MUX_S2_PIN) : 0) |
+                      ((channel & 0x08) ? (1UL << MUX_S3_PIN) : 0);
+    GPIO.out_w1tc = MUX_SELECT_MASK & ~select;
+    GPIO.out_w1ts = select;
     
     // Small delay for multiplexer to settle
-    delayMicroseconds(10);
+    delayMicroseconds(MUX_SETTLE_US);
     
-    // Read from appropriate multiplexer output pin
-    uint8_t value;
-    switch (muxIndex) {
-        case 0: value = digitalRead(MUX1_OUT_PIN); break;
-        case 1: value = digitalRead(MUX2_OUT_PIN); break;
-        case 2: value = digitalRead(MUX3_OUT_PIN); break;
-        case 3: value = digitalRead(MUX4_OUT_PIN); break;
-        default: value = 0;
+    // Every bank output in one read of each input register (GPIO0-31, 32-48)
+    return ((uint64_t)GPIO.in1.data << 32) | GPIO.in;
+}
+
+void reportSensorChange(uint8_t word, uint64_t bits, unsigned long timestamp) {
+    sensorBits[word] = bits;
+    
+    if (bits == lastSensorBits[word]) {
+        return;
+    }
+    
+    // One event per changed sensor, lowest first
+    if (reportDeltas) {
+        uint16_t first = sensorBase + word * 64;
+        forEachChangedSquare(lastSensorBits[word], bits, [first, timestamp](int bit, bool placed) {
+            sendSquareEvent(first + bit, placed, timestamp);
+        });
     }
     
-    return value;
+    // Update last known state
+    lastSensorBits[word] = bits;
+    
+    if (reportSnapshots) {
+        if (sensorBase + word * 64 < BOARD_SENSORS) {
+            sendSensorUpdate();
+        } else {
+            sendSensorBits(word);
+        }
+    }
+}
+
+void sendSensorSnapshot() {
+    // scan_sensors: the board matrix and/or every extension word this controller has
+    for (uint8_t word = 0; word < SENSOR_WORDS; word++) {
+        if (sensorBase + word * 64 < BOARD_SENSORS) {
+            sendSensorUpdate();
+        } else {
+            sendSensorBits(word);
+        }
+    }
 }
 
 void sendSensorUpdate() {
+    // The board squares (sensor word 0 of a controller at sensorBase 0)
+    uint64_t board = sensorBits[0];
+    
+    if (binaryProtocol) {
+        uint8_t payload[BOARD_SIZE];
+        for (int rank = 0; rank < BOARD_SIZE; rank++) {
+            payload[rank] = (board >> (rank * BOARD_SIZE)) & 0xFF;
+        }
+        sendFrame(OP_SENSOR_UPDATE, payload, sizeof(payload));
+        return;
+    }
+    
     // Build JSON message with sensor matrix
     jsonDoc.clear();
     jsonDoc["type"] = "sensor_update";
@@ -327,14 +890,78 @@ void sendSensorUpdate() {
     for (int rank = 0; rank < BOARD_SIZE; rank++) {
         JsonArray row = sensors.createNestedArray();
         for (int file = 0; file < BOARD_SIZE; file++) {
-            row.add(sensorState[rank][file]);
+            row.add((bool)((board >> (rank * BOARD_SIZE + file)) & 1));
+        }
+    }
+    
+    serializeJson(jsonDoc, Serial1);
+    Serial1.println();
+    
+    LOG_D("Sensor update sent");
+}
+
+void sendSensorBits(uint8_t word) {
+    // 64 extension sensors from 'first': JSON "bits" is the word as 16
+    // hex digits, sensor first + n = bit n
+    uint16_t first = sensorBase + word * 64;
+    uint64_t bits = sensorBits[word];
+    
+    if (binaryProtocol) {
+        uint8_t payload[10] = {(uint8_t)first, (uint8_t)(first >> 8)};
+        for (int i = 0; i < 8; i++) {
+            payload[2 + i] = (bits >> (i * 8)) & 0xFF;
         }
+        sendFrame(OP_SENSOR_BITS, payload, sizeof(payload));
+        return;
     }
     
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%08lx%08lx", (unsigned long)(bits >> 32), (unsigned long)(bits & 0xFFFFFFFF));
+    
+    jsonDoc.clear();
+    jsonDoc["type"] = "sensor_bits";
+    jsonDoc["first"] = first;
+    jsonDoc["bits"] = hex;
+    
     serializeJson(jsonDoc, Serial1);
     Serial1.println();
+}
+
+void sendSquareEvent(int sensor, bool placed, unsigned long timestamp) {
+    // Board squares as square_lifted / square_placed, extension sensors
+    // as sensor_lifted / sensor_placed
+    bool square = sensor < BOARD_SENSORS;
+    
+    if (binaryProtocol) {
+        uint8_t payload[7];
+        uint8_t len = 0;
+        if (square) {
+            payload[len++] = sensor;
+        } else {
+            payload[len++] = sensor & 0xFF;
+            payload[len++] = sensor >> 8;
+        }
+        payload[len++] = placed ? 1 : 0;
+        for (int i = 0; i < 4; i++) {
+            payload[len++] = (timestamp >> (i * 8)) & 0xFF;
+        }
+        sendFrame(square ? OP_SQUARE_EVENT : OP_SENSOR_EVENT, payload, len);
+        return;
+    }
+    
+    jsonDoc.clear();
+    if (square) {
+        jsonDoc["type"] = placed ? "square_placed" : "square_lifted";
+        jsonDoc["file"] = sensor % BOARD_SIZE;
+        jsonDoc["rank"] = sensor / BOARD_SIZE;
+    } else {
+        jsonDoc["type"] = placed ? "sensor_placed" : "sensor_lifted";
+        jsonDoc["sensor"] = sensor;
+    }
+    jsonDoc["time"] = timestamp;
     
-    Serial.println("Sensor update sent");
+    serializeJson(jsonDoc, Serial1);
+    Serial1.println();
 }
 
 // ==================== BUTTON READING ====================
@@ -351,11 +978,12 @@ void readButtons() {
         // Debounce
         if (currentState != lastButtonStates[i]) {
             if (currentTime - lastButtonPress[i] > BUTTON_DEBOUNCE_MS) {
+                // Queue button event for loop(); retried next poll if full
+                InputEvent event = {EVENT_BUTTON, (uint8_t)(i + 1), currentState, (uint32_t)currentTime, 0};
+                if (!inputEvents.push(event)) continue;
+                
                 buttonStates[i] = currentState;
                 lastButtonPress[i] = currentTime;
-                
-                // Send button event
-                sendButtonEvent(i + 1, currentState);
             }
         }
         
@@ -363,7 +991,28 @@ void readButtons() {
     }
 }
 
+void readEncoders() {
+    // Queue encoder deltas; a delta stays pending while the queue is full
+    int position = encoder1Position;
+    if (position != lastEncoder1Position) {
+        InputEvent event = {EVENT_ENCODER, 1, (int16_t)(position - lastEncoder1Position), (uint32_t)millis(), 0};
+        if (inputEvents.push(event)) lastEncoder1Position = position;
+    }
+    
+    position = encoder2Position;
+    if (position != lastEncoder2Position) {
+        InputEvent event = {EVENT_ENCODER, 2, (int16_t)(position - lastEncoder2Position), (uint32_t)millis(), 0};
+        if (inputEvents.push(event)) lastEncoder2Position = position;
+    }
+}
+
 void sendButtonEvent(int buttonIndex, bool pressed) {
+    if (binaryProtocol) {
+        uint8_t payload[2] = {(uint8_t)buttonIndex, (uint8_t)(pressed ? 1 : 0)};
+        sendFrame(OP_BUTTON, payload, sizeof(payload));
+        return;
+    }
+    
     jsonDoc.clear();
     jsonDoc["type"] = "button";
     jsonDoc["button"] = buttonIndex;
@@ -372,7 +1021,7 @@ void sendButtonEvent(int buttonIndex, bool pressed) {
     serializeJson(jsonDoc, Serial1);
     Serial1.println();
     
-    Serial.printf("Button %d %s\n", buttonIndex, pressed ? "pressed" : "released");
+    LOG_D("Button %d %s", buttonIndex, pressed ? "pressed" : "released");
 }
 
 // ==================== ENCODER INTERRUPTS ====================
@@ -404,6 +1053,12 @@ void IRAM_ATTR encoder2ISR() {
 }
 
 void sendEncoderEvent(int encoderIndex, int delta) {
+    if (binaryProtocol) {
+        uint8_t payload[2] = {(uint8_t)encoderIndex, (uint8_t)(int8_t)constrain(delta, -128, 127)};
+        sendFrame(OP_ENCODER, payload, sizeof(payload));
+        return;
+    }
+    
     jsonDoc.clear();
     jsonDoc["type"] = "encoder";
     jsonDoc["encoder"] = encoderIndex;
@@ -412,33 +1067,330 @@ void sendEncoderEvent(int encoderIndex, int delta) {
     serializeJson(jsonDoc, Serial1);
     Serial1.println();
     
-    Serial.printf("Encoder %d: %+d\n", encoderIndex, delta);
+    LOG_D("Encoder %d: %+d", encoderIndex, delta);
+}
+
+// ==================== CONFIG STORE ====================
+
+void defaultConfig(SensorConfig& config) {
+    // Build settings, used when NVS holds nothing (or another layout)
+    memset(&config, 0, sizeof(config));
+    config.version = CONFIG_VERSION;
+    config.brightness = LED_BRIGHTNESS;
+    config.fps = LED_FPS;
+    config.debounce = SENSOR_DEBOUNCE;
+    config.reportDeltas = true;
+    config.reportSnapshots = true;
+    config.theme = 0;
+    config.themeColors = LED_THEMES[0].colors;
+    memcpy(config.evalPalette, DEFAULT_EVAL_PALETTE, sizeof(config.evalPalette));
+    config.sensorBase = 0;
+}
+
+void captureConfig(SensorConfig& config) {
+    // The running settings, as set_config would store them
+    memset(&config, 0, sizeof(config));
+    config.version = CONFIG_VERSION;
+    config.brightness = ledBrightness;
+    config.fps = ledFps;
+    config.debounce = debounceSetting;
+    config.reportDeltas = reportDeltas;
+    config.reportSnapshots = reportSnapshots;
+    config.theme = themeIndex;
+    config.themeColors = currentTheme;
+    memcpy(config.evalPalette, evalPalette, sizeof(config.evalPalette));
+    config.sensorBase = sensorBase;
+}
+
+void applyConfig(const SensorConfig& config) {
+    ledBrightness = config.brightness;
+    setLEDFps(config.fps);
+    setDebounceSamples(config.debounce);
+    reportDeltas = config.reportDeltas;
+    reportSnapshots = config.reportSnapshots;
+    themeIndex = config.theme < LED_THEME_COUNT ? config.theme : THEME_CUSTOM;
+    currentTheme = config.themeColors;
+    memcpy(evalPalette, config.evalPalette, sizeof(evalPalette));
+    evalPalette[0] = 0;  // Class 0 is always "no overlay"
+    setSensorBase(config.sensorBase);
+    redrawEvaluation();
+    showLEDs();
+}
+
+void setSensorBase(int base) {
+    // Whole 64-sensor words only, so merging on the Pi is a shift and an OR
+    sensorBase = constrain(base, 0, SENSOR_BASE_MAX) & ~63;
+}
+
+void loadConfig() {
+    /**
+     * Boot: the stored configuration over the build defaults. A blob of
+     * another size or version (written by other firmware) is ignored as
+     * a whole rather than half applied.
+     */
+    configStore.begin(CONFIG_NAMESPACE, false);
+    
+    SensorConfig config;
+    defaultConfig(config);
+    
+    SensorConfig stored;
+    if (configStore.getBytesLength("config") == sizeof(stored) &&
+        configStore.getBytes("config", &stored, sizeof(stored)) == sizeof(stored) &&
+        stored.version == CONFIG_VERSION) {
+        config = stored;
+        configStored = true;
+        LOG_I("Configuration loaded from NVS");
+    } else {
+        LOG_I("No stored configuration, using build defaults");
+    }
+    applyConfig(config);
+}
+
+void saveConfig() {
+    SensorConfig config;
+    captureConfig(config);
+    configStored = configStore.putBytes("config", &config, sizeof(config)) == sizeof(config);
+    if (!configStored) {
+        LOG_E("Saving the configuration failed");
+    }
+}
+
+bool applyTheme(const char* name, JsonObject colors) {
+    /**
+     * Switch to a named theme (case-insensitive), then apply any
+     * "colors" overrides: {"background": [r, g, b], "white_piece",
+     * "black_piece", "highlight", "legal_move"}. Overrides make it a
+     * custom theme. Returns false for an unknown name.
+     */
+    uint8_t index = THEME_CUSTOM;
+    for (uint8_t i = 0; i < LED_THEME_COUNT; i++) {
+        if (strcasecmp(name, LED_THEMES[i].name) == 0) {
+            index = i;
+        }
+    }
+    if (index == THEME_CUSTOM && strcasecmp(name, "custom") != 0) {
+        return false;
+    }
+    
+    LEDTheme theme = index == THEME_CUSTOM ? currentTheme : LED_THEMES[index].colors;
+    
+    struct { const char* key; uint32_t* color; } fields[] = {
+        {"background", &theme.backgroundColor},
+        {"white_piece", &theme.whitePieceColor},
+        {"black_piece", &theme.blackPieceColor},
+        {"highlight", &theme.highlightColor},
+        {"legal_move", &theme.legalMoveColor}
+    };
+    for (auto& field : fields) {
+        JsonArray rgb = colors[field.key];
+        if (!rgb.isNull()) {
+            *field.color = ledColor(rgb[0], rgb[1], rgb[2]);
+            index = THEME_CUSTOM;
+        }
+    }
+    
+    themeIndex = index;
+    currentTheme = theme;
+    ledsChanged = true;
+    return true;
+}
+
+void handleConfigCommand(JsonObject& cmd) {
+    /**
+     * get_config / set_config / reset_config. set_config takes any of
+     * the get_config fields, puts them into effect and (unless "save" is
+     * false) stores the whole configuration for later boots.
+     */
+    const char* cmdType = cmd["cmd"];
+    
+    if (strcmp(cmdType, "set_config") == 0) {
+        if (cmd.containsKey("theme") || cmd.containsKey("theme_colors")) {
+            const char* theme = cmd["theme"] | (themeIndex < LED_THEME_COUNT ?
+                                                LED_THEMES[themeIndex].name : "custom");
+            if (!applyTheme(theme, cmd["theme_colors"])) {
+                failCommand("Unknown theme");
+                return;
+            }
+        }
+        
+        if (cmd.containsKey("brightness")) {
+            ledBrightness = constrain((int)cmd["brightness"], 0, 255);
+            showLEDs();
+        }
+        if (cmd.containsKey("fps")) {
+            setLEDFps(cmd["fps"]);
+        }
+        if (cmd.containsKey("debounce")) {
+            setDebounceSamples(cmd["debounce"]);
+        }
+        reportDeltas = cmd["report_deltas"] | reportDeltas;
+        reportSnapshots = cmd["report_snapshots"] | reportSnapshots;
+        
+        if (cmd.containsKey("eval_palette")) {
+            setEvaluationPalette(cmd["eval_palette"]);
+        }
+        if (cmd.containsKey("sensor_base")) {
+            setSensorBase(cmd["sensor_base"]);
+        }
+        
+        if (cmd["save"] | true) {
+            saveConfig();
+        }
+    }
+    else if (strcmp(cmdType, "reset_config") == 0) {
+        // Back to the build defaults, and nothing stored
+        SensorConfig config;
+        defaultConfig(config);
+        applyConfig(config);
+        configStore.remove("config");
+        configStored = false;
+    }
+    
+    sendConfig();
+}
+
+void sendConfig() {
+    // Reply to the config commands; always JSON, like get_stats
+    SensorConfig config;
+    captureConfig(config);
+    
+    jsonDoc.clear();
+    jsonDoc["type"] = "config";
+    jsonDoc["controller"] = "sensor";
+    jsonDoc["version"] = CONFIG_VERSION;
+    jsonDoc["stored"] = configStored;
+    jsonDoc["brightness"] = config.brightness;
+    jsonDoc["fps"] = config.fps;
+    jsonDoc["debounce"] = config.debounce;
+    jsonDoc["report_deltas"] = config.reportDeltas;
+    jsonDoc["report_snapshots"] = config.reportSnapshots;
+    jsonDoc["theme"] = config.theme < LED_THEME_COUNT ? LED_THEMES[config.theme].name : "custom";
+    jsonDoc["sensor_base"] = config.sensorBase;
+    jsonDoc["sensor_count"] = SENSOR_COUNT;
+    
+    const LEDTheme& theme = config.themeColors;
+    struct { const char* key; uint32_t color; } fields[] = {
+        {"background", theme.backgroundColor},
+        {"white_piece", theme.whitePieceColor},
+        {"black_piece", theme.blackPieceColor},
+        {"highlight", theme.highlightColor},
+        {"legal_move", theme.legalMoveColor}
+    };
+    JsonObject themeColors = jsonDoc.createNestedObject("theme_colors");
+    for (auto& field : fields) {
+        JsonArray rgb = themeColors.createNestedArray(field.key);
+        rgb.add((field.color >> 16) & 0xFF);
+        rgb.add((field.color >> 8) & 0xFF);
+        rgb.add(field.color & 0xFF);
+    }
+    
+    // Classes 1 and up, as set_evaluation_palette takes them
+    JsonArray palette = jsonDoc.createNestedArray("eval_palette");
+    for (int i = 1; i < EVAL_PALETTE_SIZE; i++) {
+        JsonArray rgb = palette.createNestedArray();
+        rgb.add((config.evalPalette[i] >> 16) & 0xFF);
+        rgb.add((config.evalPalette[i] >> 8) & 0xFF);
+        rgb.add(config.evalPalette[i] & 0xFF);
+    }
+    
+    serializeJson(jsonDoc, Serial1);
+    Serial1.println();
 }
 
 // ==================== UART COMMAND PROCESSING ====================
 
+void feedLineByte(char c) {
+    /**
+     * Append one byte to the JSON line buffer and run the command on '\n'.
+     * A line longer than LINE_BUFFER_SIZE is dropped as a whole and
+     * reported once, instead of growing without bound.
+     */
+    if (c == '\n') {
+        if (lineOverflow) {
+            lineOverflow = false;
+        } else if (lineLength > 0) {
+            uint32_t start = ESP.getCycleCount();
+            processUARTCommand();
+            endCommand();
+            recordPerf(perfStats[PERF_COMMAND], ESP.getCycleCount() - start);
+        }
+        lineLength = 0;
+        return;
+    }
+    
+    if (c == '\r' || lineOverflow) {
+        return;
+    }
+    
+    if (lineLength >= LINE_BUFFER_SIZE - 1) {
+        LOG_W("UART line overflow, dropping command");
+        linkCounters.lineOverflows++;
+        sendStatus("error", "Command too long");
+        lineOverflow = true;
+        lineLength = 0;
+        return;
+    }
+    
+    lineBuffer[lineLength++] = c;
+}
+
+void beginCommand(uint16_t seq) {
+    /**
+     * Start running a received command. A tagged one (seq != 0) is acked
+     * straight away, then gets exactly one done from endCommand() or an
+     * error from failCommand(). Every sensor command finishes on the spot,
+     * so done follows the ack within the same loop() pass.
+     */
+    commandSeq = seq;
+    sendReply(OP_ACK, seq);
+}
+
+void endCommand() {
+    sendReply(OP_DONE, commandSeq);
+    commandSeq = 0;
+}
+
+void failCommand(const char* message) {
+    // Tagged commands fail with an error reply, untagged ones with the
+    // error status they always had; no done follows
+    if (commandSeq) {
+        sendReply(OP_ERROR, commandSeq, message);
+    } else {
+        sendStatus("error", message);
+    }
+    commandSeq = 0;
+}
+
 void processUARTCommand() {
-    // Parse JSON command
-    DeserializationError error = deserializeJson(jsonDoc, inputBuffer);
+    // Parse JSON command in place: a mutable char* lets ArduinoJson point
+    // its strings into lineBuffer instead of copying them
+    lineBuffer[lineLength] = '\0';
+    DeserializationError error = deserializeJson(jsonDoc, lineBuffer, lineLength);
     
     if (error) {
-        Serial.print("JSON parse error: ");
-        Serial.println(error.c_str());
+        LOG_W("JSON parse error: %s", error.c_str());
+        linkCounters.jsonErrors++;
+        reportLinkError();
         return;
     }
     
+    linkErrors = 0;
+    
     JsonObject cmd = jsonDoc.as<JsonObject>();
     const char* cmdType = cmd["cmd"];
     
     if (cmdType == nullptr) {
-        Serial.println("No 'cmd' field in JSON");
+        LOG_W("No 'cmd' field in JSON");
         return;
     }
     
+    // {"cmd":...,"seq":N} asks for ack/done/error replies tagged with N
+    beginCommand(cmd["seq"] | 0);
+    
     // Route command
     if (strcmp(cmdType, "scan_sensors") == 0) {
-        scanSensors();
-        sendSensorUpdate();
+        processInputEvents();
+        sendSensorSnapshot();
     }
     else if (strcmp(cmdType, "highlight_squares") == 0) {
         handleLEDCommand(cmd);
@@ -449,20 +1401,409 @@ void processUARTCommand() {
     else if (strcmp(cmdType, "flash_all") == 0) {
         handleLEDCommand(cmd);
     }
+    else if (strcmp(cmdType, "show_evaluation_colors") == 0) {
+        handleLEDCommand(cmd);
+    }
+    else if (strcmp(cmdType, "clear_evaluation") == 0) {
+        clearEvaluation();
+    }
+    else if (strcmp(cmdType, "set_frame") == 0) {
+        handleLEDCommand(cmd);
+    }
+    else if (strcmp(cmdType, "clear_frame") == 0) {
+        clearLayer(LAYER_FRAME);
+    }
+    else if (strcmp(cmdType, "set_evaluation_palette") == 0) {
+        handleLEDCommand(cmd);
+    }
     else if (strcmp(cmdType, "leds_off") == 0) {
-        strip.clear();
-        strip.show();
+        clearAllLayers();
     }
     else if (strcmp(cmdType, "set_brightness") == 0) {
         if (cmd.containsKey("brightness")) {
             int brightness = cmd["brightness"];
-            strip.setBrightness(constrain(brightness, 0, 255));
-            strip.show();
+            ledBrightness = constrain(brightness, 0, 255);
+            showLEDs();
         }
     }
+    else if (strcmp(cmdType, "set_led_fps") == 0) {
+        setLEDFps(cmd["fps"] | LED_FPS);
+    }
+    else if (strcmp(cmdType, "set_sensor_reporting") == 0) {
+        reportDeltas = cmd["deltas"] | reportDeltas;
+        reportSnapshots = cmd["snapshots"] | reportSnapshots;
+        if (cmd.containsKey("debounce")) {
+            setDebounceSamples(cmd["debounce"]);
+        }
+    }
+    else if (strcmp(cmdType, "set_protocol") == 0) {
+        // Acknowledged in the old format, then outgoing messages switch
+        const char* mode = cmd["mode"] | "json";
+        bool binary = strcmp(mode, "binary") == 0;
+        sendStatus("protocol", binary ? "binary" : "json");
+        binaryProtocol = binary;
+    }
+    else if (strcmp(cmdType, "set_baud") == 0) {
+        requestBaudRate(cmd["baud"] | (uint32_t)UART_BAUD);
+    }
+    else if (strcmp(cmdType, "get_stats") == 0) {
+        // {"cmd":"get_stats","reset":true} clears the counters after reading
+        sendStats(cmd["reset"] | false);
+    }
+    else if (strcmp(cmdType, "reset_stats") == 0) {
+        resetStats();
+    }
+    else if (strcmp(cmdType, "get_config") == 0 || strcmp(cmdType, "set_config") == 0 ||
+             strcmp(cmdType, "reset_config") == 0) {
+        handleConfigCommand(cmd);
+    }
     else {
-        Serial.print("Unknown command: ");
-        Serial.println(cmdType);
+        LOG_W("Unknown command: %s", cmdType);
+        failCommand("Unknown command");
+    }
+}
+
+// ==================== BINARY PROTOCOL ====================
+
+uint16_t readUint16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+bool feedFrameByte(uint8_t c) {
+    /**
+     * Feed one received byte to the binary frame parser.
+     *
+     * Returns true if the byte belongs to a binary frame (start, body or
+     * CRC), false if it should go to the JSON line buffer instead. Frames
+     * with a bad CRC are dropped and reported as an error status.
+     */
+    FrameParser& f = frameParser;
+    
+    switch (f.feed(c, millis())) {
+        case FRAME_TEXT:
+            return false;
+        
+        case FRAME_READY: {
+            linkErrors = 0;
+            uint32_t start = ESP.getCycleCount();
+            if (f.data[0] == OP_SEQ && f.length >= 4) {
+                // Tagged: [OP_SEQ][seq lo][seq hi][opcode][payload...]
+                beginCommand(readUint16(f.data + 1));
+                processBinaryFrame(f.data[3], f.data + 4, f.length - 4);
+            } else {
+                processBinaryFrame(f.data[0], f.data + 1, f.length - 1);
+            }
+            endCommand();
+            recordPerf(perfStats[PERF_COMMAND], ESP.getCycleCount() - start);
+            return true;
+        }
+        
+        case FRAME_BAD_CRC:
+            LOG_W("Binary frame CRC error");
+            linkCounters.crcErrors++;
+            sendStatus("error", "CRC error");
+            reportLinkError();
+            return true;
+        
+        default:
+            return true;
+    }
+}
+
+void sendFrame(uint8_t opcode, const uint8_t* payload, uint8_t len) {
+    uint8_t frame[FRAME_MAX_LEN + 4];
+    len = min(len, (uint8_t)(FRAME_MAX_LEN - 1));
+    
+    frame[0] = FRAME_SYNC;
+    frame[1] = len + 1;
+    frame[2] = opcode;
+    memcpy(frame + 3, payload, len);
+    
+    uint16_t crc = 0xFFFF;
+    for (int i = 1; i < len + 3; i++) {
+        crc = crc16Update(crc, frame[i]);
+    }
+    frame[len + 3] = crc & 0xFF;
+    frame[len + 4] = crc >> 8;
+    
+    Serial1.write(frame, len + 5);
+}
+
+void processBinaryFrame(uint8_t opcode, const uint8_t* payload, uint8_t len) {
+    // Same actions as processUARTCommand(), fixed-layout payloads
+    switch (opcode) {
+        case OP_SET_PROTOCOL:
+            if (len >= 1) {
+                bool binary = payload[0] != 0;
+                sendStatus("protocol", binary ? "binary" : "json");
+                binaryProtocol = binary;
+            }
+            break;
+        
+        case OP_SET_BAUD:
+            if (len >= 4) {
+                requestBaudRate((uint32_t)payload[0] | ((uint32_t)payload[1] << 8) |
+                                ((uint32_t)payload[2] << 16) | ((uint32_t)payload[3] << 24));
+            }
+            break;
+        
+        case OP_BAUD_TEST:
+            handleBaudTest(payload, len);
+            break;
+        
+        case OP_SCAN_SENSORS:
+            processInputEvents();
+            sendSensorSnapshot();
+            break;
+        
+        case OP_HIGHLIGHT:
+            if (len >= 5) {
+                uint32_t color = ledColor(payload[0], payload[1], payload[2]);
+                LEDLayer& layer = beginLayer(LAYER_HIGHLIGHT, EFFECT_SOLID, readUint16(payload + 3));
+                layer.blend = BLEND_MAX;
+                for (int i = 5; i < len; i++) {
+                    setLEDSquare(layer, payload[i] % BOARD_SIZE, payload[i] / BOARD_SIZE, color);
+                }
+            }
+            break;
+        
+        case OP_FLASH_ALL:
+            if (len >= 4) {
+                flashAll(ledColor(payload[0], payload[1], payload[2]), payload[3]);
+            }
+            break;
+        
+        case OP_SHOW_EVALUATION:
+            if (len >= BOARD_SIZE * BOARD_SIZE / 2) {
+                uint8_t classes[BOARD_SIZE * BOARD_SIZE];
+                for (int i = 0; i < BOARD_SIZE * BOARD_SIZE; i++) {
+                    classes[i] = (payload[i / 2] >> ((i % 2) * 4)) & 0x0F;
+                }
+                showEvaluation(classes);
+            }
+            break;
+        
+        case OP_CLEAR_EVALUATION:
+            clearEvaluation();
+            break;
+        
+        case OP_SET_FRAME:
+            if (len >= 3) {
+                bool squares = payload[0] & 0x01;
+                uint32_t palette[EVAL_PALETTE_SIZE];
+                uint8_t paletteSize = 0;
+                size_t offset = 3;
+                
+                if (squares) {
+                    // u8 N, then the colors of indexes 1..N (extra entries are skipped)
+                    uint8_t count = len > 3 ? payload[3] : 0;
+                    offset = 4 + count * 3;
+                    paletteSize = min(count + 1, EVAL_PALETTE_SIZE);
+                }
+                if (offset > len) {
+                    failCommand("Bad frame");
+                    break;
+                }
+                for (uint8_t i = 1; i < paletteSize; i++) {
+                    const uint8_t* rgb = payload + 4 + (i - 1) * 3;
+                    palette[i] = ledColor(rgb[0], rgb[1], rgb[2]);
+                }
+                
+                if (!showFrame(squares, payload + offset, len - offset, payload[0] & 0x02,
+                               palette, paletteSize, readUint16(payload + 1))) {
+                    failCommand("Bad frame");
+                }
+            }
+            break;
+        
+        case OP_CLEAR_FRAME:
+            clearLayer(LAYER_FRAME);
+            break;
+        
+        case OP_LEDS_OFF:
+            clearAllLayers();
+            break;
+        
+        case OP_SET_BRIGHTNESS:
+            if (len >= 1) {
+                ledBrightness = payload[0];
+                showLEDs();
+            }
+            break;
+        
+        case OP_SET_LED_FPS:
+            if (len >= 1) {
+                setLEDFps(payload[0]);
+            }
+            break;
+        
+        case OP_SET_REPORTING:
+            if (len >= 1) {
+                reportDeltas = payload[0] & 0x01;
+                reportSnapshots = payload[0] & 0x02;
+            }
+            if (len >= 2) {
+                setDebounceSamples(payload[1]);
+            }
+            break;
+        
+        default:
+            LOG_W("Unknown opcode: 0x%02X", opcode);
+            failCommand("Unknown command");
+            break;
+    }
+}
+
+void sendStatus(const char* status, const char* message) {
+    if (binaryProtocol) {
+        uint8_t payload[FRAME_MAX_LEN - 1];
+        size_t statusLen = min(strlen(status), sizeof(payload) - 1);
+        memcpy(payload, status, statusLen);
+        payload[statusLen] = '\0';
+        
+        size_t len = statusLen + 1;
+        if (message) {
+            size_t messageLen = min(strlen(message), sizeof(payload) - len);
+            memcpy(payload + len, message, messageLen);
+            len += messageLen;
+        }
+        
+        sendFrame(OP_STATUS, payload, len);
+        return;
+    }
+    
+    jsonDoc.clear();
+    jsonDoc["type"] = "status";
+    jsonDoc["status"] = status;
+    jsonDoc["controller"] = "sensor";
+    
+    if (message) {
+        jsonDoc["message"] = message;
+    }
+    
+    serializeJson(jsonDoc, Serial1);
+    Serial1.println();
+}
+
+void sendReply(uint8_t opcode, uint16_t seq, const char* message) {
+    /**
+     * Ack/done/error for a tagged command (OP_ACK, OP_DONE or OP_ERROR).
+     * Untagged commands (seq 0) get no replies. Uses its own small
+     * document, so it is safe while jsonDoc still holds the command.
+     */
+    if (seq == 0) {
+        return;
+    }
+    
+    if (binaryProtocol) {
+        uint8_t payload[FRAME_MAX_LEN - 1];
+        payload[0] = seq & 0xFF;
+        payload[1] = seq >> 8;
+        
+        size_t len = 2;
+        if (message) {
+            size_t messageLen = min(strlen(message), sizeof(payload) - len);
+            memcpy(payload + len, message, messageLen);
+            len += messageLen;
+        }
+        
+        sendFrame(opcode, payload, len);
+        return;
+    }
+    
+    static const char* const REPLY_TYPES[] = {"ack", "done", "error"};
+    StaticJsonDocument<192> reply;
+    reply["type"] = REPLY_TYPES[opcode - OP_ACK];
+    reply["seq"] = seq;
+    
+    if (message) {
+        reply["message"] = message;
+    }
+    
+    serializeJson(reply, Serial1);
+    Serial1.println();
+}
+
+// ==================== LINK SPEED ====================
+
+void applyBaudRate(uint32_t baud) {
+    Serial1.flush();                // Let pending replies leave at the old rate
+    Serial1.updateBaudRate(baud);
+    linkBaud = baud;
+    
+    // Anything half-received was garbled by the switch
+    frameParser.state = 0;
+    lineLength = 0;
+    lineOverflow = false;
+}
+
+void requestBaudRate(uint32_t baud) {
+    /**
+     * Switch the Pi link to a faster rate, tentatively.
+     *
+     * The acknowledgement goes out at the current rate, then both ends
+     * switch. The Pi sends CRC-checked OP_BAUD_TEST bursts that are echoed
+     * back, and an empty OP_BAUD_TEST to confirm. Without that confirmation
+     * within BAUD_CONFIRM_MS the previous rate is restored.
+     */
+    if (baud < UART_BAUD || baud > MAX_UART_BAUD) {
+        failCommand("Unsupported baud rate");
+        return;
+    }
+    
+    char message[12];
+    snprintf(message, sizeof(message), "%lu", (unsigned long)baud);
+    sendStatus("baud", message);
+    
+    if (!baudPending) {
+        fallbackBaud = linkBaud;
+    }
+    applyBaudRate(baud);
+    baudPending = true;
+    baudSwitchTime = millis();
+    LOG_I("UART: trying %lu baud", (unsigned long)baud);
+}
+
+void handleBaudTest(const uint8_t* payload, uint8_t len) {
+    if (len > 0) {
+        // Test burst: echo it so the Pi can check the return direction too
+        sendFrame(OP_BAUD_TEST, payload, len);
+        baudSwitchTime = millis();
+        return;
+    }
+    
+    if (baudPending) {
+        baudPending = false;
+        linkErrors = 0;
+        LOG_I("UART: %lu baud confirmed", (unsigned long)linkBaud);
+    }
+    sendStatus("baud", "confirmed");
+}
+
+void serviceLinkSpeed() {
+    if (baudPending && millis() - baudSwitchTime > BAUD_CONFIRM_MS) {
+        baudPending = false;
+        applyBaudRate(fallbackBaud);
+        LOG_W("UART: not confirmed, back to %lu baud", (unsigned long)fallbackBaud);
+    }
+}
+
+void reportLinkError() {
+    /**
+     * Called for every corrupted frame or unparseable line. A single error
+     * during negotiation, or BAUD_ERROR_LIMIT in a row afterwards, drops
+     * the link back to UART_BAUD, where the Pi can negotiate again.
+     */
+    if (linkBaud == UART_BAUD) {
+        return;
+    }
+    
+    if (baudPending || ++linkErrors >= BAUD_ERROR_LIMIT) {
+        baudPending = false;
+        linkErrors = 0;
+        applyBaudRate(UART_BAUD);
+        LOG_W("UART: too many errors, back to default baud rate");
+        sendStatus("baud", "fallback");
     }
 }
 
@@ -475,108 +1816,603 @@ void handleLEDCommand(JsonObject& cmd) {
         JsonArray squares = cmd["squares"];
         JsonArray colorArray = cmd["color"];
         
-        if (squares.isNull() || colorArray.isNull()) return;
+        if (squares.isNull()) return;
         
-        uint32_t color = strip.Color(colorArray[0], colorArray[1], colorArray[2]);
-        int duration = cmd["duration"] | 2000; // Default 2 seconds
+        // No color: the theme's highlight color
+        uint32_t color = colorArray.isNull() ? currentTheme.highlightColor
+                                             : ledColor(colorArray[0], colorArray[1], colorArray[2]);
+        unsigned long duration = cmd["duration"] | HIGHLIGHT_MS;    // 0 = until cleared
+        LEDEffect effect = parseEffect(cmd["effect"] | "solid");
+        uint16_t period = cmd["period"] | FLASH_PERIOD_MS;
         
-        // Highlight specified squares
+        // Highlight specified squares; replaces the previous highlight
+        LEDLayer& layer = beginLayer(LAYER_HIGHLIGHT, effect, duration, period);
+        layer.blend = parseBlend(cmd["blend"] | "max");
         for (JsonVariant square : squares) {
             JsonArray pos = square.as<JsonArray>();
             int file = pos[0];
             int rank = pos[1];
-            setLEDSquare(file, rank, color);
+            setLEDSquare(layer, file, rank, color);
+        }
+    }
+    else if (strcmp(cmdType, "set_theme") == 0) {
+        // Not stored; set_config with "theme" keeps it across reboots
+        if (!applyTheme(cmd["theme"] | "classic", cmd["colors"])) {
+            failCommand("Unknown theme");
         }
-        strip.show();
-        
-        // TODO: Auto-clear after duration (needs timer)
     }
     else if (strcmp(cmdType, "flash_all") == 0) {
         JsonArray colorArray = cmd["color"];
         int count = cmd["count"] | 3;
         
-        uint32_t color = strip.Color(colorArray[0], colorArray[1], colorArray[2]);
+        uint32_t color = ledColor(colorArray[0], colorArray[1], colorArray[2]);
+        flashAll(color, count);
+    }
+    else if (strcmp(cmdType, "show_evaluation_colors") == 0) {
+        // "classes": 64 hex digits, one palette class per square
+        const char* table = cmd["classes"];
+        if (table == nullptr || strlen(table) < BOARD_SIZE * BOARD_SIZE) return;
+        
+        uint8_t classes[BOARD_SIZE * BOARD_SIZE];
+        for (int i = 0; i < BOARD_SIZE * BOARD_SIZE; i++) {
+            char c = table[i];
+            classes[i] = isdigit(c) ? c - '0' : isxdigit(c) ? (tolower(c) - 'a' + 10) : 0;
+        }
+        showEvaluation(classes, parseBlend(cmd["blend"] | "priority"));
+    }
+    else if (strcmp(cmdType, "set_evaluation_palette") == 0) {
+        setEvaluationPalette(cmd["colors"]);
+    }
+    else if (strcmp(cmdType, "set_frame") == 0) {
+        // "data": the frame as base64, "format": "leds" or "squares"
+        const char* text = cmd["data"] | "";
+        uint8_t data[LED_COUNT * 4];    // Worst case RLE: one run per LED
+        int len = decodeBase64(text, strlen(text), data, sizeof(data));
+        bool squares = strcmp(cmd["format"] | "leds", "squares") == 0;
+        
+        // "palette": [[r, g, b], ...] for indexes 1, 2, ...; default the evaluation palette
+        uint32_t palette[EVAL_PALETTE_SIZE];
+        uint8_t paletteSize = EVAL_PALETTE_SIZE;
+        memcpy(palette, evalPalette, sizeof(palette));
+        JsonArray colors = cmd["palette"];
+        if (!colors.isNull()) {
+            paletteSize = 1;
+            for (JsonArray rgb : colors) {
+                if (paletteSize >= EVAL_PALETTE_SIZE) break;
+                palette[paletteSize++] = ledColor(rgb[0], rgb[1], rgb[2]);
+            }
+        }
+        
+        if (len < 0 || !showFrame(squares, data, len, cmd["rle"] | false, palette, paletteSize,
+                                  cmd["duration"] | 0UL, parseBlend(cmd["blend"] | "max"))) {
+            failCommand("Bad frame");
+        }
+    }
+}
+
+void flashAll(uint32_t color, int count) {
+    // Runs as an effect layer; clears itself after count cycles
+    LEDLayer& layer = beginLayer(LAYER_EFFECT, EFFECT_FLASH, (unsigned long)count * FLASH_PERIOD_MS,
+                                 FLASH_PERIOD_MS);
+    for (int i = 0; i < LED_COUNT; i++) {
+        layer.covered[i] = true;
+        layer.color[i] = color;
+    }
+}
+
+// ==================== EVALUATION OVERLAY ====================
+
+void showEvaluation(const uint8_t* classes, LEDBlend blend) {
+    /**
+     * Update the live evaluation overlay from a full class table.
+     *
+     * The backend resends the table several times a second while a piece
+     * is held, so only squares whose class changed are redrawn, and
+     * nothing is redrawn if the table is unchanged. The overlay stays
+     * until clear_evaluation or leds_off.
+     */
+    LEDLayer& layer = ledLayers[LAYER_EVALUATION];
+    if (!layer.active) {
+        beginLayer(LAYER_EVALUATION, EFFECT_SOLID, 0);
+        memset(evalClasses, 0, sizeof(evalClasses));
+    }
+    if (blend != layer.blend) {
+        // Mode changed: every shared corner needs recomputing
+        layer.blend = blend;
+        memset(evalClasses, 0, sizeof(evalClasses));
+        memset(layer.covered, 0, sizeof(layer.covered));
+    }
+    
+    bool changed = false;
+    for (int square = 0; square < BOARD_SIZE * BOARD_SIZE; square++) {
+        uint8_t evalClass = classes[square] < EVAL_PALETTE_SIZE ? classes[square] : 0;
+        if (evalClass == evalClasses[square]) continue;
+        
+        evalClasses[square] = evalClass;
+        changed = true;
         
-        for (int i = 0; i < count; i++) {
-            for (int j = 0; j < LED_COUNT; j++) {
-                strip.setPixelColor(j, color);
+        // Redraw the square's four corner LEDs
+        int file = square % BOARD_SIZE;
+        int rank = square / BOARD_SIZE;
+        redrawEvaluationLED(file, rank);
+        redrawEvaluationLED(file + 1, rank);
+        redrawEvaluationLED(file, rank + 1);
+        redrawEvaluationLED(file + 1, rank + 1);
+    }
+    
+    if (changed) {
+        ledsChanged = true;
+    }
+}
+
+void setEvaluationPalette(JsonArray colors) {
+    // [[r, g, b], ...] for classes 1, 2, ...
+    int index = 1;
+    for (JsonArray rgb : colors) {
+        if (index >= EVAL_PALETTE_SIZE) break;
+        evalPalette[index++] = ledColor(rgb[0], rgb[1], rgb[2]);
+    }
+    redrawEvaluation();
+}
+
+void redrawEvaluation() {
+    // Palette changed: recolor every corner the overlay covers
+    for (int y = 0; y < LED_GRID_SIZE; y++) {
+        for (int x = 0; x < LED_GRID_SIZE; x++) {
+            redrawEvaluationLED(x, y);
+        }
+    }
+    ledsChanged = true;
+}
+
+void clearEvaluation() {
+    clearLayer(LAYER_EVALUATION);
+    memset(evalClasses, 0, sizeof(evalClasses));
+}
+
+void redrawEvaluationLED(int x, int y) {
+    // Recompute one corner LED from the up to four squares sharing it,
+    // blended with the layer's mode. By default the better class wins.
+    LEDLayer& layer = ledLayers[LAYER_EVALUATION];
+    uint8_t led = ledGridIndex(x, y);
+    layer.covered[led] = false;
+    
+    for (int rank = y - 1; rank <= y; rank++) {
+        for (int file = x - 1; file <= x; file++) {
+            if (rank < 0 || rank >= BOARD_SIZE || file < 0 || file >= BOARD_SIZE) continue;
+            
+            uint8_t evalClass = evalClasses[rank * BOARD_SIZE + file];
+            if (evalClass != 0) {
+                blendLED(layer, led, evalPalette[evalClass], EVAL_PALETTE_SIZE - evalClass);
             }
-            strip.show();
-            delay(200);
+        }
+    }
+}
+
+// ==================== FRAME UPLOAD ====================
+
+bool showFrame(bool squares, const uint8_t* data, size_t len, bool rle, const uint32_t* palette,
+               uint8_t paletteSize, unsigned long duration, LEDBlend blend) {
+    /**
+     * Replace LAYER_FRAME with a whole host-rendered board at once.
+     *
+     * 'data' is either LED_COUNT x (r, g, b) in grid order (y * 9 + x,
+     * as in squareCorners()) or 64 palette indexes (rank * 8 + file,
+     * 0 = not drawn), optionally run-length packed (see expandRuns()).
+     * Shared corners of a squares frame follow 'blend'; with priority,
+     * lower indexes win. Nothing changes unless the whole frame decodes,
+     * and the next serviceLEDs() pass shows it in one refresh, however
+     * much of the board changed. Returns false for a malformed frame.
+     */
+    uint8_t expanded[LED_COUNT * 3];
+    size_t expected = squares ? BOARD_SIZE * BOARD_SIZE : sizeof(expanded);
+    const uint8_t* pixels = data;
+    
+    if (rle) {
+        if (expandRuns(data, len, squares ? 1 : 3, expanded, expected) != (int)expected) return false;
+        pixels = expanded;
+    } else if (len != expected) {
+        return false;
+    }
+    
+    LEDLayer& layer = beginLayer(LAYER_FRAME, EFFECT_SOLID, duration);
+    layer.blend = blend;
+    
+    if (squares) {
+        for (int square = 0; square < BOARD_SIZE * BOARD_SIZE; square++) {
+            uint8_t index = pixels[square];
+            if (index == 0 || index >= paletteSize) continue;
+            setLEDSquare(layer, square % BOARD_SIZE, square / BOARD_SIZE, palette[index],
+                         EVAL_PALETTE_SIZE - index);
+        }
+    } else {
+        for (int y = 0; y < LED_GRID_SIZE; y++) {
+            for (int x = 0; x < LED_GRID_SIZE; x++) {
+                const uint8_t* rgb = pixels + (y * LED_GRID_SIZE + x) * 3;
+                uint8_t led = ledGridIndex(x, y);
+                layer.covered[led] = true;
+                layer.color[led] = ledColor(rgb[0], rgb[1], rgb[2]);
+            }
+        }
+    }
+    return true;
+}
+
+// ==================== LED ANIMATION ====================
+
+LEDLayer& beginLayer(uint8_t layer, LEDEffect effect, unsigned long duration, uint16_t period) {
+    // Reset a layer for new content, starting its effect clock now
+    LEDLayer& l = ledLayers[layer];
+    memset(l.covered, 0, sizeof(l.covered));
+    l.active = true;
+    l.effect = effect;
+    l.blend = BLEND_PRIORITY;
+    l.startTime = millis();
+    l.duration = duration;
+    l.period = max(period, (uint16_t)(2 * ledFrameInterval));
+    ledsChanged = true;
+    return l;
+}
+
+void clearLayer(uint8_t layer) {
+    ledLayers[layer].active = false;
+    ledsChanged = true;
+}
+
+void clearAllLayers() {
+    for (uint8_t i = 0; i < LED_LAYERS; i++) {
+        clearLayer(i);
+    }
+}
+
+LEDBlend parseBlend(const char* name) {
+    if (strcmp(name, "max") == 0) return BLEND_MAX;
+    if (strcmp(name, "average") == 0) return BLEND_AVERAGE;
+    return BLEND_PRIORITY;
+}
+
+void blendLED(LEDLayer& layer, uint8_t led, uint32_t color, uint8_t priority) {
+    // Combine a square's color into a corner LED it shares with others
+    if (!layer.covered[led]) {
+        layer.covered[led] = true;
+        layer.color[led] = color;
+        layer.weight[led] = (layer.blend == BLEND_AVERAGE) ? 1 : priority;
+        return;
+    }
+    
+    uint32_t old = layer.color[led];
+    switch (layer.blend) {
+        case BLEND_MAX:
+            layer.color[led] = max(old & 0xFF0000, color & 0xFF0000) |
+                               max(old & 0x00FF00, color & 0x00FF00) |
+                               max(old & 0x0000FF, color & 0x0000FF);
+            break;
+        
+        case BLEND_AVERAGE: {
+            // Running average over the squares drawn so far
+            uint32_t n = layer.weight[led]++;
+            uint32_t r = (((old >> 16) & 0xFF) * n + ((color >> 16) & 0xFF)) / (n + 1);
+            uint32_t g = (((old >> 8) & 0xFF) * n + ((color >> 8) & 0xFF)) / (n + 1);
+            uint32_t b = ((old & 0xFF) * n + (color & 0xFF)) / (n + 1);
+            layer.color[led] = ledColor(r, g, b);
+            break;
+        }
+        
+        default:
+            if (priority >= layer.weight[led]) {
+                layer.color[led] = color;
+                layer.weight[led] = priority;
+            }
+            break;
+    }
+}
+
+LEDEffect parseEffect(const char* name) {
+    if (strcmp(name, "flash") == 0) return EFFECT_FLASH;
+    if (strcmp(name, "pulse") == 0) return EFFECT_PULSE;
+    if (strcmp(name, "fade") == 0) return EFFECT_FADE;
+    return EFFECT_SOLID;
+}
+
+uint8_t layerIntensity(const LEDLayer& layer, unsigned long elapsed) {
+    // Effect brightness (0-255) at a point in the layer's lifetime
+    switch (layer.effect) {
+        case EFFECT_FLASH:
+            return (elapsed % layer.period) < layer.period / 2 ? 255 : 0;
+        
+        case EFFECT_PULSE: {
+            unsigned long phase = (elapsed % layer.period) * 510 / layer.period;
+            return phase < 256 ? phase : 510 - phase;
+        }
+        
+        case EFFECT_FADE:
+            if (layer.duration == 0) return 255;
+            return 255 - min(elapsed, layer.duration) * 255 / layer.duration;
+        
+        default:
+            return 255;
+    }
+}
+
+void serviceLEDs() {
+    /**
+     * Advance animations and composite the next frame.
+     *
+     * Called every loop(); does nothing until a frame interval has passed.
+     * Expires timed layers, and only redraws when a layer changed or an
+     * animated effect is running. Covered LEDs of an upper layer replace
+     * the ones beneath, uncovered LEDs show through.
+     */
+    unsigned long now = millis();
+    if (now - lastLEDFrame < ledFrameInterval) {
+        return;
+    }
+    lastLEDFrame = now;
+    
+    bool animating = false;
+    uint8_t intensity[LED_LAYERS];
+    
+    for (uint8_t i = 0; i < LED_LAYERS; i++) {
+        LEDLayer& layer = ledLayers[i];
+        if (!layer.active) continue;
+        
+        unsigned long elapsed = now - layer.startTime;
+        if (layer.duration > 0 && elapsed >= layer.duration) {
+            layer.active = false;
+            ledsChanged = true;
+            continue;
+        }
+        
+        intensity[i] = layerIntensity(layer, elapsed);
+        if (layer.effect != EFFECT_SOLID) animating = true;
+    }
+    
+    if (!ledsChanged && !animating) {
+        return;
+    }
+    ledsChanged = false;
+    
+    for (int led = 0; led < LED_COUNT; led++) {
+        uint32_t color = 0;
+        
+        for (uint8_t i = 0; i < LED_LAYERS; i++) {
+            const LEDLayer& layer = ledLayers[i];
+            if (!layer.active || !layer.covered[led]) continue;
             
-            strip.clear();
-            strip.show();
-            delay(200);
+            uint32_t c = layer.color[led];
+            uint8_t k = intensity[i];
+            color = ledColor(((c >> 16) & 0xFF) * k / 255,
+                                ((c >> 8) & 0xFF) * k / 255,
+                                (c & 0xFF) * k / 255);
         }
+        
+        ledFrame[led] = color;
     }
+    
+    showLEDs();
 }
 
-void setLEDSquare(int file, int rank, uint32_t color) {
+void setLEDSquare(LEDLayer& layer, int file, int rank, uint32_t color, uint8_t priority) {
     /**
-     * Light up a chess square on a 9x9 LED grid.
+     * Light up a chess square on a 9x9 LED grid, in one animation layer.
      * 
      * LED Grid Layout (9x9 = 81 LEDs):
-     * - Each chess square has 4 corner LEDs
-     * - Adjacent squares share corner LEDs
+     * - Each chess square has 4 corner LEDs (SQUARE_LEDS)
+     * - Adjacent squares share corner LEDs, combined with the layer's
+     *   blend mode
      * - Wiring pattern: serpentine (zigzag) by row
      * 
      * Example for square at (file=0, rank=0):
      *   LEDs at grid positions: (0,0), (1,0), (0,1), (1,1)
      */
+    if (file < 0 || file >= BOARD_SIZE || rank < 0 || rank >= BOARD_SIZE) return;
     
-    // Chess square (0-7) maps to LED grid corners
-    // Top-left LED of this square
-    int ledX = file;      // LED column (0-8)
-    int ledY = rank;      // LED row (0-8)
-    
-    // Calculate LED indices for 4 corners of this square
-    // Assuming serpentine (zigzag) wiring:
-    //   Row 0: left-to-right (0-8)
-    //   Row 1: right-to-left (17-9)
-    //   Row 2: left-to-right (18-26)
-    //   etc.
+    const SquareLEDs& corners = SQUARE_LEDS[rank * BOARD_SIZE + file];
+    for (int i = 0; i < 4; i++) {
+        blendLED(layer, corners.led[i], color, priority);
+    }
+}
+
+void updateLEDs() {
+    showLEDs();
+}
+
+// ==================== LED OUTPUT ====================
+
+uint32_t ledColor(uint8_t r, uint8_t g, uint8_t b) {
+    return ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
+}
+
+void showLEDs() {
+    // Only marks the frame; any number of calls per loop() cost one refresh
+    frameDirty = true;
+}
+
+void pushLEDFrame() {
+    /**
+     * Send ledFrame to the strip if it changed, at most once per frame
+     * interval.
+     *
+     * The frame is encoded into the idle RMT buffer, and the transfer
+     * starts without waiting. The RMT peripheral clocks out the ~2.4 ms of
+     * bits on its own, so encoder and UART interrupts keep running, unlike
+     * bit-banged output. Frames are at least 10 ms apart, which also gives
+     * the 50 us latch gap and ensures the other buffer has finished.
+     */
+    unsigned long now = millis();
+    if (!frameDirty || now - lastFramePush < ledFrameInterval) {
+        return;
+    }
     
-    int ledIndices[4];
+    uint32_t start = ESP.getCycleCount();
+    rmt_data_t* bits = rmtBuffers[rmtBufferIndex];
+    size_t n = 0;
     
-    // Top-left corner
-    if (ledY % 2 == 0) {
-        // Even row: left-to-right
-        ledIndices[0] = ledY * 9 + ledX;
-    } else {
-        // Odd row: right-to-left
-        ledIndices[0] = ledY * 9 + (8 - ledX);
+    for (int led = 0; led < LED_COUNT; led++) {
+        uint32_t c = ledFrame[led];
+        uint32_t r = (((c >> 16) & 0xFF) * (ledBrightness + 1)) >> 8;
+        uint32_t g = (((c >> 8) & 0xFF) * (ledBrightness + 1)) >> 8;
+        uint32_t b = ((c & 0xFF) * (ledBrightness + 1)) >> 8;
+        uint32_t grb = (g << 16) | (r << 8) | b;     // WS2812B wire order, MSB first
+        
+        for (int i = 23; i >= 0; i--) {
+            bool one = (grb >> i) & 1;
+            bits[n].level0 = 1;
+            bits[n].duration0 = one ? WS2812_T1H : WS2812_T0H;
+            bits[n].level1 = 0;
+            bits[n].duration1 = one ? WS2812_T1L : WS2812_T0L;
+            n++;
+        }
     }
     
-    // Top-right corner
-    if (ledY % 2 == 0) {
-        ledIndices[1] = ledY * 9 + (ledX + 1);
-    } else {
-        ledIndices[1] = ledY * 9 + (8 - ledX - 1);
+    rmtWrite(ledRmt, bits, n);
+    rmtBufferIndex ^= 1;
+    frameDirty = false;
+    lastFramePush = now;
+    
+    recordPerf(perfStats[PERF_LED_FRAME], ESP.getCycleCount() - start);
+}
+
+void setLEDFps(int fps) {
+    ledFps = constrain(fps, 1, 100);
+    ledFrameInterval = 1000 / ledFps;
+}
+
+// ==================== PERFORMANCE STATS ====================
+
+void recordPerf(PerfStat& stat, uint32_t cycles) {
+    /**
+     * Add one sample to a timing histogram. Bucket 0 counts samples under
+     * 1 us, bucket b the range [2^(b-1), 2^b) us and the last bucket
+     * everything longer.
+     */
+    uint32_t us = cycles / cyclesPerUs;
+    int bucket = us ? 32 - __builtin_clz(us) : 0;
+    if (bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
+    
+    stat.buckets[bucket]++;
+    stat.count++;
+    stat.totalCycles += cycles;
+    if (cycles > stat.maxCycles) stat.maxCycles = cycles;
+}
+
+void onUARTError(hardwareSerial_error_t error) {
+    // Called from the UART driver's event task
+    if (error == UART_BUFFER_FULL_ERROR || error == UART_FIFO_OVF_ERROR) {
+        linkCounters.rxOverflows++;
+    } else if (error == UART_FRAME_ERROR || error == UART_PARITY_ERROR) {
+        linkCounters.rxErrors++;
     }
+}
+
+void sendStats(bool reset) {
+    /**
+     * Reply to get_stats. Always a JSON line, whatever the protocol mode:
+     * the histograms don't fit in a frame, and the Pi's frame decoder
+     * passes text through. With reset the counters restart right after
+     * the copy, so periodic scrapes each cover one interval.
+     */
+    PerfStat snapshot[PERF_STATS];
     
-    // Bottom-left corner
-    int nextRow = ledY + 1;
-    if (nextRow % 2 == 0) {
-        ledIndices[2] = nextRow * 9 + ledX;
-    } else {
-        ledIndices[2] = nextRow * 9 + (8 - ledX);
+    portENTER_CRITICAL(&statsMux);
+    memcpy(snapshot, perfStats, sizeof(snapshot));
+    if (reset) memset(perfStats, 0, sizeof(perfStats));
+    portEXIT_CRITICAL(&statsMux);
+    
+    jsonDoc.clear();
+    jsonDoc["type"] = "stats";
+    jsonDoc["controller"] = "sensor";
+    jsonDoc["uptime_ms"] = millis();
+    jsonDoc["baud"] = linkBaud;
+    
+    JsonObject timings = jsonDoc.createNestedObject("timings");
+    for (int i = 0; i < PERF_STATS; i++) {
+        const PerfStat& stat = snapshot[i];
+        JsonObject entry = timings.createNestedObject(PERF_STAT_NAMES[i]);
+        entry["count"] = stat.count;
+        entry["avg_us"] = stat.count ? (float)stat.totalCycles / stat.count / cyclesPerUs : 0.0f;
+        entry["max_us"] = (float)stat.maxCycles / cyclesPerUs;
+        
+        JsonArray hist = entry.createNestedArray("hist");
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            hist.add(stat.buckets[b]);
+        }
     }
     
-    // Bottom-right corner
-    if (nextRow % 2 == 0) {
-        ledIndices[3] = nextRow * 9 + (ledX + 1);
-    } else {
-        ledIndices[3] = nextRow * 9 + (8 - ledX - 1);
+    JsonObject link = jsonDoc.createNestedObject("link");
+    link["rx_overflows"] = linkCounters.rxOverflows;
+    link["rx_errors"] = linkCounters.rxErrors;
+    link["crc_errors"] = linkCounters.crcErrors;
+    link["json_errors"] = linkCounters.jsonErrors;
+    link["line_overflows"] = linkCounters.lineOverflows;
+    
+    serializeJson(jsonDoc, Serial1);
+    Serial1.println();
+    
+    if (reset) {
+        memset(&linkCounters, 0, sizeof(linkCounters));
     }
+}
+
+void resetStats() {
+    portENTER_CRITICAL(&statsMux);
+    memset(perfStats, 0, sizeof(perfStats));
+    portEXIT_CRITICAL(&statsMux);
+    memset(&linkCounters, 0, sizeof(linkCounters));
+}
+
+// ==================== DEBUG LOG ====================
+
+void logPrintf(char level, const char* format, ...) {
+    /**
+     * Append one formatted line to the debug ring buffer. Use the LOG_x
+     * macros rather than calling this directly. Safe from any task, not
+     * from ISRs. If the line doesn't fit it is dropped and counted,
+     * never waited for.
+     */
+    char line[LOG_LINE_MAX];
+    int len = snprintf(line, sizeof(line), "[%c] ", level);
     
-    // Set all 4 corner LEDs to the specified color
-    for (int i = 0; i < 4; i++) {
-        if (ledIndices[i] >= 0 && ledIndices[i] < LED_COUNT) {
-            strip.setPixelColor(ledIndices[i], color);
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(line + len, sizeof(line) - len, format, args);
+    va_end(args);
+    
+    len = min(len + max(written, 0), (int)sizeof(line) - 2);
+    line[len++] = '\r';
+    line[len++] = '\n';
+    
+    portENTER_CRITICAL(&logMux);
+    if (logHead - logTail + len > LOG_BUFFER_SIZE) {
+        logDropped = logDropped + 1;
+    } else {
+        for (int i = 0; i < len; i++) {
+            logBuffer[(logHead + i) & (LOG_BUFFER_SIZE - 1)] = line[i];
         }
+        logHead = logHead + len;
     }
+    portEXIT_CRITICAL(&logMux);
 }
 
-void updateLEDs() {
-    strip.show();
-}
\ No newline at end of file
+void serviceLog() {
+    // Called from loop(): move what fits into the Serial TX FIFO
+    if (logDropped) {
+        portENTER_CRITICAL(&logMux);
+        uint32_t dropped = logDropped;
+        logDropped = 0;
+        portEXIT_CRITICAL(&logMux);
+        logPrintf('W', "%lu log lines dropped", (unsigned long)dropped);
+    }
+    
+    int room = Serial.availableForWrite();
+    while (room > 0 && logTail != logHead) {
+        uint32_t start = logTail & (LOG_BUFFER_SIZE - 1);
+        uint32_t chunk = min(min(logHead - logTail, (uint32_t)LOG_BUFFER_SIZE - start), (uint32_t)room);
+        Serial.write((const uint8_t*)logBuffer + start, chunk);
+        
+        portENTER_CRITICAL(&logMux);
+        logTail = logTail + chunk;
+        portEXIT_CRITICAL(&logMux);
+        room -= chunk;
+    }
+}
@@ -0,0 +1,17 @@
+/**
+ * Board geometry and scan defaults for the sensor controller
+ *
+ * Shared by main.cpp and the native benchmark in bench/, so the bench
+ * always times the LED grid and debounce window the board runs.
+ */
+
+#pragma once
+
+// Board and LED grid
+#define BOARD_SIZE          8
+#define LED_GRID_SIZE       9     // 9x9 physical LED grid
+#define LED_COUNT           81    // 9x9 grid (4 LEDs per square, shared corners)
+
+// Sensor debounce (set_sensor_reporting / set_config "debounce")
+#define SENSOR_DEBOUNCE     3     // Matching scans needed before a square changes
+#define SENSOR_DEBOUNCE_MAX 8     // Size of the scan history
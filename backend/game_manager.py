@@ -41,6 +41,7 @@ class GameManager:
         # Track the digital twin of the physical board
         self.physical_board_state: Optional[List[List[bool]]] = None
         self.last_known_state: Optional[List[List[bool]]] = None
+        self.pending_changes: Dict[int, bool] = {}  # square -> occupied, from delta events
         
         # Move history (for UI and analysis)
         self.move_history: List[chess.Move] = []
@@ -178,6 +179,49 @@ class GameManager:
                     is_occupied_now = new_state[rank][file]
                     changed_squares.append((square, is_occupied_now))
         
+        return self._infer_move(changed_squares, new_state)
+    
+    def apply_square_event(self, file: int, rank: int, occupied: bool) -> Optional[chess.Move]:
+        """
+        Incremental counterpart of parse_physical_move() for the sensor
+        controller's square_lifted / square_placed events.
+        
+        Changes since the last accepted position are kept per square, so a
+        piece lifted and put back cancels out without diffing full matrices.
+        
+        Args:
+            file: Sensor file index (0-7)
+            rank: Sensor rank index (0-7, same orientation as the matrix)
+            occupied: True for square_placed, False for square_lifted
+            
+        Returns:
+            chess.Move object if valid, None if still in progress or invalid
+        """
+        if self.last_known_state is None:
+            return None
+        
+        square = chess.square(file, 7 - rank)
+        if self.last_known_state[rank][file] == occupied:
+            self.pending_changes.pop(square, None)
+        else:
+            self.pending_changes[square] = occupied
+        
+        if not self.pending_changes:
+            return None
+        
+        new_state = [row[:] for row in self.last_known_state]
+        for changed_square, is_occupied in self.pending_changes.items():
+            new_state[7 - chess.square_rank(changed_square)][chess.square_file(changed_square)] = is_occupied
+        self.physical_board_state = new_state
+        
+        move = self._infer_move(list(self.pending_changes.items()), new_state)
+        if self.last_known_state is new_state:
+            self.pending_changes.clear()
+        return move
+    
+    def _infer_move(self, changed_squares: List[Tuple[int, bool]],
+                    new_state: List[List[bool]]) -> Optional[chess.Move]:
+        """Match a set of (square, occupied_now) changes against the legal moves"""
         # No changes detected
         if len(changed_squares) == 0:
             return None
@@ -3,12 +3,40 @@ Hardware Interface for the Smart Chess Board.
 Manages communication with ESP32 microcontrollers via UART.
 """
 import asyncio
+import base64
 import logging
-from typing import List, Dict, Any, Optional, Tuple
+from typing import Callable, List, Dict, Any, Optional, Tuple
 import json
 
+from uart_protocol import frame_data
+
 logger = logging.getLogger(__name__)
 
+# Palette indices for show_evaluation_colors (sensor firmware evalPalette)
+EVALUATION_CLASSES = {
+    "BRILLIANT": 1,
+    "EXCELLENT": 2,
+    "GOOD": 3,
+    "NEUTRAL": 4,
+    "INACCURACY": 5,
+    "MISTAKE": 6,
+    "BLUNDER": 7,
+}
+
+# Longest a tagged command may take before its done/error counts as lost
+# (homing both axes from the far corner is the slowest)
+COMMAND_TIMEOUT_S = 30.0
+
+# Position stream from the motor ESP32 while the gantry moves (set_telemetry)
+TELEMETRY_RATE_HZ = 50
+
+# Magnet mask for path points (bit n = magnet n + 1); the piece is carried on all four
+MAGNETS_ALL = 0x0F
+
+
+class CommandError(Exception):
+    """A controller answered a tagged command with an error reply"""
+
 
 class HardwareInterface:
     """
@@ -27,6 +55,22 @@ class HardwareInterface:
         # Simulated sensor state for testing
         self.mock_sensor_state: List[List[bool]] = [[False] * 8 for _ in range(8)]
         
+        # Every sensor controller merged: bit n = sensor n (0-63 the squares,
+        # rank * 8 + file; higher ones extension sensors, see sensor_base)
+        self.sensor_bits: int = 0
+        
+        # Tagged commands waiting for their done/error reply, by sequence ID
+        self._next_seq = 1
+        self._pending: Dict[int, asyncio.Future] = {}
+        
+        # Latest motor telemetry record, and callers waiting on a condition over it
+        self.gantry_telemetry: Optional[Dict[str, Any]] = None
+        self._telemetry_waiters: List[Tuple[Callable[[Dict[str, Any]], bool], asyncio.Future]] = []
+        
+        # Unsolicited messages from each controller, filled by the UART readers
+        self.sensor_messages: asyncio.Queue = asyncio.Queue()
+        self.motor_messages: asyncio.Queue = asyncio.Queue()
+        
     async def initialize(self):
         """Initialize hardware connections"""
         logger.info("Initializing hardware interface...")
@@ -36,24 +80,131 @@ class HardwareInterface:
         logger.warning("Running in MOCK MODE - no real hardware")
         
         await asyncio.sleep(0.1)  # Simulate initialization delay
+        await self._send_motor_command({"cmd": "set_telemetry", "rate": TELEMETRY_RATE_HZ})
+        # A warm-booted controller reports itself homed, so the first move skips homing
+        await self._send_motor_command({"cmd": "get_position"})
         logger.info("Hardware interface initialized (mock mode)")
     
     async def home_motors(self):
         """Home the H-Bot gantry to (0,0) using limit switch"""
         logger.info("Homing motors...")
         
-        # TODO: Send homing command to motor ESP32
-        # Command format: {"cmd": "home"}
-        
-        await self._send_motor_command({"cmd": "home"})
-        
-        # Wait for homing to complete
-        await asyncio.sleep(2.0)  # Simulate homing time
+        # Returns once the controller reports the gantry homed
+        await self._send_motor_command({"cmd": "home"}, wait=True)
         
         self.current_position = (0, 0)
         self.is_homed = True
         logger.info("Motors homed successfully")
     
+    def handle_motor_message(self, message: Dict[str, Any]):
+        """
+        Track state reported by the motor ESP32.
+        A stall means steps were lost, so the next move re-homes first.
+        """
+        if message.get("type") in ("ack", "done", "error"):
+            self.handle_reply(message)
+        elif message.get("type") == "position":
+            self.is_homed = message.get("homed", self.is_homed)
+        elif message.get("type") == "telemetry":
+            self._handle_telemetry(message)
+        elif message.get("type") == "stall":
+            logger.warning(f"Motor stall at ({message.get('x')}, {message.get('y')}), "
+                           f"motors {message.get('motors')} - will re-home before the next move")
+            self.is_homed = False
+    
+    def handle_sensor_message(self, message: Dict[str, Any]) -> Optional[Dict[str, Any]]:
+        """
+        Merge a sensor controller's report into sensor_bits.
+        Controllers report in their own sensor range (sensor_base), so any
+        number of them share one bitmask. Lift/place events come back as one
+        stream, {"sensor": n, "placed": bool, "time": ms}; "time" is the
+        sending controller's clock, so only compare it within a controller.
+        """
+        kind = message.get("type")
+        
+        if kind in ("ack", "done", "error"):
+            self.handle_reply(message)
+        elif kind == "sensor_update":
+            board = 0
+            for rank, row in enumerate(message["sensors"]):
+                for file, occupied in enumerate(row):
+                    board |= int(bool(occupied)) << (rank * 8 + file)
+            self.sensor_bits = (self.sensor_bits & ~0xFFFFFFFFFFFFFFFF) | board
+        elif kind == "sensor_bits":
+            first = message["first"]
+            self.sensor_bits &= ~(0xFFFFFFFFFFFFFFFF << first)
+            self.sensor_bits |= int(message["bits"], 16) << first
+        elif kind in ("square_placed", "square_lifted", "sensor_placed", "sensor_lifted"):
+            sensor = message["sensor"] if "sensor" in message else message["rank"] * 8 + message["file"]
+            placed = kind.endswith("placed")
+            if placed:
+                self.sensor_bits |= 1 << sensor
+            else:
+                self.sensor_bits &= ~(1 << sensor)
+            return {"sensor": sensor, "placed": placed, "time": message.get("time")}
+        
+        return None
+    
+    async def read_square_event(self) -> Dict[str, Any]:
+        """
+        Wait for the next lift/place event from the sensor controllers.
+        Replies and bitmask reports met on the way are merged as usual.
+        """
+        while True:
+            event = self.handle_sensor_message(await self.sensor_messages.get())
+            if event:
+                return event
+    
+    async def process_motor_messages(self):
+        """Dispatch the motor controller's messages until cancelled"""
+        while True:
+            self.handle_motor_message(await self.motor_messages.get())
+    
+    def _handle_telemetry(self, record: Dict[str, Any]):
+        """Keep the latest position record and release waiters it satisfies"""
+        self.gantry_telemetry = record
+        
+        waiting = []
+        for condition, future in self._telemetry_waiters:
+            if future.done():
+                continue
+            if condition(record):
+                future.set_result(record)
+            else:
+                waiting.append((condition, future))
+        self._telemetry_waiters = waiting
+    
+    async def wait_for_gantry(self, condition: Callable[[Dict[str, Any]], bool],
+                              timeout: float = COMMAND_TIMEOUT_S) -> Dict[str, Any]:
+        """
+        Wait until a telemetry record satisfies a condition, mid-move.
+        
+        For example, start the next highlight as soon as the gantry is past
+        the middle of the board, without waiting for it to stop:
+            await hardware.wait_for_gantry(lambda t: t["x"] > 200)
+        
+        Args:
+            condition: Called with each record (x, y, vx, vy, queued, moving, homed)
+            timeout: Seconds before asyncio.TimeoutError
+            
+        Returns:
+            The first record that satisfied the condition
+        """
+        if self.gantry_telemetry is not None and condition(self.gantry_telemetry):
+            return self.gantry_telemetry
+        
+        future = asyncio.get_running_loop().create_future()
+        self._telemetry_waiters.append((condition, future))
+        try:
+            return await asyncio.wait_for(future, timeout)
+        finally:
+            self._telemetry_waiters = [w for w in self._telemetry_waiters if w[1] is not future]
+    
+    async def _ensure_homed(self):
+        """Home only if the controller has lost its position"""
+        if not self.is_homed:
+            await self.home_motors()
+    
     async def shutdown(self):
         """Shutdown hardware gracefully"""
         logger.info("Shutting down hardware...")
@@ -119,20 +270,25 @@ class HardwareInterface:
         from_pos = self._square_to_position(from_square)
         to_pos = self._square_to_position(to_square)
         
-        # Move to source square
-        await self._move_gantry(from_pos)
-        
-        # Engage electromagnet
-        await self._send_motor_command({"cmd": "magnet_on"})
-        await asyncio.sleep(0.2)  # Wait for magnet to engage
+        await self._ensure_homed()
         
-        # Move to destination square
-        await self._move_gantry(to_pos)
+        # One path: travel empty to the source, carry to the destination,
+        # release there. The controller switches the magnets on arrival,
+        # waits for them to engage/release and limits the carry speed.
+        command = {
+            "cmd": "path",
+            "points": [
+                [from_pos[0], from_pos[1], 0],
+                [to_pos[0], to_pos[1], MAGNETS_ALL],
+                [to_pos[0], to_pos[1], 0],
+            ],
+            "speed": 5000  # mm/min - will come from settings
+        }
         
-        # Disengage electromagnet
-        await self._send_motor_command({"cmd": "magnet_off"})
-        await asyncio.sleep(0.1)
+        # Done is reported after the magnets have let go
+        await self._send_motor_command(command, wait=True)
         
+        self.current_position = to_pos
         logger.info("Move complete")
     
     async def _move_gantry(self, position: Tuple[float, float]):
@@ -143,9 +299,8 @@ class HardwareInterface:
             position: (x, y) in millimeters
         """
         x, y = position
+        await self._ensure_homed()
         
-        # TODO: Calculate stepper pulses needed
-        # Send movement command to motor ESP32
         command = {
             "cmd": "move_absolute",
             "x": x,
@@ -153,16 +308,36 @@ class HardwareInterface:
             "speed": 5000  # mm/min - will come from settings
         }
         
-        await self._send_motor_command(command)
-        
-        # Wait for movement to complete
-        # TODO: Implement proper movement completion detection
-        distance = ((x - self.current_position[0])**2 + (y - self.current_position[1])**2)**0.5
-        movement_time = distance / 83.3  # 5000 mm/min = 83.3 mm/s
-        await asyncio.sleep(movement_time)
+        # Returns once the gantry has reached the target
+        await self._send_motor_command(command, wait=True)
         
         self.current_position = (x, y)
     
+    async def move_along_path(self, waypoints: List[Tuple[float, float]]):
+        """
+        Move gantry through several absolute positions (in mm) as one motion.
+        The motor ESP32 queues every point and blends the corners, so only
+        the last waypoint decelerates to a stop.
+        
+        Args:
+            waypoints: [(x, y), ...] in millimeters
+        """
+        if not waypoints:
+            return
+        
+        await self._ensure_homed()
+        
+        command = {
+            "cmd": "path",
+            "points": [[x, y] for x, y in waypoints],
+            "speed": 5000  # mm/min - will come from settings
+        }
+        
+        # Done is reported after the last waypoint
+        await self._send_motor_command(command, wait=True)
+        
+        self.current_position = waypoints[-1]
+    
     def _square_to_position(self, square: Tuple[int, int]) -> Tuple[float, float]:
         """
         Convert chess square coordinates to physical position in mm.
@@ -219,23 +394,48 @@ class HardwareInterface:
         """
         logger.info(f"Displaying live evaluation for {len(evaluations)} possible moves")
         
-        # Build color map for each square
-        square_colors = []
+        # One palette class per square (0 = no overlay), as 64 hex digits.
+        # The firmware only redraws squares whose class changed.
+        classes = ["0"] * 64
         for square_num, eval_data in evaluations.items():
-            file = square_num % 8
-            rank = square_num // 8
-            color = eval_data['color']
-            
-            square_colors.append({
-                'square': [file, rank],
-                'color': color,
-                'classification': eval_data['classification']
-            })
+            classes[square_num] = "%x" % EVALUATION_CLASSES.get(eval_data['classification'], 0)
         
         command = {
             "cmd": "show_evaluation_colors",
-            "squares": square_colors,
-            "duration": 0  # Stay on until piece is placed or canceled
+            "classes": "".join(classes)  # Stays on until clear_evaluation
+        }
+        
+        await self._send_sensor_command(command)
+    
+    async def show_board_frame(self, colors: Dict[int, Tuple[int, int, int]], duration: int = 0):
+        """
+        Draw a complete board render in one set_frame command.
+        
+        Position, legal-move overlay and heatmap can be composed into one
+        frame here instead of sending a highlight per layer; the firmware
+        swaps it in with a single refresh.
+        
+        Args:
+            colors: Maps square (rank * 8 + file) -> (r, g, b); other squares stay dark
+            duration: ms until the frame clears itself, 0 = until replaced
+        """
+        palette: List[Tuple[int, int, int]] = []
+        indexes = [0] * 64
+        for square, rgb in colors.items():
+            if rgb not in palette:
+                if len(palette) == 15:
+                    raise ValueError("A square frame holds at most 15 colors")
+                palette.append(rgb)
+            indexes[square] = palette.index(rgb) + 1
+        
+        data, rle = frame_data(bytes(indexes), 1)
+        command = {
+            "cmd": "set_frame",
+            "format": "squares",
+            "palette": [list(rgb) for rgb in palette],
+            "rle": rle,
+            "data": base64.b64encode(data).decode(),
+            "duration": duration
         }
         
         await self._send_sensor_command(command)
@@ -266,8 +466,80 @@ class HardwareInterface:
         
         await self._send_sensor_command(command)
     
+    # ==================== Diagnostics ====================
+    
+    async def read_stats(self, reset: bool = False) -> Dict[str, Any]:
+        """
+        Scrape both controllers' performance counters (get_stats).
+        
+        Args:
+            reset: Restart the counters after reading, so each scrape covers one interval
+            
+        Returns:
+            {"sensor": stats, "motor": stats}, fields as in the firmware READMEs
+        """
+        command = {"cmd": "get_stats", "reset": reset}
+        return {
+            "sensor": await self._send_sensor_command(command),
+            "motor": await self._send_motor_command(command),
+        }
+    
+    async def read_config(self) -> Dict[str, Any]:
+        """
+        Read both controllers' stored settings (get_config).
+        
+        Returns:
+            {"sensor": config, "motor": config}, fields as in the firmware READMEs
+        """
+        command = {"cmd": "get_config"}
+        return {
+            "sensor": await self._send_sensor_command(command),
+            "motor": await self._send_motor_command(command),
+        }
+    
     # ==================== Communication Protocol ====================
     
+    def _tag_command(self, command: Dict[str, Any]) -> Tuple[Dict[str, Any], asyncio.Future]:
+        """
+        Give a command a sequence ID so the controller replies ack/done/error.
+        
+        Returns:
+            (tagged command, future resolved by handle_reply)
+        """
+        seq = self._next_seq
+        self._next_seq = self._next_seq % 65535 + 1  # 1-65535, 0 = untagged
+        
+        future = asyncio.get_running_loop().create_future()
+        self._pending[seq] = future
+        return {**command, "seq": seq}, future
+    
+    def handle_reply(self, message: Dict[str, Any]):
+        """
+        Complete the tagged command an ack/done/error reply belongs to.
+        An ack only confirms receipt; done resolves the command's future and
+        error fails it with CommandError.
+        """
+        future = self._pending.get(message.get("seq"))
+        if future is None or message.get("type") == "ack":
+            return
+        
+        del self._pending[message["seq"]]
+        if future.done():
+            return
+        if message.get("type") == "error":
+            future.set_exception(CommandError(message.get("message") or "Command failed"))
+        else:
+            future.set_result(message)
+    
+    async def _await_reply(self, seq: int, future: asyncio.Future) -> Dict[str, Any]:
+        """Wait for a tagged command's done reply (raises CommandError on error)"""
+        try:
+            return await asyncio.wait_for(future, COMMAND_TIMEOUT_S)
+        except asyncio.TimeoutError:
+            self._pending.pop(seq, None)
+            logger.error(f"No reply to command {seq} after {COMMAND_TIMEOUT_S}s")
+            raise
+    
     async def _send_sensor_command(self, command: Dict[str, Any]) -> Optional[Dict[str, Any]]:
         """
         Send a command to the sensor ESP32 and wait for response.
@@ -295,23 +567,35 @@ class HardwareInterface:
         
         return {"status": "ok"}
     
-    async def _send_motor_command(self, command: Dict[str, Any]) -> Optional[Dict[str, Any]]:
+    async def _send_motor_command(self, command: Dict[str, Any],
+                                  wait: bool = False) -> Optional[Dict[str, Any]]:
         """
         Send a command to the motor ESP32 and wait for response.
         
         Args:
             command: Command dictionary
+            wait: Tag the command and return only once the controller reports
+                  it done (for moves: target reached). Raises CommandError if
+                  it fails or is aborted.
             
         Returns:
             Response dictionary or None
         """
         # TODO: Implement actual UART communication
         
+        if wait:
+            command, future = self._tag_command(command)
+        
         logger.debug(f"Motor ESP32 <- {json.dumps(command)}")
         
         # Simulate response delay
         await asyncio.sleep(0.01)
         
+        if wait:
+            # Mock controller: every tagged command finishes immediately
+            self.handle_reply({"type": "done", "seq": command["seq"]})
+            return await self._await_reply(command["seq"], future)
+        
         return {"status": "ok"}
     
     def _get_initial_board_state(self) -> List[List[bool]]:
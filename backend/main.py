@@ -139,8 +139,15 @@ class ChessBoardController:
         self.state_machine.startup_complete()
         
         # Start background tasks
+        # Live sensor controllers stream lift/place events; mock mode polls the matrix
+        if self.hardware.sensor_esp is None:
+            sensor_task = asyncio.create_task(self._sensor_polling_loop(), name="sensor_polling")
+        else:
+            sensor_task = asyncio.create_task(self._sensor_event_loop(), name="sensor_events")
+        
         self.background_tasks = [
-            asyncio.create_task(self._sensor_polling_loop(), name="sensor_polling"),
+            sensor_task,
+            asyncio.create_task(self._motor_message_loop(), name="motor_messages"),
             asyncio.create_task(self._voice_listening_loop(), name="voice_listening"),
             asyncio.create_task(self._ui_update_loop(), name="ui_updates"),
             asyncio.create_task(self._button_monitoring_loop(), name="button_monitoring"),
@@ -205,6 +212,36 @@ class ChessBoardController:
         except asyncio.CancelledError:
             logger.info("Sensor polling loop cancelled")
     
+    async def _sensor_event_loop(self):
+        """
+        Feed the sensor controllers' square_lifted / square_placed events to
+        the game one square at a time instead of diffing full matrix scans.
+        """
+        logger.info("Starting sensor event loop")
+        
+        try:
+            while not self.shutdown_event.is_set():
+                event = await self.hardware.read_square_event()
+                
+                # Sensors past the 64 squares belong to extension boards
+                if event["sensor"] < 64:
+                    await self._handle_square_event(event)
+                
+        except asyncio.CancelledError:
+            logger.info("Sensor event loop cancelled")
+    
+    async def _motor_message_loop(self):
+        """
+        Route motor controller reports (replies, telemetry, stalls) to the
+        hardware interface.
+        """
+        logger.info("Starting motor message loop")
+        
+        try:
+            await self.hardware.process_motor_messages()
+        except asyncio.CancelledError:
+            logger.info("Motor message loop cancelled")
+    
     async def _voice_listening_loop(self):
         """
         Continuously listen for voice commands using Vosk.
@@ -279,30 +316,52 @@ class ChessBoardController:
             if self.state_machine.current_state.id == 'human_turn':
                 # Validate the move
                 move = self.game_manager.parse_physical_move(new_board_state)
-                
-                if move and self.game_manager.is_legal_move(move):
-                    logger.info(f"Legal move detected: {move}")
-                    self.game_manager.make_move(move)
-                    
-                    # Update LEDs to show the move
-                    await self.hardware.highlight_move(move)
-                    
-                    # Transition to robot's turn if applicable
-                    self.state_machine.move_detected()
-                    
-                    # If it's robot's turn, start thinking
-                    if self.state_machine.current_state.id == 'robot_thinking':
-                        await self._robot_think()
-                else:
-                    logger.warning(f"Illegal move detected: {move}")
-                    # Flash LEDs red to indicate error
-                    await self.hardware.flash_error()
-                    self.state_machine.error_occurred()
+                await self._handle_detected_move(move)
                     
         except Exception as e:
             logger.error(f"Error handling board change: {e}")
             self.state_machine.error_occurred()
     
+    async def _handle_square_event(self, event):
+        """
+        Process a single square lifted / placed on the physical board.
+        Most events are a move still in progress and yield no move yet.
+        """
+        try:
+            if self.state_machine.current_state.id == 'human_turn':
+                sensor = event["sensor"]
+                move = self.game_manager.apply_square_event(sensor % 8, sensor // 8, event["placed"])
+                
+                if move:
+                    await self._handle_detected_move(move)
+                    
+        except Exception as e:
+            logger.error(f"Error handling square event: {e}")
+            self.state_machine.error_occurred()
+    
+    async def _handle_detected_move(self, move):
+        """
+        Play a move read off the physical board, or flag it if illegal.
+        """
+        if move and self.game_manager.is_legal_move(move):
+            logger.info(f"Legal move detected: {move}")
+            self.game_manager.make_move(move)
+            
+            # Update LEDs to show the move
+            await self.hardware.highlight_move(move)
+            
+            # Transition to robot's turn if applicable
+            self.state_machine.move_detected()
+            
+            # If it's robot's turn, start thinking
+            if self.state_machine.current_state.id == 'robot_thinking':
+                await self._robot_think()
+        else:
+            logger.warning(f"Illegal move detected: {move}")
+            # Flash LEDs red to indicate error
+            await self.hardware.flash_error()
+            self.state_machine.error_occurred()
+    
     async def _robot_think(self):
         """
         Calculate the robot's next move using the chess engine.
@@ -415,6 +474,9 @@ class ChessBoardController:
         # Create game manager with mode
         self.game_manager = GameManager(mode=mode, settings=settings)
         
+        # Square events only carry changes, so take the starting position from a full scan
+        self.game_manager.has_board_changed(await self.hardware.read_sensor_matrix())
+        
         # Create game record in database
         if self.db_manager:
             self.game_manager.game_id = await self.db_manager.create_game(
@@ -0,0 +1,374 @@
+"""
+Binary UART protocol for the ESP32 controllers.
+
+Frame layout (see the BINARY PROTOCOL section of each firmware):
+    [SYNC][LEN][OPCODE][PAYLOAD...][CRC16 lo][CRC16 hi]
+
+LEN counts OPCODE + PAYLOAD, CRC16-CCITT (init 0xFFFF) covers LEN..PAYLOAD.
+Multi-byte fields are little-endian, positions are in 0.1 mm.
+JSON stays available: the controllers switch their replies to binary after
+{"cmd": "set_protocol", "mode": "binary"}.
+
+A command wrapped in OP_SEQ (see tag_frame) is answered with OP_ACK, then
+exactly one OP_DONE or OP_ERROR carrying the same sequence ID.
+"""
+import logging
+import os
+import struct
+import time
+from typing import Any, Dict, Iterator, List, Optional, Sequence, Tuple
+
+logger = logging.getLogger(__name__)
+
+FRAME_SYNC = 0xA5
+FRAME_MAX_LEN = 255
+
+DEFAULT_BAUD = 115200
+BAUD_CANDIDATES = (2000000, 921600, 460800, 230400)
+BAUD_CONFIRM_S = 1.0        # Matches BAUD_CONFIRM_MS in the firmware
+BAUD_TEST_BYTES = 200
+
+# Pi -> controllers
+OP_SET_PROTOCOL = 0x01
+OP_SET_BAUD = 0x02
+OP_BAUD_TEST = 0x03
+OP_SEQ = 0x04
+OP_HOME = 0x10
+OP_MOVE_ABSOLUTE = 0x11
+OP_MOVE_RELATIVE = 0x12
+OP_PATH = 0x13
+OP_STOP = 0x14
+OP_GET_POSITION = 0x15
+OP_MAGNET = 0x16
+OP_SET_FAN = 0x17
+OP_SET_STALL = 0x18
+OP_SET_CURRENT = 0x19
+OP_SET_TELEMETRY = 0x1A
+OP_MAGNET_PATH = 0x1B
+OP_SET_MAGNET_POWER = 0x1C
+OP_SCAN_SENSORS = 0x20
+OP_HIGHLIGHT = 0x21
+OP_FLASH_ALL = 0x22
+OP_LEDS_OFF = 0x23
+OP_SET_BRIGHTNESS = 0x24
+OP_SET_REPORTING = 0x25
+OP_SET_LED_FPS = 0x26
+OP_SHOW_EVALUATION = 0x27
+OP_CLEAR_EVALUATION = 0x28
+OP_SET_FRAME = 0x29
+OP_CLEAR_FRAME = 0x2A
+
+# Controllers -> Pi
+OP_STATUS = 0x80
+OP_POSITION = 0x81
+OP_STALL = 0x82
+OP_ACK = 0x83
+OP_DONE = 0x84
+OP_ERROR = 0x85
+OP_TELEMETRY = 0x86
+OP_SENSOR_UPDATE = 0x90
+OP_BUTTON = 0x91
+OP_ENCODER = 0x92
+OP_SQUARE_EVENT = 0x93
+OP_SENSOR_BITS = 0x94
+OP_SENSOR_EVENT = 0x95
+
+
+def crc16(data: bytes, crc: int = 0xFFFF) -> int:
+    """CRC16-CCITT (poly 0x1021), matching crc16Update() in the firmware"""
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def encode_frame(opcode: int, payload: bytes = b"") -> bytes:
+    """
+    Build a complete frame.
+
+    Args:
+        opcode: 1-byte opcode (OP_*)
+        payload: Fixed-layout payload for that opcode
+
+    Returns:
+        Frame bytes ready to write to the serial port
+    """
+    if len(payload) > FRAME_MAX_LEN - 1:
+        raise ValueError(f"Payload too long: {len(payload)} bytes")
+
+    body = bytes([len(payload) + 1, opcode]) + payload
+    return bytes([FRAME_SYNC]) + body + struct.pack("<H", crc16(body))
+
+
+def tag_frame(frame: bytes, seq: int) -> bytes:
+    """
+    Wrap a complete command frame in OP_SEQ so the controller acknowledges it.
+
+    Args:
+        frame: Frame from encode_frame() or one of the encode_* helpers
+        seq: Sequence ID, 1-65535 (0 means untagged)
+
+    Returns:
+        Frame bytes ready to write to the serial port
+    """
+    return encode_frame(OP_SEQ, struct.pack("<H", seq) + frame[2:-2])
+
+
+def _mm(value: float) -> int:
+    """Convert mm to the protocol's 0.1 mm integer units"""
+    return int(round(value * 10))
+
+
+def encode_move_absolute(x: float, y: float, speed: int = 0) -> bytes:
+    """Move to (x, y) mm; speed 0 keeps the controller's current speed"""
+    return encode_frame(OP_MOVE_ABSOLUTE, struct.pack("<hhH", _mm(x), _mm(y), speed))
+
+
+def encode_path(points: List[Tuple[float, float]], speed: int = 0) -> bytes:
+    """Queue several (x, y) mm waypoints as one blended motion"""
+    payload = struct.pack("<H", speed)
+    for x, y in points:
+        payload += struct.pack("<hh", _mm(x), _mm(y))
+    return encode_frame(OP_PATH, payload)
+
+
+MAGNETS_ALL = 0x0F          # Magnet mask: bit n = magnet n + 1
+MAGNETS_KEEP = 0xFF
+
+
+def encode_magnet_path(points: List[Tuple[float, float, int]], speed: int = 0) -> bytes:
+    """Queue (x, y, magnets) waypoints; the magnets are on while travelling to the point"""
+    payload = struct.pack("<H", speed)
+    for x, y, magnets in points:
+        payload += struct.pack("<hhB", _mm(x), _mm(y), magnets)
+    return encode_frame(OP_MAGNET_PATH, payload)
+
+
+def encode_highlight(squares: List[Tuple[int, int]], color: List[int], duration: int = 0) -> bytes:
+    """Highlight (file, rank) squares in an RGB color"""
+    payload = struct.pack("<BBBH", color[0], color[1], color[2], duration)
+    payload += bytes(rank * 8 + file for file, rank in squares)
+    return encode_frame(OP_HIGHLIGHT, payload)
+
+
+def encode_evaluation(classes: List[int]) -> bytes:
+    """Pack 64 palette classes (square = rank * 8 + file) into 4 bits each"""
+    payload = bytes((classes[i] & 0x0F) | ((classes[i + 1] & 0x0F) << 4) for i in range(0, 64, 2))
+    return encode_frame(OP_SHOW_EVALUATION, payload)
+
+
+FRAME_SQUARES = 0x01         # set_frame flags
+FRAME_RLE = 0x02
+
+
+def pack_runs(data: bytes, unit: int) -> bytes:
+    """Run-length pack 'unit'-byte values as set_frame's RLE: [count][value] runs"""
+    runs = bytearray()
+    i = 0
+    while i < len(data):
+        value = data[i:i + unit]
+        count = 1
+        while count < 255 and data[i + count * unit:i + (count + 1) * unit] == value:
+            count += 1
+        runs += bytes([count]) + value
+        i += count * unit
+    return bytes(runs)
+
+
+def frame_data(data: bytes, unit: int) -> Tuple[bytes, bool]:
+    """Pick the smaller of raw and RLE-packed frame data: (data, rle)"""
+    runs = pack_runs(data, unit)
+    return (runs, True) if len(runs) < len(data) else (data, False)
+
+
+def encode_led_frame(colors: Sequence[Tuple[int, int, int]], duration: int = 0) -> bytes:
+    """Show 81 (r, g, b) LED colors in grid order (y * 9 + x) as one frame"""
+    data, rle = frame_data(bytes(c for rgb in colors for c in rgb), 3)
+    payload = struct.pack("<BH", FRAME_RLE if rle else 0, duration) + data
+    return encode_frame(OP_SET_FRAME, payload)
+
+
+def encode_square_frame(indexes: Sequence[int], palette: Sequence[Tuple[int, int, int]],
+                        duration: int = 0) -> bytes:
+    """Show 64 palette indexes (square = rank * 8 + file, 0 = off); palette colors indexes 1.."""
+    data, rle = frame_data(bytes(indexes), 1)
+    flags = FRAME_SQUARES | (FRAME_RLE if rle else 0)
+    payload = struct.pack("<BHB", flags, duration, len(palette))
+    payload += bytes(c for rgb in palette for c in rgb) + data
+    return encode_frame(OP_SET_FRAME, payload)
+
+
+def decode_sensor_update(payload: bytes) -> List[List[bool]]:
+    """Expand an 8-byte sensor bitmap (byte = rank, bit = file) to an 8x8 matrix"""
+    return [[bool(payload[rank] & (1 << file)) for file in range(8)] for rank in range(8)]
+
+
+def decode_square_event(payload: bytes) -> Tuple[int, int, bool, int]:
+    """Decode a square_lifted/square_placed event into (file, rank, placed, time_ms)"""
+    square, placed, timestamp = struct.unpack("<BBI", payload[:6])
+    return (square % 8, square // 8, bool(placed), timestamp)
+
+
+def decode_sensor_bits(payload: bytes) -> Tuple[int, int]:
+    """Decode extension sensor bits into (first, bits), sensor first + n = bit n"""
+    first, bits = struct.unpack("<HQ", payload[:10])
+    return (first, bits)
+
+
+def decode_sensor_event(payload: bytes) -> Tuple[int, bool, int]:
+    """Decode a sensor_lifted/sensor_placed event into (sensor, placed, time_ms)"""
+    sensor, placed, timestamp = struct.unpack("<HBI", payload[:7])
+    return (sensor, bool(placed), timestamp)
+
+
+def decode_position(payload: bytes) -> Tuple[float, float, bool]:
+    """Decode a position report into (x_mm, y_mm, homed)"""
+    x, y, homed = struct.unpack("<hhB", payload[:5])
+    return (x / 10.0, y / 10.0, bool(homed))
+
+
+def decode_telemetry(payload: bytes) -> Dict[str, Any]:
+    """Decode a telemetry record into the same fields as the JSON form"""
+    time_ms, x, y, vx, vy, queued, flags = struct.unpack("<IhhhhBB", payload[:14])
+    return {
+        "time": time_ms,
+        "x": x / 10.0,
+        "y": y / 10.0,
+        "vx": float(vx),
+        "vy": float(vy),
+        "queued": queued,
+        "moving": bool(flags & 0x01),
+        "homed": bool(flags & 0x02),
+    }
+
+
+def decode_stall(payload: bytes) -> Tuple[float, float, List[str]]:
+    """Decode a stall event into (x_mm, y_mm, stalled motors)"""
+    x, y, motors = struct.unpack("<hhB", payload[:5])
+    return (x / 10.0, y / 10.0, [name for bit, name in ((1, "A"), (2, "B")) if motors & bit])
+
+
+def decode_reply(payload: bytes) -> Tuple[int, Optional[str]]:
+    """Decode an ack/done/error reply into (seq, message)"""
+    seq = struct.unpack("<H", payload[:2])[0]
+    return (seq, payload[2:].decode() or None)
+
+
+def decode_status(payload: bytes) -> Tuple[str, Optional[str]]:
+    """Decode a status report into (status, message)"""
+    status, _, message = payload.partition(b"\0")
+    return (status.decode(), message.decode() or None)
+
+
+class FrameDecoder:
+    """
+    Incremental frame parser for bytes read from a controller.
+    Bytes outside of frames (JSON lines, debug text) are returned separately
+    so both protocols can share one serial port.
+    """
+
+    def __init__(self):
+        self._buffer = bytearray()
+        self.crc_errors = 0
+
+    def feed(self, data: bytes) -> Iterator[Tuple[Optional[int], bytes]]:
+        """
+        Add received bytes and yield what is complete.
+
+        Yields:
+            (opcode, payload) for each valid frame, or
+            (None, text) for non-frame bytes up to the next frame start
+        """
+        self._buffer.extend(data)
+
+        while self._buffer:
+            start = self._buffer.find(FRAME_SYNC)
+            if start != 0:
+                end = len(self._buffer) if start < 0 else start
+                yield (None, bytes(self._buffer[:end]))
+                del self._buffer[:end]
+                continue
+
+            if len(self._buffer) < 2:
+                return
+
+            length = self._buffer[1]
+            total = 2 + length + 2
+            if len(self._buffer) < total:
+                return
+
+            body = bytes(self._buffer[1:2 + length])
+            received = struct.unpack("<H", self._buffer[2 + length:total])[0]
+
+            if length == 0 or crc16(body) != received:
+                # Not a frame after all: skip the sync byte and resync
+                self.crc_errors += 1
+                yield (None, bytes(self._buffer[:1]))
+                del self._buffer[:1]
+                continue
+
+            del self._buffer[:total]
+            yield (body[1], body[2:])
+
+
+def _read_frame(port: Any, decoder: FrameDecoder, opcode: int, timeout: float) -> Optional[bytes]:
+    """Read until a frame with the given opcode arrives or the timeout expires"""
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        data = port.read(port.in_waiting or 1)
+        for frame_opcode, payload in decoder.feed(data):
+            if frame_opcode == opcode:
+                return payload
+    return None
+
+
+def _try_baud(port: Any, baud: int) -> bool:
+    """Run one set_baud / test burst / confirm round; True if the rate sticks"""
+    decoder = FrameDecoder()
+    port.reset_input_buffer()
+    port.write(encode_frame(OP_SET_BAUD, struct.pack("<I", baud)))
+
+    # The acknowledgement arrives at the old rate
+    status = _read_frame(port, decoder, OP_STATUS, BAUD_CONFIRM_S)
+    if status is None or decode_status(status) != ("baud", str(baud)):
+        return False
+
+    port.baudrate = baud
+    pattern = os.urandom(BAUD_TEST_BYTES)
+    port.write(encode_frame(OP_BAUD_TEST, pattern))
+    if _read_frame(port, decoder, OP_BAUD_TEST, BAUD_CONFIRM_S / 2) != pattern:
+        return False
+
+    port.write(encode_frame(OP_BAUD_TEST))
+    status = _read_frame(port, decoder, OP_STATUS, BAUD_CONFIRM_S / 2)
+    return status is not None and decode_status(status)[0] == "baud"
+
+
+def negotiate_baud(port: Any, candidates: Sequence[int] = BAUD_CANDIDATES) -> int:
+    """
+    Raise the link to the fastest rate that passes a CRC-checked test burst.
+
+    Expects a pyserial-compatible port opened at DEFAULT_BAUD with the
+    controller already in binary mode. After a failed attempt the controller
+    reverts on its own within BAUD_CONFIRM_S, so we wait for that before
+    trying the next rate.
+
+    Args:
+        port: Open serial port (read, write, in_waiting, baudrate)
+        candidates: Rates to try, fastest first
+
+    Returns:
+        The baud rate the link ended up at
+    """
+    for baud in candidates:
+        if _try_baud(port, baud):
+            logger.info(f"UART link running at {baud} baud")
+            return baud
+
+        logger.warning(f"UART link failed at {baud} baud, falling back")
+        time.sleep(BAUD_CONFIRM_S)
+        port.baudrate = DEFAULT_BAUD
+
+    return DEFAULT_BAUD